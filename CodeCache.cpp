@@ -0,0 +1,165 @@
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+#include <thread>
+#include <vector>
+#include "CodeCache.h"
+
+// Part of every key. Change it when the image format changes in a way
+// that the compiler's own identity would not show.
+const char * CODE_CACHE_VERSION = "1";
+
+// FNV-1a, 64 bit.
+static unsigned long long Hash(const std::string & text)
+{
+	unsigned long long hash = 14695981039346656037ULL;
+	for (unsigned char c : text)
+	{
+		hash ^= c;
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+
+static bool MakeDirectory(const std::string & directory)
+{
+	return mkdir(directory.c_str(), 0755) == 0 || errno == EEXIST;
+}
+
+CodeCacheClass::CodeCacheClass(const std::string & directory)
+	: mDirectory(directory)
+{
+	if (mDirectory.empty())
+	{
+		const char * cache = getenv("XDG_CACHE_HOME");
+		const char * home = getenv("HOME");
+		std::string base;
+		if (cache && *cache)
+		{
+			base = cache;
+		}
+		else if (home && *home)
+		{
+			base = std::string(home) + "/.cache";
+		}
+		if (!base.empty() && MakeDirectory(base))
+		{
+			mDirectory = base + "/simple-compiler";
+		}
+	}
+	if (!mDirectory.empty() && !MakeDirectory(mDirectory))
+	{
+		mDirectory.clear();
+	}
+
+	// A rebuilt compiler is a different file, or the same one changed.
+	struct stat compiler;
+	if (stat("/proc/self/exe", &compiler) != 0)
+	{
+		mDirectory.clear();
+		return;
+	}
+	std::ostringstream identity;
+	identity << CODE_CACHE_VERSION << ' ' << compiler.st_dev << ' ' << compiler.st_ino
+		<< ' ' << compiler.st_size << ' ' << compiler.st_mtim.tv_sec
+		<< '.' << compiler.st_mtim.tv_nsec;
+	mCompiler = identity.str();
+}
+
+bool CodeCacheClass::ReadSource(const std::string & filename, std::string & source) const
+{
+	std::ifstream file(filename.c_str(), std::ios::binary);
+	if (!file)
+	{
+		return false;
+	}
+	std::ostringstream text;
+	text << file.rdbuf();
+	source = text.str();
+	return true;
+}
+
+std::string CodeCacheClass::EntryName(const std::string & source) const
+{
+	char name[32];
+	snprintf(name, sizeof(name), "%016llx", Hash(mCompiler + '\0' + source));
+	return mDirectory + "/" + name + ".code";
+}
+
+// An entry is the source's length and text, then the image from
+// InstructionsClass::SaveCode.
+bool CodeCacheClass::Load(const std::string & filename, InstructionsClass & machineCode)
+{
+	std::string source;
+	if (mDirectory.empty() || !ReadSource(filename, source))
+	{
+		return false;
+	}
+	int file = open(EntryName(source).c_str(), O_RDONLY | O_CLOEXEC);
+	if (file == -1)
+	{
+		return false;
+	}
+	struct stat entry;
+	void * memory = MAP_FAILED;
+	if (fstat(file, &entry) == 0 && entry.st_size > 0)
+	{
+		memory = mmap(NULL, (size_t)entry.st_size, PROT_READ, MAP_PRIVATE, file, 0);
+	}
+	close(file);
+	if (memory == MAP_FAILED)
+	{
+		return false;
+	}
+
+	const unsigned char * bytes = (const unsigned char *)memory;
+	size_t size = (size_t)entry.st_size;
+	unsigned int length;
+	bool loaded = size >= sizeof(length);
+	if (loaded)
+	{
+		memcpy(&length, bytes, sizeof(length));
+		size_t header = sizeof(length) + (size_t)length;
+		loaded = length == source.size() && size >= header
+			&& memcmp(bytes + sizeof(length), source.data(), length) == 0
+			&& machineCode.LoadCode(bytes + header, size - header);
+	}
+	munmap(memory, size);
+	return loaded;
+}
+
+// Written under a name of its own and renamed into place, so that
+// other runs never see half an entry. The name is the process's and
+// the thread's, since a batch stores entries from many threads.
+void CodeCacheClass::Store(const std::string & filename, const InstructionsClass & machineCode)
+{
+	std::string source;
+	if (mDirectory.empty() || !ReadSource(filename, source))
+	{
+		return;
+	}
+	std::vector<unsigned char> image;
+	machineCode.SaveCode(image);
+	unsigned int length = (unsigned int)source.size();
+
+	std::string entry = EntryName(source);
+	std::ostringstream name;
+	name << entry << "." << getpid() << "." << std::this_thread::get_id();
+	std::string temporary = name.str();
+	std::ofstream file(temporary.c_str(), std::ios::binary | std::ios::trunc);
+	file.write((const char *)&length, sizeof(length));
+	file.write(source.data(), source.size());
+	file.write((const char *)image.data(), image.size());
+	file.close();
+	if (!file || rename(temporary.c_str(), entry.c_str()) != 0)
+	{
+		remove(temporary.c_str());
+	}
+}
@@ -0,0 +1,29 @@
+#pragma once
+#include <string>
+#include "Instructions.h"
+
+// Machine code kept on disk between runs, so that a program that has
+// not changed skips scanning, parsing and code generation. An entry is
+// found by a hash of the source text and of the compiler that coded it,
+// and holds the source itself to rule out collisions. The cache is only
+// ever a shortcut: anything wrong with it is a miss, never an error.
+class CodeCacheClass
+{
+public:
+	// The directory is made if it is missing. By default it is
+	// simple-compiler under $XDG_CACHE_HOME, or under ~/.cache.
+	CodeCacheClass(const std::string & directory = "");
+	// True when the code for filename was found and machineCode now
+	// holds it, ready to Execute.
+	bool Load(const std::string & filename, InstructionsClass & machineCode);
+	// After machineCode.Finish. Load and Store may be called from several
+	// threads at once.
+	void Store(const std::string & filename, const InstructionsClass & machineCode);
+
+private:
+	bool ReadSource(const std::string & filename, std::string & source) const;
+	std::string EntryName(const std::string & source) const;
+
+	std::string mDirectory; // empty when there is nowhere to keep entries
+	std::string mCompiler;  // what identifies this build of the compiler
+};
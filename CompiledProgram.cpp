@@ -0,0 +1,107 @@
+#include "CompiledProgram.h"
+#include "Scanner.h"
+#include "Symbol.h"
+#include "Node.h"
+#include "Parser.h"
+#include "Optimizer.h"
+#include "Passes.h"
+#include <memory>
+
+bool CompileOptions::IsDefault() const
+{
+	return !throughIR && peephole && relaxBranches && unrollBudget < 0 && !statistics;
+}
+
+// Steps 1 to 5 of running a program: from source to finished machine code.
+// A source that cannot be read, parsed or coded throws std::runtime_error.
+static void Compile(const std::string & filename, InstructionsClass & machineCode,
+	const CompileOptions & options)
+{
+	// 1) build the scanner, symbol table, and parser
+	ScannerClass scanner(filename);
+	SymbolTableClass symbolTable;
+	ParserClass parser(&scanner, &symbolTable);
+
+	// 2) parse → AST
+	// Held so that it goes even when a later step throws, say for an
+	// undeclared variable.
+	std::unique_ptr<StartNode> root(parser.Start());
+	machineCode.SetVariableCount(parser.GetDeclarationCount());
+
+	// 3) propagate and fold constants, prune dead branches, remove dead
+	//    stores, hoist loop invariants and pick the loops to unroll
+	OptimizerClass optimizer;
+	if (options.unrollBudget >= 0)
+	{
+		optimizer.SetUnrollBudget(options.unrollBudget);
+	}
+	optimizer.Optimize(root.get());
+	if (options.statistics)
+	{
+		optimizer.PrintStatistics();
+	}
+
+	// 4) generate bytecodes, straight from the AST or through the SSA IR
+	machineCode.SetPeephole(options.peephole);
+	machineCode.SetBranchRelaxation(options.relaxBranches);
+	if (options.throughIR)
+	{
+		IRFunctionClass function;
+		IRBuilderClass builder(&function);
+		root->BuildIR(builder);
+		PassManagerClass passes;
+		passes.AddStandardPasses();
+		passes.Run(function);
+		// function.Print();
+		if (options.statistics)
+		{
+			passes.PrintStatistics();
+		}
+		function.Lower(machineCode);
+	}
+	else
+	{
+		machineCode.SetRegisterMode(true); // false for the plain stack machine
+		root->Code(machineCode);
+	}
+	machineCode.Finish();
+	// machineCode.PrintAllMachineCodes();
+	if (options.statistics)
+	{
+		machineCode.PrintPeepholeStatistics();
+	}
+
+	// 5) tear down the AST; the machine code does not need it
+	root.reset();
+}
+
+CompiledProgramClass::CompiledProgramClass(const std::string & filename, CodeCacheClass * cache,
+	OutputBufferClass * output, const CompileOptions & options)
+	: mMachineCode(output)
+{
+	if (!options.IsDefault())
+	{
+		cache = NULL;
+	}
+	if (!cache || !cache->Load(filename, mMachineCode))
+	{
+		Compile(filename, mMachineCode, options);
+		if (cache)
+		{
+			cache->Store(filename, mMachineCode);
+		}
+	}
+	mMachineCode.MakeExecutable();
+}
+
+void CompiledProgramClass::Execute()
+{
+	ExecutionContext * context = mMachineCode.NewContext();
+	mMachineCode.Execute(context);
+	mMachineCode.FreeContext(context);
+}
+
+InstructionsClass & CompiledProgramClass::GetMachineCode()
+{
+	return mMachineCode;
+}
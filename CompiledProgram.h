@@ -0,0 +1,40 @@
+#pragma once
+#include <string>
+#include "Instructions.h"
+#include "CodeCache.h"
+
+// How a program is compiled. The code cache only holds programs compiled
+// with the defaults, and is passed by when statistics are wanted.
+struct CompileOptions
+{
+	bool throughIR = false;    // code from the SSA IR instead of from the AST
+	bool peephole = true;      // see InstructionsClass::SetPeephole
+	bool relaxBranches = true; // see InstructionsClass::SetBranchRelaxation
+	int unrollBudget = -1;     // see OptimizerClass::SetUnrollBudget; -1 keeps its own
+	bool statistics = false;   // print what each pass did, on standard output
+	bool IsDefault() const;
+};
+
+// A program compiled once and executed any number of times, say in a
+// benchmark loop or once per request. Each Execute runs main on a data
+// segment of its own, so every variable starts at zero as in a fresh
+// process, and nothing is scanned, parsed or coded again. Executes may
+// run on several threads at once; each buffers its own output.
+class CompiledProgramClass
+{
+public:
+	// Compiles filename, or takes its code from cache when it is there
+	// and stores it there when it was not.
+	CompiledProgramClass(const std::string & filename, CodeCacheClass * cache = NULL,
+		OutputBufferClass * output = &gStandardOutput,
+		const CompileOptions & options = CompileOptions());
+	CompiledProgramClass(const CompiledProgramClass &) = delete;
+	CompiledProgramClass & operator=(const CompiledProgramClass &) = delete;
+	void Execute();
+	// For what else can be done with finished code, like WriteExecutable.
+	// It is executable already, so nothing more can be coded into it.
+	InstructionsClass & GetMachineCode();
+
+private:
+	InstructionsClass mMachineCode;
+};
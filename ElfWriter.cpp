@@ -0,0 +1,103 @@
+#include <elf.h>
+#include <sys/stat.h>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <cstdlib>
+#include "ElfWriter.h"
+
+const size_t PAGE_SIZE_BYTES = 4096;
+const int SEGMENT_COUNT = 2;
+
+static size_t RoundUp(size_t value, size_t alignment)
+{
+	return (value + alignment - 1) / alignment * alignment;
+}
+
+ElfWriterClass::ElfWriterClass(size_t textSize, size_t dataSize, size_t zeroSize)
+	: mTextSize(textSize), mDataSize(dataSize), mZeroSize(zeroSize)
+{
+	mTextOffset = sizeof(Elf64_Ehdr) + SEGMENT_COUNT * sizeof(Elf64_Phdr);
+	mDataOffset = RoundUp(mTextOffset + mTextSize, PAGE_SIZE_BYTES);
+}
+
+// The text segment maps the file from its start, headers included, so
+// each segment's address is the base plus its place in the file.
+unsigned long long ElfWriterClass::GetTextAddress() const
+{
+	return EXECUTABLE_BASE + mTextOffset;
+}
+
+unsigned long long ElfWriterClass::GetDataAddress() const
+{
+	return EXECUTABLE_BASE + mDataOffset;
+}
+
+void ElfWriterClass::Write(const std::string & filename, const std::vector<unsigned char> & text,
+	size_t entry, const std::vector<unsigned char> & data) const
+{
+	if (text.size() != mTextSize || data.size() != mDataSize || entry >= mTextSize)
+	{
+		std::cerr << "Error.  The executable's segments do not match their sizes." << std::endl;
+		exit(1);
+	}
+
+	Elf64_Ehdr header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.e_ident, ELFMAG, SELFMAG);
+	header.e_ident[EI_CLASS] = ELFCLASS64;
+	header.e_ident[EI_DATA] = ELFDATA2LSB;
+	header.e_ident[EI_VERSION] = EV_CURRENT;
+	header.e_ident[EI_OSABI] = ELFOSABI_SYSV;
+	header.e_type = ET_EXEC;
+	header.e_machine = EM_X86_64;
+	header.e_version = EV_CURRENT;
+	header.e_entry = GetTextAddress() + entry;
+	header.e_phoff = sizeof(Elf64_Ehdr);
+	header.e_ehsize = sizeof(Elf64_Ehdr);
+	header.e_phentsize = sizeof(Elf64_Phdr);
+	header.e_phnum = SEGMENT_COUNT;
+
+	Elf64_Phdr segments[SEGMENT_COUNT];
+	memset(segments, 0, sizeof(segments));
+	segments[0].p_type = PT_LOAD;
+	segments[0].p_flags = PF_R | PF_X;
+	segments[0].p_offset = 0;
+	segments[0].p_vaddr = EXECUTABLE_BASE;
+	segments[0].p_paddr = EXECUTABLE_BASE;
+	segments[0].p_filesz = mTextOffset + mTextSize;
+	segments[0].p_memsz = mTextOffset + mTextSize;
+	segments[0].p_align = PAGE_SIZE_BYTES;
+	segments[1].p_type = PT_LOAD;
+	segments[1].p_flags = PF_R | PF_W;
+	segments[1].p_offset = mDataOffset;
+	segments[1].p_vaddr = GetDataAddress();
+	segments[1].p_paddr = GetDataAddress();
+	segments[1].p_filesz = mDataSize;
+	segments[1].p_memsz = mDataSize + mZeroSize;
+	segments[1].p_align = PAGE_SIZE_BYTES;
+
+	std::ofstream file(filename.c_str(), std::ios::binary | std::ios::trunc);
+	if (!file)
+	{
+		std::cerr << "Error.  Could not open " << filename << " for writing." << std::endl;
+		exit(1);
+	}
+	file.write((const char *)&header, sizeof(header));
+	file.write((const char *)segments, sizeof(segments));
+	file.write((const char *)text.data(), text.size());
+	std::vector<char> padding(mDataOffset - (mTextOffset + mTextSize), 0);
+	file.write(padding.data(), padding.size());
+	file.write((const char *)data.data(), data.size());
+	file.close();
+	if (!file)
+	{
+		std::cerr << "Error.  Could not write " << filename << "." << std::endl;
+		exit(1);
+	}
+	if (chmod(filename.c_str(), 0755) != 0)
+	{
+		std::cerr << "Error.  Could not make " << filename << " executable." << std::endl;
+		exit(1);
+	}
+}
@@ -0,0 +1,31 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <cstddef>
+
+// Where a standalone executable loads. It is a static ET_EXEC, not a
+// position-independent one, so its addresses are known before it runs.
+const unsigned long long EXECUTABLE_BASE = 0x400000;
+
+// Writes a static x86-64 Linux executable with two segments: text, read
+// and execute, and data, read and write, whose first bytes come from the
+// file and whose rest the kernel fills with zeros. The sizes are given
+// up front, so code can be pointed at the addresses before it is written.
+// Failures print an error and exit, like InstructionsClass.
+class ElfWriterClass
+{
+public:
+	ElfWriterClass(size_t textSize, size_t dataSize, size_t zeroSize);
+	unsigned long long GetTextAddress() const;
+	unsigned long long GetDataAddress() const;
+	// entry is an offset into text. The file is made executable.
+	void Write(const std::string & filename, const std::vector<unsigned char> & text,
+		size_t entry, const std::vector<unsigned char> & data) const;
+
+private:
+	size_t mTextSize;
+	size_t mDataSize;
+	size_t mZeroSize;
+	size_t mTextOffset; // in the file, after the headers
+	size_t mDataOffset; // in the file, on a page of its own
+};
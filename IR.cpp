@@ -0,0 +1,787 @@
+#include <iostream>
+#include <algorithm>
+#include <set>
+#include "IR.h"
+
+IRFunctionClass::IRFunctionClass()
+	: mNextId(0)
+{
+}
+
+IRFunctionClass::~IRFunctionClass()
+{
+	for (IRInstruction * instruction : mInstructions)
+	{
+		delete instruction;
+	}
+	for (IRBlock * block : mBlocks)
+	{
+		delete block;
+	}
+	for (IRBlock * block : mRemovedBlocks)
+	{
+		delete block;
+	}
+}
+
+IRBlock * IRFunctionClass::NewBlock()
+{
+	IRBlock * block = new IRBlock;
+	block->id = (int)(mBlocks.size() + mRemovedBlocks.size());
+	block->terminator = IR_RETURN;
+	block->condition = NULL;
+	block->successors[0] = NULL;
+	block->successors[1] = NULL;
+	mBlocks.push_back(block);
+	return block;
+}
+
+// The caller puts the instruction into block's phis or instructions.
+IRInstruction * IRFunctionClass::NewInstruction(IROpcode opcode, IRBlock * block)
+{
+	IRInstruction * instruction = new IRInstruction;
+	instruction->opcode = opcode;
+	instruction->id = mNextId++;
+	instruction->operation = BAD_TOKEN;
+	instruction->constant = 0;
+	instruction->block = block;
+	instruction->replacement = NULL;
+	instruction->slot = -1;
+	mInstructions.push_back(instruction);
+	return instruction;
+}
+
+// Constants belong to no block; there is one per value.
+IRInstruction * IRFunctionClass::Constant(int value)
+{
+	std::map<int, IRInstruction *>::iterator found = mConstants.find(value);
+	if (found != mConstants.end())
+	{
+		return found->second;
+	}
+	IRInstruction * constant = NewInstruction(IR_CONSTANT, NULL);
+	constant->constant = value;
+	mConstants[value] = constant;
+	return constant;
+}
+
+std::vector<IRBlock *> & IRFunctionClass::GetBlocks()
+{
+	return mBlocks;
+}
+
+IRInstruction * IRFunctionClass::Resolve(IRInstruction * instruction)
+{
+	while (instruction && instruction->replacement)
+	{
+		instruction = instruction->replacement;
+	}
+	return instruction;
+}
+
+static void ResolveAll(std::vector<IRInstruction *> & instructions)
+{
+	for (IRInstruction * & instruction : instructions)
+	{
+		instruction = IRFunctionClass::Resolve(instruction);
+	}
+}
+
+static void DropReplaced(std::vector<IRInstruction *> & instructions)
+{
+	instructions.erase(std::remove_if(instructions.begin(), instructions.end(),
+		[](IRInstruction * instruction) { return instruction->replacement != NULL; }),
+		instructions.end());
+}
+
+void IRFunctionClass::ResolveReplacements()
+{
+	for (IRBlock * block : mBlocks)
+	{
+		for (IRInstruction * phi : block->phis)
+		{
+			ResolveAll(phi->operands);
+		}
+		for (IRInstruction * instruction : block->instructions)
+		{
+			ResolveAll(instruction->operands);
+		}
+		block->condition = Resolve(block->condition);
+		DropReplaced(block->phis);
+		DropReplaced(block->instructions);
+	}
+}
+
+void IRFunctionClass::RemoveEdge(IRBlock * predecessor, IRBlock * block)
+{
+	std::vector<IRBlock *> & predecessors = block->predecessors;
+	std::vector<IRBlock *>::iterator edge =
+		std::find(predecessors.begin(), predecessors.end(), predecessor);
+	if (edge == predecessors.end())
+	{
+		return;
+	}
+	int index = (int)(edge - predecessors.begin());
+	predecessors.erase(edge);
+	for (IRInstruction * phi : block->phis)
+	{
+		phi->operands.erase(phi->operands.begin() + index);
+	}
+}
+
+static int SuccessorCount(const IRBlock * block)
+{
+	switch (block->terminator)
+	{
+	case IR_JUMP:   return 1;
+	case IR_BRANCH: return 2;
+	default:        return 0;
+	}
+}
+
+// Blocks in reverse postorder, visiting the false side of a branch
+// first so that the true side comes straight after the branch. Blocks
+// the entry cannot reach are left out.
+static std::vector<IRBlock *> ReversePostorder(IRBlock * entry)
+{
+	std::vector<IRBlock *> postorder;
+	std::set<IRBlock *> visited;
+	std::vector<std::pair<IRBlock *, int> > stack;
+	visited.insert(entry);
+	stack.push_back(std::make_pair(entry, SuccessorCount(entry)));
+	while (!stack.empty())
+	{
+		IRBlock * block = stack.back().first;
+		int & next = stack.back().second;
+		if (next == 0)
+		{
+			postorder.push_back(block);
+			stack.pop_back();
+			continue;
+		}
+		IRBlock * successor = block->successors[--next];
+		if (visited.insert(successor).second)
+		{
+			stack.push_back(std::make_pair(successor, SuccessorCount(successor)));
+		}
+	}
+	std::reverse(postorder.begin(), postorder.end());
+	return postorder;
+}
+
+int IRFunctionClass::RemoveUnreachableBlocks()
+{
+	std::vector<IRBlock *> reachable = ReversePostorder(mBlocks[0]);
+	if (reachable.size() == mBlocks.size())
+	{
+		return 0;
+	}
+	std::set<IRBlock *> keep(reachable.begin(), reachable.end());
+	int removed = 0;
+	std::vector<IRBlock *> kept;
+	for (IRBlock * block : mBlocks)
+	{
+		if (keep.count(block))
+		{
+			kept.push_back(block);
+			continue;
+		}
+		for (int i = 0; i < SuccessorCount(block); i++)
+		{
+			if (keep.count(block->successors[i]))
+			{
+				RemoveEdge(block, block->successors[i]);
+			}
+		}
+		mRemovedBlocks.push_back(block);
+		removed++;
+	}
+	mBlocks.swap(kept);
+	return removed;
+}
+
+static void PrintValue(const IRInstruction * value)
+{
+	if (value->opcode == IR_CONSTANT)
+	{
+		std::cout << value->constant;
+	}
+	else
+	{
+		std::cout << "%" << value->id;
+	}
+}
+
+void IRFunctionClass::Print() const
+{
+	for (const IRBlock * block : mBlocks)
+	{
+		std::cout << "block" << block->id << ":";
+		for (const IRBlock * predecessor : block->predecessors)
+		{
+			std::cout << " <- block" << predecessor->id;
+		}
+		std::cout << std::endl;
+		for (const IRInstruction * phi : block->phis)
+		{
+			std::cout << "  %" << phi->id << " = phi";
+			for (IRInstruction * operand : phi->operands)
+			{
+				std::cout << " ";
+				PrintValue(Resolve(operand));
+			}
+			std::cout << std::endl;
+		}
+		for (const IRInstruction * instruction : block->instructions)
+		{
+			std::cout << "  ";
+			switch (instruction->opcode)
+			{
+			case IR_BINARY:
+				std::cout << "%" << instruction->id << " = "
+					<< TokenClass::GetTokenTypeName(instruction->operation) << " ";
+				PrintValue(Resolve(instruction->operands[0]));
+				std::cout << ", ";
+				PrintValue(Resolve(instruction->operands[1]));
+				break;
+			case IR_WRITE:
+				std::cout << "write ";
+				PrintValue(Resolve(instruction->operands[0]));
+				break;
+			case IR_WRITE_END:
+				std::cout << "write endl";
+				break;
+			default:
+				break;
+			}
+			std::cout << std::endl;
+		}
+		switch (block->terminator)
+		{
+		case IR_JUMP:
+			std::cout << "  jump block" << block->successors[0]->id << std::endl;
+			break;
+		case IR_BRANCH:
+			std::cout << "  branch ";
+			PrintValue(Resolve(block->condition));
+			std::cout << " ? block" << block->successors[0]->id
+				<< " : block" << block->successors[1]->id << std::endl;
+			break;
+		case IR_RETURN:
+			std::cout << "  return" << std::endl;
+			break;
+		}
+	}
+}
+
+// Lowering. Each value lives in a hidden slot of the data segment and is loaded
+// into ESI or EDI to be worked on; constants are coded as immediates. Values
+// read only in their own block share slots, since few are live at once.
+
+static void LoadOperand(InstructionsClass & machineCode, RegisterType reg,
+	const IRInstruction * value)
+{
+	if (value->opcode == IR_CONSTANT)
+	{
+		machineCode.LoadValue(reg, value->constant);
+	}
+	else
+	{
+		machineCode.LoadVariable(reg, value->slot);
+	}
+}
+
+static bool IsRelational(TokenType operation)
+{
+	return operation >= LESS_TOKEN && operation <= NOTEQUAL_TOKEN;
+}
+
+// Copies each phi of to its operand along the edge from from. A phi
+// reading another phi of the same block must see the old value, so
+// then the copies go through the stack.
+static void CodeEdge(InstructionsClass & machineCode, IRBlock * from, IRBlock * to)
+{
+	if (to->phis.empty())
+	{
+		return;
+	}
+	int index = (int)(std::find(to->predecessors.begin(), to->predecessors.end(), from)
+		- to->predecessors.begin());
+	bool parallel = false;
+	for (IRInstruction * phi : to->phis)
+	{
+		IRInstruction * source = phi->operands[index];
+		if (source != phi && source->opcode == IR_PHI && source->block == to)
+		{
+			parallel = true;
+		}
+	}
+	if (!parallel)
+	{
+		for (IRInstruction * phi : to->phis)
+		{
+			IRInstruction * source = phi->operands[index];
+			if (source != phi)
+			{
+				LoadOperand(machineCode, ESI_REGISTER, source);
+				machineCode.StoreVariable(phi->slot, ESI_REGISTER);
+			}
+		}
+		return;
+	}
+	for (IRInstruction * phi : to->phis)
+	{
+		LoadOperand(machineCode, ESI_REGISTER, phi->operands[index]);
+		machineCode.PushRegister(ESI_REGISTER);
+	}
+	for (int i = (int)to->phis.size() - 1; i >= 0; i--)
+	{
+		machineCode.PopRegister(ESI_REGISTER);
+		machineCode.StoreVariable(to->phis[i]->slot, ESI_REGISTER);
+	}
+}
+
+// Codes main's body; Finish still has to be called. Blocks are laid out
+// in reverse postorder, and a jump to the next block is left out.
+void IRFunctionClass::Lower(InstructionsClass & machineCode)
+{
+	ResolveReplacements();
+	std::vector<IRBlock *> order = ReversePostorder(mBlocks[0]);
+
+	// A phi operand is read at the end of the predecessor it comes from.
+	std::map<IRInstruction *, int> uses;
+	std::set<IRInstruction *> shared; // read outside the block defining it
+	for (IRBlock * block : order)
+	{
+		for (IRInstruction * phi : block->phis)
+		{
+			phi->slot = machineCode.AllocateSlot();
+			for (size_t i = 0; i < phi->operands.size(); i++)
+			{
+				uses[phi->operands[i]]++;
+				if (phi->operands[i]->block != block->predecessors[i])
+				{
+					shared.insert(phi->operands[i]);
+				}
+			}
+		}
+		for (IRInstruction * instruction : block->instructions)
+		{
+			for (IRInstruction * operand : instruction->operands)
+			{
+				uses[operand]++;
+				if (operand->block != block)
+				{
+					shared.insert(operand);
+				}
+			}
+		}
+		if (block->terminator == IR_BRANCH)
+		{
+			uses[block->condition]++;
+			if (block->condition->block != block)
+			{
+				shared.insert(block->condition);
+			}
+		}
+	}
+	// Phis and values that outlive their block keep a slot to themselves.
+	// The rest take one from freeSlots when they are coded and give it
+	// back after their last use.
+	for (IRBlock * block : order)
+	{
+		for (IRInstruction * instruction : block->instructions)
+		{
+			if (instruction->opcode == IR_BINARY && shared.count(instruction))
+			{
+				instruction->slot = machineCode.AllocateSlot();
+			}
+		}
+	}
+	std::vector<int> freeSlots;
+	auto release = [&shared, &freeSlots](IRInstruction * value)
+	{
+		if (value->opcode == IR_BINARY && value->slot >= 0 && !shared.count(value))
+		{
+			freeSlots.push_back(value->slot);
+			value->slot = -1;
+		}
+	};
+
+	std::map<IRBlock *, int> starts;
+	std::vector<std::pair<int, IRBlock *> > jumps; // NULL: to the end of main
+	for (size_t position = 0; position < order.size(); position++)
+	{
+		IRBlock * block = order[position];
+		IRBlock * next = position + 1 < order.size() ? order[position + 1] : NULL;
+		starts[block] = machineCode.GetAddress();
+
+		// A comparison only the branch uses is coded as a compare and jump.
+		IRInstruction * fused = NULL;
+		if (block->terminator == IR_BRANCH && !block->instructions.empty()
+			&& block->instructions.back() == block->condition
+			&& block->condition->opcode == IR_BINARY
+			&& IsRelational(block->condition->operation)
+			&& uses[block->condition] == 1)
+		{
+			fused = block->condition;
+		}
+
+		// Where the block last reads each of its values. The fused compare,
+		// the branch and the edges read theirs at the end.
+		int end = (int)block->instructions.size();
+		std::map<IRInstruction *, int> lastUse;
+		for (int i = 0; i < end; i++)
+		{
+			for (IRInstruction * operand : block->instructions[i]->operands)
+			{
+				lastUse[operand] = block->instructions[i] == fused ? end : i;
+			}
+		}
+		if (block->terminator == IR_BRANCH)
+		{
+			lastUse[block->condition] = end;
+		}
+		for (int i = 0; i < (block->terminator == IR_BRANCH ? 2 : 1); i++)
+		{
+			IRBlock * successor = block->terminator == IR_RETURN ? NULL : block->successors[i];
+			if (!successor || successor->phis.empty())
+			{
+				continue;
+			}
+			int index = (int)(std::find(successor->predecessors.begin(),
+				successor->predecessors.end(), block) - successor->predecessors.begin());
+			for (IRInstruction * phi : successor->phis)
+			{
+				lastUse[phi->operands[index]] = end;
+			}
+		}
+
+		for (int i = 0; i < end; i++)
+		{
+			IRInstruction * instruction = block->instructions[i];
+			if (instruction == fused)
+			{
+				break;
+			}
+			if (instruction->opcode == IR_BINARY && instruction->slot < 0)
+			{
+				if (freeSlots.empty())
+				{
+					instruction->slot = machineCode.AllocateSlot();
+				}
+				else
+				{
+					instruction->slot = freeSlots.back();
+					freeSlots.pop_back();
+				}
+			}
+			switch (instruction->opcode)
+			{
+			case IR_BINARY:
+			{
+				IRInstruction * right = instruction->operands[1];
+				LoadOperand(machineCode, ESI_REGISTER, instruction->operands[0]);
+				if (right->opcode == IR_CONSTANT)
+				{
+					machineCode.OperateValue(instruction->operation, ESI_REGISTER, right->constant);
+				}
+				else
+				{
+					machineCode.LoadVariable(EDI_REGISTER, right->slot);
+					machineCode.OperateRegisters(instruction->operation, ESI_REGISTER, EDI_REGISTER);
+				}
+				machineCode.StoreVariable(instruction->slot, ESI_REGISTER);
+				break;
+			}
+			case IR_WRITE:
+				LoadOperand(machineCode, ESI_REGISTER, instruction->operands[0]);
+				machineCode.WriteRegister(ESI_REGISTER);
+				break;
+			case IR_WRITE_END:
+				machineCode.WriteEndLinux64();
+				break;
+			default:
+				break;
+			}
+			for (IRInstruction * operand : instruction->operands)
+			{
+				if (lastUse[operand] == i)
+				{
+					release(operand);
+				}
+			}
+			if (!lastUse.count(instruction))
+			{
+				release(instruction);
+			}
+		}
+
+		switch (block->terminator)
+		{
+		case IR_JUMP:
+			CodeEdge(machineCode, block, block->successors[0]);
+			if (block->successors[0] != next)
+			{
+				jumps.push_back(std::make_pair(machineCode.Jump(), block->successors[0]));
+			}
+			break;
+		case IR_BRANCH:
+		{
+			IRBlock * onTrue = block->successors[0];
+			IRBlock * onFalse = block->successors[1];
+			// Usually the true side comes next and the false edge copies
+			// nothing, so the jcc goes straight to the false side and the
+			// true side falls through. When the false edge has copies to
+			// make but the true side still comes next, the test is turned
+			// around so that the true edge's copies can fall through.
+			bool straight = onFalse->phis.empty();
+			bool turned = !straight && onTrue == next;
+			IRBlock * first = turned ? onFalse : onTrue;
+			IRBlock * second = turned ? onTrue : onFalse;
+			int toSecond;
+			if (fused)
+			{
+				IRInstruction * right = fused->operands[1];
+				LoadOperand(machineCode, ESI_REGISTER, fused->operands[0]);
+				if (right->opcode == IR_CONSTANT)
+				{
+					machineCode.CompareValue(ESI_REGISTER, right->constant);
+				}
+				else
+				{
+					machineCode.LoadVariable(EDI_REGISTER, right->slot);
+					machineCode.CompareRegisters(ESI_REGISTER, EDI_REGISTER);
+				}
+				ComparisonType comparison = InstructionsClass::ComparisonFor(fused->operation);
+				toSecond = machineCode.JumpIf(turned ? comparison : InstructionsClass::Opposite(comparison));
+			}
+			else
+			{
+				LoadOperand(machineCode, ESI_REGISTER, block->condition);
+				toSecond = turned ? machineCode.SkipIfNotZeroRegister(ESI_REGISTER)
+					: machineCode.SkipIfZeroRegister(ESI_REGISTER);
+			}
+			if (straight)
+			{
+				jumps.push_back(std::make_pair(toSecond, onFalse));
+			}
+			CodeEdge(machineCode, block, first);
+			if (!straight || first != next)
+			{
+				jumps.push_back(std::make_pair(machineCode.Jump(), first));
+			}
+			if (!straight)
+			{
+				machineCode.SetOffsets(JumpList(1, toSecond), machineCode.GetAddress());
+				CodeEdge(machineCode, block, second);
+				if (second != next)
+				{
+					jumps.push_back(std::make_pair(machineCode.Jump(), second));
+				}
+			}
+			break;
+		}
+		case IR_RETURN:
+			if (next)
+			{
+				jumps.push_back(std::make_pair(machineCode.Jump(), (IRBlock *)NULL));
+			}
+			break;
+		}
+		for (IRInstruction * instruction : block->instructions)
+		{
+			if (lastUse.count(instruction) && lastUse[instruction] == end)
+			{
+				release(instruction);
+			}
+		}
+	}
+
+	int end = machineCode.GetAddress();
+	for (const std::pair<int, IRBlock *> & jump : jumps)
+	{
+		machineCode.SetOffsets(JumpList(1, jump.first),
+			jump.second ? starts[jump.second] : end);
+	}
+}
+
+IRBuilderClass::IRBuilderClass(IRFunctionClass * function)
+	: mFunction(function), mBlock(NULL), mNextVariable(-1)
+{
+	IRBlock * entry = mFunction->NewBlock();
+	SealBlock(entry);
+	SetBlock(entry);
+}
+
+IRFunctionClass * IRBuilderClass::GetFunction()
+{
+	return mFunction;
+}
+
+IRBlock * IRBuilderClass::GetBlock()
+{
+	return mBlock;
+}
+
+void IRBuilderClass::SetBlock(IRBlock * block)
+{
+	mBlock = block;
+}
+
+void IRBuilderClass::SealBlock(IRBlock * block)
+{
+	std::map<int, IRInstruction *> incomplete;
+	incomplete.swap(mIncompletePhis[block]);
+	for (const std::pair<const int, IRInstruction *> & phi : incomplete)
+	{
+		AddPhiOperands(phi.first, phi.second);
+	}
+	mSealed[block] = true;
+}
+
+void IRBuilderClass::WriteVariable(int variable, IRInstruction * value)
+{
+	mCurrentDefinitions[mBlock][variable] = value;
+}
+
+IRInstruction * IRBuilderClass::ReadVariable(int variable)
+{
+	return ReadVariable(variable, mBlock);
+}
+
+// Synthetic variables count down from -1, clear of symbol table indexes.
+int IRBuilderClass::NewVariable()
+{
+	return mNextVariable--;
+}
+
+IRInstruction * IRBuilderClass::ReadVariable(int variable, IRBlock * block)
+{
+	std::map<int, IRInstruction *> & definitions = mCurrentDefinitions[block];
+	std::map<int, IRInstruction *>::iterator found = definitions.find(variable);
+	if (found != definitions.end())
+	{
+		return IRFunctionClass::Resolve(found->second);
+	}
+
+	IRInstruction * value;
+	if (!mSealed[block])
+	{
+		value = mFunction->NewInstruction(IR_PHI, block);
+		block->phis.push_back(value);
+		mIncompletePhis[block][variable] = value;
+	}
+	else if (block->predecessors.size() == 1)
+	{
+		value = ReadVariable(variable, block->predecessors[0]);
+	}
+	else if (block->predecessors.empty())
+	{
+		value = mFunction->Constant(0); // never assigned; variables start zeroed
+	}
+	else
+	{
+		// Defined first, so that a loop back to here finds the phi.
+		IRInstruction * phi = mFunction->NewInstruction(IR_PHI, block);
+		block->phis.push_back(phi);
+		mCurrentDefinitions[block][variable] = phi;
+		value = AddPhiOperands(variable, phi);
+	}
+	mCurrentDefinitions[block][variable] = value;
+	return value;
+}
+
+IRInstruction * IRBuilderClass::AddPhiOperands(int variable, IRInstruction * phi)
+{
+	for (IRBlock * predecessor : phi->block->predecessors)
+	{
+		phi->operands.push_back(ReadVariable(variable, predecessor));
+	}
+	return TryRemoveTrivialPhi(phi);
+}
+
+// A phi whose operands are all one value, or itself, is that value. It
+// is forwarded rather than unlinked; ResolveReplacements tidies up.
+IRInstruction * IRBuilderClass::TryRemoveTrivialPhi(IRInstruction * phi)
+{
+	IRInstruction * same = NULL;
+	for (IRInstruction * operand : phi->operands)
+	{
+		operand = IRFunctionClass::Resolve(operand);
+		if (operand == same || operand == phi)
+		{
+			continue;
+		}
+		if (same)
+		{
+			return phi;
+		}
+		same = operand;
+	}
+	if (!same)
+	{
+		same = mFunction->Constant(0);
+	}
+	phi->replacement = same;
+	return same;
+}
+
+IRInstruction * IRBuilderClass::Binary(TokenType operation, IRInstruction * left,
+	IRInstruction * right)
+{
+	IRInstruction * instruction = mFunction->NewInstruction(IR_BINARY, mBlock);
+	instruction->operation = operation;
+	instruction->operands.push_back(left);
+	instruction->operands.push_back(right);
+	mBlock->instructions.push_back(instruction);
+	return instruction;
+}
+
+void IRBuilderClass::Write(IRInstruction * value)
+{
+	IRInstruction * instruction = mFunction->NewInstruction(IR_WRITE, mBlock);
+	instruction->operands.push_back(value);
+	mBlock->instructions.push_back(instruction);
+}
+
+void IRBuilderClass::WriteEnd()
+{
+	IRInstruction * instruction = mFunction->NewInstruction(IR_WRITE_END, mBlock);
+	mBlock->instructions.push_back(instruction);
+}
+
+void IRBuilderClass::AddEdge(IRBlock * from, IRBlock * to)
+{
+	to->predecessors.push_back(from);
+}
+
+void IRBuilderClass::Jump(IRBlock * target)
+{
+	mBlock->terminator = IR_JUMP;
+	mBlock->successors[0] = target;
+	AddEdge(mBlock, target);
+	mBlock = NULL;
+}
+
+void IRBuilderClass::Branch(IRInstruction * condition, IRBlock * whenTrue, IRBlock * whenFalse)
+{
+	if (whenTrue == whenFalse)
+	{
+		Jump(whenTrue);
+		return;
+	}
+	mBlock->terminator = IR_BRANCH;
+	mBlock->condition = condition;
+	mBlock->successors[0] = whenTrue;
+	mBlock->successors[1] = whenFalse;
+	AddEdge(mBlock, whenTrue);
+	AddEdge(mBlock, whenFalse);
+	mBlock = NULL;
+}
+
+void IRBuilderClass::Return()
+{
+	mBlock->terminator = IR_RETURN;
+	mBlock = NULL;
+}
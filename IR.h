@@ -0,0 +1,130 @@
+#pragma once
+#include <vector>
+#include <map>
+#include "Token.h"
+#include "Instructions.h"
+
+// A mid-level SSA form of main, between the AST and InstructionsClass.
+// Every IRInstruction defines at most one value, and every value is
+// defined exactly once. Where control flow merges, a phi picks the value
+// that arrived along each predecessor.
+
+enum IROpcode {
+	IR_CONSTANT,  // constant
+	IR_PHI,       // operands[i] arrives from block->predecessors[i]
+	IR_BINARY,    // operands[0] operation operands[1]
+	IR_WRITE,     // cout << operands[0]
+	IR_WRITE_END  // cout << endl
+};
+
+struct IRBlock;
+
+struct IRInstruction {
+	IROpcode opcode;
+	int id;
+	TokenType operation; // IR_BINARY: any binary operator but && and ||
+	int constant;        // IR_CONSTANT
+	std::vector<IRInstruction *> operands;
+	IRBlock * block;
+	// Set when a pass replaces this value by another one. Operands are
+	// pointed past it by IRFunctionClass::ResolveReplacements.
+	IRInstruction * replacement;
+	int slot; // where lowering keeps the value in mData
+};
+
+enum IRTerminator {
+	IR_JUMP,   // to successors[0]
+	IR_BRANCH, // to successors[0] if condition is not zero, else successors[1]
+	IR_RETURN
+};
+
+struct IRBlock {
+	int id;
+	std::vector<IRInstruction *> phis;
+	std::vector<IRInstruction *> instructions;
+	std::vector<IRBlock *> predecessors;
+	IRTerminator terminator;
+	IRInstruction * condition;
+	IRBlock * successors[2];
+};
+
+// Owns the blocks and instructions of main. blocks[0] is the entry.
+class IRFunctionClass
+{
+public:
+	IRFunctionClass();
+	~IRFunctionClass();
+	IRFunctionClass(const IRFunctionClass &) = delete;
+	IRFunctionClass & operator=(const IRFunctionClass &) = delete;
+
+	IRBlock * NewBlock();
+	IRInstruction * NewInstruction(IROpcode opcode, IRBlock * block);
+	IRInstruction * Constant(int value);
+
+	std::vector<IRBlock *> & GetBlocks();
+	// The value standing in for instruction, following replacements.
+	static IRInstruction * Resolve(IRInstruction * instruction);
+	// Points every operand past replaced instructions, and drops those
+	// instructions from their blocks.
+	void ResolveReplacements();
+	// Drops the edge from predecessor to block, with its phi operands.
+	void RemoveEdge(IRBlock * predecessor, IRBlock * block);
+	// Drops blocks the entry cannot reach. Returns how many.
+	int RemoveUnreachableBlocks();
+
+	void Print() const;
+	void Lower(InstructionsClass & machineCode);
+
+private:
+	std::vector<IRBlock *> mBlocks;
+	std::vector<IRBlock *> mRemovedBlocks;
+	std::vector<IRInstruction *> mInstructions;
+	std::map<int, IRInstruction *> mConstants;
+	int mNextId;
+};
+
+// Builds SSA while walking the AST, with the on-the-fly construction of
+// Braun et al., "Simple and Efficient Construction of Static Single
+// Assignment Form". A block is sealed once all its predecessors are
+// known; reads in unsealed blocks get phis whose operands are filled in
+// when it is sealed.
+class IRBuilderClass
+{
+public:
+	IRBuilderClass(IRFunctionClass * function);
+
+	IRFunctionClass * GetFunction();
+	IRBlock * GetBlock();
+	// Makes block the one instructions are added to.
+	void SetBlock(IRBlock * block);
+	void SealBlock(IRBlock * block);
+
+	// variable is a symbol table index, or one from NewVariable.
+	void WriteVariable(int variable, IRInstruction * value);
+	IRInstruction * ReadVariable(int variable);
+	// A variable for the builder's own use, like a repeat counter.
+	int NewVariable();
+
+	IRInstruction * Binary(TokenType operation, IRInstruction * left, IRInstruction * right);
+	void Write(IRInstruction * value);
+	void WriteEnd();
+
+	// End the current block. Afterwards there is no current block until
+	// SetBlock.
+	void Jump(IRBlock * target);
+	void Branch(IRInstruction * condition, IRBlock * whenTrue, IRBlock * whenFalse);
+	void Return();
+
+private:
+	IRInstruction * ReadVariable(int variable, IRBlock * block);
+	IRInstruction * AddPhiOperands(int variable, IRInstruction * phi);
+	IRInstruction * TryRemoveTrivialPhi(IRInstruction * phi);
+	void AddEdge(IRBlock * from, IRBlock * to);
+
+	IRFunctionClass * mFunction;
+	IRBlock * mBlock;
+	std::map<IRBlock *, std::map<int, IRInstruction *> > mCurrentDefinitions;
+	std::map<IRBlock *, std::map<int, IRInstruction *> > mIncompletePhis;
+	std::map<IRBlock *, bool> mSealed;
+	int mNextVariable;
+};
@@ -2,6 +2,16 @@
 #include <unistd.h>
 #include <sys/mman.h>
 #include "Instructions.h"
+#include <set>
+#include <cstring>
+#include <climits>
+#include <cstddef>
+#include <csetjmp>
+#include <csignal>
+#include <mutex>
+#include <stdexcept>
+#include "Output.h"
+#include "ElfWriter.h"
 
 const unsigned char PUSH_EBX = 0x53;
 const unsigned char PUSH_ESI = 0x56;
@@ -9,6 +19,7 @@ const unsigned char PUSH_EDI = 0x57;
 const unsigned char POP_EDI = 0x5F;
 const unsigned char POP_ESI = 0x5E;
 const unsigned char POP_EBX = 0x5B; 
+const unsigned char REX_B_PREFIX = 0x41; // push/pop R8 to R15
 
 
 // Some assembly like definitions for our machine code:
@@ -82,8 +93,113 @@ const unsigned char JE = 0x74;
 
 const unsigned char JUMP_ALWAYS = 0xEB;
 
+const unsigned char MOV_EBX_EAX1 = 0x89; // mov ebx, eax
+const unsigned char MOV_EBX_EAX2 = 0xC3;
+const unsigned char MOV_EAX_EBX1 = 0x89; // mov eax, ebx
+const unsigned char MOV_EAX_EBX2 = 0xD8;
+const unsigned char MOV_EDX_EAX1 = 0x89; // mov edx, eax
+const unsigned char MOV_EDX_EAX2 = 0xC2;
+const unsigned char MOV_EDI_EAX1 = 0x89; // mov edi, eax
+const unsigned char MOV_EDI_EAX2 = 0xC7;
+const unsigned char MOV_ECX_AT_ESI1 = 0x8B; // mov ecx, [rsi]
+const unsigned char MOV_ECX_AT_ESI2 = 0x0E;
+const unsigned char MOV_ECX_TO_AT_ESI1 = 0x89; // mov [rsi], ecx
+const unsigned char MOV_ECX_TO_AT_ESI2 = 0x0E;
+const unsigned char ADD_EDI_ECX1 = 0x01; // add rdi, rcx (after BIT64)
+const unsigned char ADD_EDI_ECX2 = 0xCF;
+const unsigned char ADD_ESI_EAX1 = 0x01; // add rsi, rax (after BIT64)
+const unsigned char ADD_ESI_EAX2 = 0xC6;
+const unsigned char SUB_EDX_EAX1 = 0x29; // sub edx, eax
+const unsigned char SUB_EDX_EAX2 = 0xC2;
+const unsigned char MOV_EAX_EDI1 = 0x89; // mov rax, rdi (after BIT64)
+const unsigned char MOV_EAX_EDI2 = 0xF8;
+const unsigned char SUB_EAX_ESI1 = 0x29; // sub rax, rsi (after BIT64)
+const unsigned char SUB_EAX_ESI2 = 0xF0;
+const unsigned char BYTE_TO_AT_EDI1 = 0xC6; // mov byte [rdi], followed by 1 byte
+const unsigned char BYTE_TO_AT_EDI2 = 0x07;
+const unsigned char AL_TO_AT_EDI1 = 0x88; // mov byte [rdi], al
+const unsigned char AL_TO_AT_EDI2 = 0x07;
+const unsigned char INC_EDI1 = 0xFF; // inc rdi (after BIT64)
+const unsigned char INC_EDI2 = 0xC7;
+const unsigned char INC_ECX1 = 0xFF; // inc ecx
+const unsigned char INC_ECX2 = 0xC1;
+const unsigned char XOR_EAX_EAX1 = 0x31;
+const unsigned char XOR_EAX_EAX2 = 0xC0;
+const unsigned char XOR_EDX_EDX1 = 0x31;
+const unsigned char XOR_EDX_EDX2 = 0xD2;
+const unsigned char TEST_EAX_EAX1 = 0x85;
+const unsigned char TEST_EAX_EAX2 = 0xC0;
+const unsigned char TEST_EDX_EDX1 = 0x85;
+const unsigned char TEST_EDX_EDX2 = 0xD2;
+const unsigned char UNSIGNED_DIV_EAX_EBX1 = 0xF7;
+const unsigned char UNSIGNED_DIV_EAX_EBX2 = 0xF3;
+	// Like DIV_EAX_EBX but unsigned. Clear D with XOR first.
+const unsigned char MOV_ECX_EAX1 = 0x89; // mov ecx, eax
+const unsigned char MOV_ECX_EAX2 = 0xC1;
+const unsigned char MOV_EAX_ECX1 = 0x89; // mov eax, ecx
+const unsigned char MOV_EAX_ECX2 = 0xC8;
+const unsigned char ADD_EAX1 = 0x83; // followed by 1 byte
+const unsigned char ADD_EAX2 = 0xC0;
+const unsigned char IMUL1 = 0x0F; // imul reg, reg. Followed by one of:
+const unsigned char IMUL2 = 0xAF;
+const unsigned char IMUL_EAX_EAX = 0xC0;
+const unsigned char IMUL_EAX_ECX = 0xC1;
+const unsigned char IMUL_ECX_ECX = 0xC9;
+const unsigned char TEST_DL1 = 0xF6; // followed by 1 byte mask
+const unsigned char TEST_DL2 = 0xC2;
+const unsigned char SHR_EDX_1_1 = 0xD1; // shift EDX right by one
+const unsigned char SHR_EDX_1_2 = 0xEA;
+const unsigned char NEG_EDX1 = 0xF7;
+const unsigned char NEG_EDX2 = 0xDA;
+const unsigned char JA = 0x77; // unsigned greater
+// Register mode. Opcodes that take a ModRM byte naming two registers.
+const unsigned char REX = 0x40;
+const unsigned char REX_W = 0x08; // 64 bit operand
+const unsigned char REX_R = 0x04; // ModRM reg field is R8 to R15
+const unsigned char REX_B = 0x01; // ModRM rm field is R8 to R15
+const unsigned char MODRM_REGISTERS = 0xC0;
+const unsigned char ADD_RM_REG = 0x01;
+const unsigned char SUB_RM_REG = 0x29;
+const unsigned char XOR_RM_REG = 0x31;
+const unsigned char CMP_RM_REG = 0x39;
+const unsigned char TEST_RM_REG = 0x85;
+const unsigned char MOV_RM_REG = 0x89;
+const unsigned char MOV_REG_RM = 0x8B;
+const unsigned char LEA = 0x8D;
+// Variables are addressed off RBP, which points DATA_BASE_BIAS bytes past the
+// first variable so that the first 64 variables need only a 1 byte displacement.
+const unsigned char MODRM_DISP8 = 0x40; // [rm + 1 byte]
+const unsigned char MODRM_DISP32 = 0x80; // [rm + 4 bytes]
+const int DATA_BASE_BIAS = 128;
+const unsigned char IMUL_IMMEDIATE32 = 0x69; // imul reg, rm, 4 byte value
+const unsigned char IMUL_IMMEDIATE8 = 0x6B; // imul reg, rm, 1 byte value
+const unsigned char GROUP_IMMEDIATE32 = 0x81; // op rm, 4 byte value
+const unsigned char GROUP_IMMEDIATE8 = 0x83; // op rm, 1 byte value
+const int GROUP_ADD = 0; // the ModRM reg field picks the op
+const int GROUP_SUB = 5;
+const int GROUP_CMP = 7;
+const unsigned char IDIV1 = 0xF7; // also neg and one operand imul
+const int IDIV_DIGIT = 7;
+const int NEG_DIGIT = 3;
+const int IMUL_DIGIT = 5; // edx:eax = eax * rm
+const int GROUP_AND = 4;
+const unsigned char GROUP_SHIFT = 0xC1; // shift rm by a 1 byte count
+const int SHIFT_LEFT = 4;
+const int SHIFT_RIGHT = 5; // unsigned
+const int SHIFT_RIGHT_SIGNED = 7;
+const unsigned char REX_X = 0x02; // SIB index field is R8 to R15
+const unsigned char MODRM_SIB = 0x04; // a SIB byte follows
+const unsigned char SETCC1 = 0x0F; // set byte register if condition
+const unsigned char SETCC2 = 0x90; // plus the condition
+const unsigned char MOVZX_BYTE1 = 0x0F; // zero extend byte register
+const unsigned char MOVZX_BYTE2 = 0xB6;
+const unsigned char CMP_EAX_IMMEDIATE = 0x3D; // followed by 4 bytes
+const int EINTR_RESULT = -4; // a syscall interrupted by a signal
+
 const unsigned char JE_FAR1 = 0x0f; // 4 byte jump
 const unsigned char JE_FAR2 = 0x84; // 4 byte jump
+const unsigned char JNE_FAR1 = 0x0f; // 4 byte jump
+const unsigned char JNE_FAR2 = 0x85; // 4 byte jump
 const unsigned char JUMP_ALWAYS_FAR = 0xE9; // 4 byte jump
 static const unsigned char OP_HALT = 0xFF;
 
@@ -91,72 +207,244 @@ static const unsigned char OP_HALT = 0xFF;
 
 // Put one instruction at a time into mCode:
 void InstructionsClass::Encode(unsigned char c){
-	if(mCurrent + sizeof(unsigned char) < MAX_INSTRUCTIONS)
+	Reserve(sizeof(unsigned char));
+	mCode[mCurrent] = c;
+	mCurrent += sizeof(unsigned char);
+}
+
+// Makes room for bytes more code, moving the buffer if it has to grow.
+// Code only refers to other code by relative offsets, and to data off
+// RBP, so a move needs no fixing up.
+void InstructionsClass::Reserve(int bytes)
+{
+	if (mMemory.IsExecutable())
 	{
-		mCode[mCurrent] = c;
-		mCurrent += sizeof(unsigned char);
+		std::cerr << "Error.  Machine code cannot be added to once it has run."
+			<< std::endl;
+		exit(1);
 	}
-	else
+	if (mCurrent + bytes <= mCodeSize)
+	{
+		return;
+	}
+	int newSize = mCodeSize;
+	while (mCurrent + bytes > newSize)
+	{
+		newSize *= 2;
+	}
+	try
+	{
+		mMemory.Grow(newSize);
+	}
+	catch (std::runtime_error &e)
+	{
+		std::cerr << "Error.  " << e.what() << "." << std::endl;
+		exit(1);
+	}
+	mCode = mMemory.GetWritable();
+	mCodeSize = newSize;
+}
+
+static void * MapMemory(size_t bytes, int protection, int flags = 0)
+{
+	void * memory = mmap(NULL, bytes, protection,
+		MAP_PRIVATE | MAP_ANONYMOUS | flags, -1, 0);
+	if (memory == MAP_FAILED)
 	{
-		std::cerr << "Error.  Used up all " << MAX_INSTRUCTIONS 
-			<< " instructions." << std::endl;
+		std::cerr << "Error.  Could not map " << bytes
+			<< " bytes of memory." << std::endl;
 		exit(1);
 	}
+	return memory;
 }
 
-InstructionsClass::InstructionsClass()
+// Code is written into mMemory while it is only writable. Execute makes
+// it executable, after which it can no longer be written.
+InstructionsClass::InstructionsClass(OutputBufferClass * output, int dataSize)
+	: mMemory(INITIAL_CODE_SIZE)
 {
-	// This command allows mCode data to be called as a function.
-	mprotect((void *)((uintptr_t)mCode& ~(sysconf(_SC_PAGE_SIZE)-1)), 
-		MAX_INSTRUCTIONS, PROT_READ|PROT_WRITE|PROT_EXEC);
+	mCode = mMemory.GetWritable();
+	mCodeSize = INITIAL_CODE_SIZE;
+	if (dataSize <= 0)
+	{
+		std::cerr << "Error.  The data segment needs room for at least one variable."
+			<< std::endl;
+		exit(1);
+	}
+	if (dataSize > INT_MAX / (int)sizeof(int))
+	{
+		std::cerr << "Error.  The data segment can hold at most "
+			<< INT_MAX / (int)sizeof(int) << " variables." << std::endl;
+		exit(1);
+	}
+	mDataSize = dataSize;
+	mOutput = output;
+	mContext = NewContext();
 
 	// Initialize all class variables:
 	mCurrent = 0;
 	mStartOfMain = 0;
-	mPrintInteger = 0;
-	mTempInteger = 0;
-	mMinusString = '-';
-	mSpaceString = ' ';
-
-	// Record where the PrintIntegerLinux64 function starts:
+	for (int i = 0; i < PEEPHOLE_PATTERN_COUNT; i++)
+	{
+		mPatternCounts[i] = 0;
+		mPatternBytesSaved[i] = 0;
+	}
+	mBytesBeforePeephole = 0;
+	// Handed out from the back. None are live across a call, since calls
+	// only happen between statements.
+	const RegisterType pool[] = {R11_REGISTER, R10_REGISTER, R9_REGISTER,
+		R8_REGISTER, EDI_REGISTER, ESI_REGISTER};
+	mFreeRegisters.assign(pool, pool + sizeof(pool) / sizeof(pool[0]));
+	SetRegisterMode(false);
+
+	// Code the output routines first. They will be called later many times.
+	mStartOfFlush = mCurrent;
+	FlushLinux64();
 	mStartOfPrint = mCurrent; 
-
-	// Code one function PrintIntegerLinux64 that prints an integer. 
-	// It will be called later many times.
-	PrintIntegerLinux64(); // Write all the codes into mCode.
+	PrintIntegerLinux64();
+	mStartOfWriteEnd = mCurrent;
+	WriteEndRoutine();
 
 	// Now record where the main function will start:
 	mStartOfMain = mCurrent;
+	// Only main is recorded for the peephole pass.
+	mInstructions.clear();
+	BeginInstruction(OPAQUE_INSTRUCTION);
 
-	// All functions start this way. So does the main function.
-	Encode(PUSH_EBP);
-	Encode(MOV_EBP_ESP1);
-	Encode(MOV_EBP_ESP2);
 	// Make sure we save and restore all 5 Callee-Save registers.
 	// That is, EBP, ESP, EBX, ESI, and EDI,
+	Encode(PUSH_EBP);
 	Encode(PUSH_EBX);
 	Encode(PUSH_ESI);
 	Encode(PUSH_EDI);
+	// And R12 to R15, which may hold loop variables.
+	for (int reg = R12_REGISTER; reg <= R15_REGISTER; reg++)
+	{
+		Encode(REX_B_PREFIX);
+		Encode((unsigned char)(PUSH_EAX + (reg & 7)));
+	}
+	// Main is called with its ExecutionContext in RDI. Instead of a frame
+	// pointer, RBP holds the base that variables, and the context ahead
+	// of them, are addressed from. The output routines use it too.
+	Encode((unsigned char)(REX | REX_W));
+	Encode(LEA);
+	Encode((unsigned char)(MODRM_DISP32 | ((EBP_REGISTER & 7) << 3) | (EDI_REGISTER & 7)));
+	Encode(CONTEXT_SIZE + DATA_BASE_BIAS);
+}
+
+// opcode with reg and a field of the ExecutionContext, e.g. mov reg,
+// [rbp + d]. wide for 64 bit operands, like the lea of the buffer.
+void InstructionsClass::EncodeContextAccess(unsigned char opcode, RegisterType reg, int field, bool wide)
+{
+	if (wide || reg >= 8)
+	{
+		Encode((unsigned char)(REX | (wide ? REX_W : 0) | (reg >= 8 ? REX_R : 0)));
+	}
+	Encode(opcode);
+	Encode((unsigned char)(MODRM_DISP32 | ((reg & 7) << 3) | (EBP_REGISTER & 7)));
+	Encode(field - CONTEXT_SIZE - DATA_BASE_BIAS);
+}
+
+// Writes everything held in the output buffer with the write syscall,
+// then empties the buffer. Loops because write() may take fewer bytes
+// than asked for (pipes) or be interrupted by a signal.
+// Clobbers EAX, ECX, EDX, ESI, EDI and R11.
+void InstructionsClass::FlushLinux64()
+{
+	// EDX counts the bytes still to write, ESI points at them.
+	EncodeContextAccess(MOV_REG_RM, EDX_REGISTER, offsetof(ExecutionContext, length));
+	EncodeContextAccess(LEA, ESI_REGISTER, offsetof(ExecutionContext, buffer), true);
+
+	int write_loop = GetAddress();
+
+		// Stop when there is nothing left.
+		Encode(TEST_EDX_EDX1);
+		Encode(TEST_EDX_EDX2);
+		Encode(JLE);
+		int fillInDone1 = mCurrent;
+		Encode((unsigned char)0);
+
+		// The EAX register indicates which syscall (write)
+		// The EDI tells which file to write to
+		// The ESI contains the address to write from
+		// The EDX says how many bytes to write
+		EncodeContextAccess(MOV_REG_RM, EDI_REGISTER, offsetof(ExecutionContext, fileDescriptor));
+		Encode(IMMEDIATE_TO_EAX);
+		Encode((int)1); // 1 for write syscall
+		Encode((unsigned char)SYS_CALL1);
+		Encode((unsigned char)SYS_CALL2);
+
+		// EAX holds how many bytes were written, or a negative error.
+		Encode(TEST_EAX_EAX1);
+		Encode(TEST_EAX_EAX2);
+		Encode(JG);
+		int fillInWrote = mCurrent;
+		Encode((unsigned char)0);
+
+		// Try again if a signal interrupted us, otherwise give up.
+		Encode(CMP_EAX1);
+		Encode(CMP_EAX2);
+		Encode((unsigned char)EINTR_RESULT);
+		int end_retry = GetAddress() + 2;
+		Encode(JE);
+		Encode((unsigned char)(write_loop - end_retry));
+		Encode(JUMP_ALWAYS);
+		int fillInDone2 = mCurrent;
+		Encode((unsigned char)0);
+
+		// Step past the bytes that made it out.
+		mCode[fillInWrote] = (unsigned char)(mCurrent - (fillInWrote + 1));
+		Encode(BIT64);
+		Encode(ADD_ESI_EAX1);
+		Encode(ADD_ESI_EAX2);
+		Encode(SUB_EDX_EAX1);
+		Encode(SUB_EDX_EAX2);
+		int end_write_loop = GetAddress() + 2;
+		Encode(JUMP_ALWAYS);
+		Encode((unsigned char)(write_loop - end_write_loop));
+
+	// The buffer is empty again.
+	mCode[fillInDone1] = (unsigned char)(mCurrent - (fillInDone1 + 1));
+	mCode[fillInDone2] = (unsigned char)(mCurrent - (fillInDone2 + 1));
+	Encode(XOR_EAX_EAX1);
+	Encode(XOR_EAX_EAX2);
+	EncodeContextAccess(MOV_RM_REG, EAX_REGISTER, offsetof(ExecutionContext, length));
+	Encode(NEAR_RET);
 }
 
 // Modified from https://baptiste-wicht.com/posts/2011/11/print-strings-integers-intel-assembly.html
 // This is made into a function, so it can be called per cout instead of rewritten every time.
-// The integer to print should be previously stored in mPrintInteger.
+// The integer to print should be in EAX. Its digits and a trailing space
+// are added to the output buffer, which is flushed first if they might not fit.
 void InstructionsClass::PrintIntegerLinux64()
 {
-	// All functions start this way. So does PrintInteger.
-	Encode(PUSH_EBP);
-	Encode(MOV_EBP_ESP1);
-	Encode(MOV_EBP_ESP2);
+	// No frame pointer: RBP stays main's, for the ExecutionContext.
 	// Make sure we save and restore all 5 Callee-Save registers.
 	// That is, EBP, ESP, EBX, ESI, and EDI,
 	Encode(PUSH_EBX);
 	Encode(PUSH_ESI);
 	Encode(PUSH_EDI);
 
-	// Get the integer to print from mPrintInteger:
-	Encode(MEM_TO_EAX);
-	Encode(&mPrintInteger);
+	// Keep the integer in EBX while making room for it.
+	Encode(MOV_EBX_EAX1);
+	Encode(MOV_EBX_EAX2);
+	EncodeContextAccess(MOV_REG_RM, EAX_REGISTER, offsetof(ExecutionContext, length));
+	Encode(CMP_EAX_IMMEDIATE);
+	Encode((int)(OUTPUT_BUFFER_SIZE - MAX_INTEGER_CHARACTERS));
+	Encode(JLE);
+	int fillInRoom = mCurrent;
+	Encode((unsigned char)0);
+	Call(mStartOfFlush);
+	mCode[fillInRoom] = (unsigned char)(mCurrent - (fillInRoom + 1));
+	Encode(MOV_EAX_EBX1);
+	Encode(MOV_EAX_EBX2);
+
+	// EDI points at the first free byte of the buffer.
+	EncodeContextAccess(LEA, EDI_REGISTER, offsetof(ExecutionContext, buffer), true);
+	EncodeContextAccess(MOV_REG_RM, ECX_REGISTER, offsetof(ExecutionContext, length));
+	Encode(BIT64);
+	Encode(ADD_EDI_ECX1);
+	Encode(ADD_EDI_ECX2);
 
 	// Check if the number to print is negative:
 	Encode(CMP_EAX1);
@@ -168,19 +456,20 @@ void InstructionsClass::PrintIntegerLinux64()
 	unsigned char DistanceToJump = 0; // fill in later
 	int fillInAddress = mCurrent;
 	Encode(DistanceToJump); // fill in this distance later
-	unsigned char * jumpFrom = GetAddress();
+	int jumpFrom = GetAddress();
 
-	// Negate negative integers:
+	// Negate negative integers, and write the minus sign.
 	Encode(NEG_EAX1);
 	Encode(NEG_EAX2);
-
-	// Print the minus sign, first saving register EAX.
-	Encode(PUSH_EAX);
-	WriteMinusLinux64();
-	Encode(POP_EAX);
+	Encode(BYTE_TO_AT_EDI1);
+	Encode(BYTE_TO_AT_EDI2);
+	Encode((unsigned char)'-');
+	Encode(BIT64);
+	Encode(INC_EDI1);
+	Encode(INC_EDI2);
 
 	// Fill in how far to jump from before:
-	unsigned char * beginningOfPrintPositiveInteger = GetAddress();
+	int beginningOfPrintPositiveInteger = GetAddress();
 	mCode[fillInAddress]= (unsigned char)(beginningOfPrintPositiveInteger -jumpFrom);
 
 	// Jump to here!
@@ -189,24 +478,24 @@ void InstructionsClass::PrintIntegerLinux64()
 	// ECX is counter for how many decimal bytes are in the integer
 	Encode(IMMEDIATE_TO_ECX);
 	Encode((int)0);
+	Encode(IMMEDIATE_TO_EBX);
+	Encode((int)10); // Divide by 10
 
 	// Beginning of loop1.
 	// It puts all the ascii characters of the integer on the stack.
-		unsigned char *divide_loop= GetAddress(); 
+		int divide_loop = GetAddress(); 
 
 		// increment the counter
 		Encode(ADD_ECX1);
 		Encode(ADD_ECX2);
 		Encode((unsigned char)1);
 
-		// Clear out high bytes before division
-		Encode(CDQ);    // Necessary to clear the D register.
-
-		// edx = eax % 10
-		Encode(IMMEDIATE_TO_EBX);
-		Encode((int)10); // Divide by 10
-		Encode(DIV_EAX_EBX1); // divide eax by ebx
-		Encode(DIV_EAX_EBX2); // remainder result in edx
+		// edx = eax % 10. The division is unsigned, so that
+		// the negated most negative integer still works.
+		Encode(XOR_EDX_EDX1);
+		Encode(XOR_EDX_EDX2);
+		Encode(UNSIGNED_DIV_EAX_EBX1);
+		Encode(UNSIGNED_DIV_EAX_EBX2);
 
 		// convert decimal remainder to ascii by adding 48.
 		Encode(ADD_EDX1);
@@ -222,161 +511,144 @@ void InstructionsClass::PrintIntegerLinux64()
 		Encode((unsigned char)0);
 
 		// repeat loop1 while quotient != 0. Encode the jump.
-		unsigned char *end_divide_loop = GetAddress() + 2;
+		int end_divide_loop = GetAddress() + 2;
 		Encode(JNE);
 		Encode((unsigned char)(divide_loop-end_divide_loop));
 	// End of loop1.
 
 	// Beginning of loop2. 
-	// It pops and prints all ascii characters.
-		unsigned char *print_loop = GetAddress();
+	// It pops all ascii characters into the buffer.
+		int print_loop = GetAddress();
 
-		// Code to print a character using syscall:
-		{
 		Encode(POP_EAX);
-		Encode(EAX_TO_MEM);
-		Encode(&mPrintInteger);
-
+		Encode(AL_TO_AT_EDI1);
+		Encode(AL_TO_AT_EDI2);
 		Encode(BIT64);
-		Encode(IMMEDIATE_TO_ESI); // move into ESI
-		Encode(&mPrintInteger); // address of bytes to print
-
-		Encode(IMMEDIATE_TO_EAX);
-		Encode((int)1); // 1 for print syscall
-
-		Encode(IMMEDIATE_TO_EDI);
-		Encode((int)1); // 1 for stdout port
-
-		Encode(IMMEDIATE_TO_EDX);
-		Encode((int)1); // length of bytes to print
-
-		// Engage 64 bit syscall with special codes 0x0F, 0x05
-		// The EAX register indicates which syscall (print)
-		// The EDI tells which port to print to (stdout)
-		// The ESI contains the address to print
-		// The EDX says how many bytes to print
-		Encode(PUSH_ECX); // First save important registers
-		Encode((unsigned char)SYS_CALL1);
-		Encode((unsigned char)SYS_CALL2);
-		Encode(POP_ECX); // Restore important register
-		}
+		Encode(INC_EDI1);
+		Encode(INC_EDI2);
 
 		// Decrement the count of characters left to print
 		Encode(SUB_ECX1);
 		Encode(SUB_ECX2);
 		Encode((unsigned char)1);
 
-		// Are there no characters left to print?
-		Encode(CMP_ECX1);
-		Encode(CMP_ECX2);
-		Encode((unsigned char)0);
-
 		// Repeat loop if there are more characters to print
-		unsigned char *end_print_loop = GetAddress() + 2;
+		int end_print_loop = GetAddress() + 2;
 		Encode(JNE);
 		Encode((unsigned char)(print_loop-end_print_loop));
 	// End of loop2.
 
 	// Separate multiple printed items with a space.
-	WriteSpaceLinux64();
+	Encode(BYTE_TO_AT_EDI1);
+	Encode(BYTE_TO_AT_EDI2);
+	Encode((unsigned char)' ');
+	Encode(BIT64);
+	Encode(INC_EDI1);
+	Encode(INC_EDI2);
+
+	// The new length is how far EDI got into the buffer.
+	Encode(BIT64);
+	Encode(MOV_EAX_EDI1);
+	Encode(MOV_EAX_EDI2);
+	EncodeContextAccess(LEA, ESI_REGISTER, offsetof(ExecutionContext, buffer), true);
+	Encode(BIT64);
+	Encode(SUB_EAX_ESI1);
+	Encode(SUB_EAX_ESI2);
+	EncodeContextAccess(MOV_RM_REG, EAX_REGISTER, offsetof(ExecutionContext, length));
 
 	// Restore Callee-Saved registers:
 	Encode(POP_EDI);
 	Encode(POP_ESI);
 	Encode(POP_EBX);
-	// All functions end this way:
-	Encode(POP_EBP);
 	Encode(NEAR_RET);
 }
 
-// 64 bit print syscall Taken from:
-// https://stackoverflow.com/questions/22503944/using-interrupt-0x80-on-64-bit-linux
-void InstructionsClass::WriteMinusLinux64()
-{
-	Encode(IMMEDIATE_TO_EAX);
-	Encode((int)1); // 1 for print syscall
-
-	Encode(IMMEDIATE_TO_EDI);
-	Encode((int)1); // 1 for stdout port
-
-	Encode(BIT64);
-	Encode(IMMEDIATE_TO_ESI); 
-	Encode(&mMinusString); // address of bytes to print
-
-	Encode(IMMEDIATE_TO_EDX);
-	Encode((int)1); // length of bytes to print
-
-	// 64 bit syscall:
-	Encode((unsigned char)SYS_CALL1);
-	Encode((unsigned char)SYS_CALL2);
-}
-
-void InstructionsClass::WriteSpaceLinux64()
+// Adds a newline to the output buffer, flushing first if it is full.
+void InstructionsClass::WriteEndRoutine()
 {
-	Encode(IMMEDIATE_TO_EAX);
-	Encode((int)1); // 1 for print syscall
-
-	Encode(IMMEDIATE_TO_EDI);
-	Encode((int)1); // 1 for stdout port
+	EncodeContextAccess(MOV_REG_RM, EAX_REGISTER, offsetof(ExecutionContext, length));
+	Encode(CMP_EAX_IMMEDIATE);
+	Encode((int)(OUTPUT_BUFFER_SIZE - 1));
+	Encode(JLE);
+	int fillInRoom = mCurrent;
+	Encode((unsigned char)0);
+	Call(mStartOfFlush);
+	mCode[fillInRoom] = (unsigned char)(mCurrent - (fillInRoom + 1));
 
+	EncodeContextAccess(MOV_REG_RM, ECX_REGISTER, offsetof(ExecutionContext, length));
+	EncodeContextAccess(LEA, EDI_REGISTER, offsetof(ExecutionContext, buffer), true);
 	Encode(BIT64);
-	Encode(IMMEDIATE_TO_ESI); 
-	Encode(&mSpaceString); // address of bytes to print
-
-	Encode(IMMEDIATE_TO_EDX);
-	Encode((int)1); // length of bytes to print
-
-	// 64 bit syscall:
-	Encode((unsigned char)SYS_CALL1);
-	Encode((unsigned char)SYS_CALL2);
+	Encode(ADD_EDI_ECX1);
+	Encode(ADD_EDI_ECX2);
+	Encode(BYTE_TO_AT_EDI1);
+	Encode(BYTE_TO_AT_EDI2);
+	Encode((unsigned char)'\n');
+	Encode(INC_ECX1);
+	Encode(INC_ECX2);
+	EncodeContextAccess(MOV_RM_REG, ECX_REGISTER, offsetof(ExecutionContext, length));
+	Encode(NEAR_RET);
 }
 
 void InstructionsClass::PopAndWrite()
 {
-	// Move the integer to be printed from stack to mPrintInteger:
+	// The print routine takes the integer in EAX.
+	BeginInstruction(POP_EAX_INSTRUCTION);
 	Encode(POP_EAX);
-	Encode(EAX_TO_MEM);
-	Encode(&mPrintInteger);
 
-	// Call previously coded function that prints mPrintInteger
-	Call( (void*) &(mCode[mStartOfPrint])); 
-		// &(mCode[mStartOfPrint])is where PrintIntegerLinux64 is.
+	// Call previously coded function that prints EAX
+	Call(mStartOfPrint); 
+		// mStartOfPrint is where PrintIntegerLinux64 is.
 }
 
 void InstructionsClass::PopAndStore(int index)
 {
+	if (IsPromoted(index))
+	{
+		PopRegister(PromotedRegister(index));
+		return;
+	}
     // Remove the integer from the stack and move it to the EAX register
+    BeginInstruction(POP_EAX_INSTRUCTION);
     Encode(POP_EAX);
 
-    // Move the value from the EAX register to the correct RAM address
-    Encode(EAX_TO_MEM);
-    Encode(GetMem(index)); // Get the RAM address using GetMem and encode it
+    // Move the value from the EAX register to the variable
+    BeginInstruction(STORE_VARIABLE_INSTRUCTION, index);
+    EncodeDataAccess(MOV_RM_REG, EAX_REGISTER, index);
 }
 
-void InstructionsClass::PopAndStoreTemp()
+InstructionsClass::~InstructionsClass()
 {
-	Encode(POP_EAX);
-	Encode(EAX_TO_MEM);
-	Encode(&mTempInteger);
+	FreeContext(mContext);
 }
 
-void InstructionsClass::Call(void * function_address)
+// Calls the routine coded at function_address in mCode.
+void InstructionsClass::Call(int function_address)
 {
-	unsigned char * a1 = (unsigned char*)function_address;
-	unsigned char * a2 = (unsigned char*)(&mCode[mCurrent+5]);
-	int offset = (int)(a1 - a2);
+	int offset = function_address - (mCurrent + 5);
+	BeginInstruction(CALL_INSTRUCTION, function_address);
 	Encode(CALL);
+	Relocation call = {mCurrent, CALL_RELOCATION, function_address};
+	mRelocations.push_back(call);
 	Encode(offset);
 }
 
-unsigned char * InstructionsClass::GetAddress()
+int InstructionsClass::GetAddress()
 {
-	return &(mCode[mCurrent]);
+	return mCurrent;
 }
 
 
 void InstructionsClass::Finish(){
+	// Anything still buffered goes out before main returns.
+	Call(mStartOfFlush);
+
     // Retore Callee-Saved registers:
+	BeginInstruction(OPAQUE_INSTRUCTION);
+	for (int reg = R15_REGISTER; reg >= R12_REGISTER; reg--)
+	{
+		Encode(REX_B_PREFIX);
+		Encode((unsigned char)(POP_EAX + (reg & 7)));
+	}
 	Encode(POP_EDI);
 	Encode(POP_ESI);
 	Encode(POP_EBX);
@@ -385,165 +657,536 @@ void InstructionsClass::Finish(){
 	Encode(POP_EBP);
 	Encode(NEAR_RET);
 
+	Relayout();
 
 	// std::cout << "Finished creating " << mCurrent << 
 	// 	" bytes of machine code" << std::endl;
 }
 
 void InstructionsClass::Execute(){
+	Execute(mContext);
+	// Did everything work?
+	std::cout << "\nThere and back again!" << std::endl; 
+}
+
+unsigned char * InstructionsClass::MakeExecutable()
+{
+	try{
+		return mMemory.MakeExecutable();
+	}catch (std::runtime_error &e){
+		std::cerr << "Error.  " << e.what() << "." << std::endl;
+		exit(1);
+	}
+}
+
+// Where a fault in main jumps back to, on the thread that is executing
+// it, or NULL while the thread is not.
+static thread_local sigjmp_buf * tFaultReturn = NULL;
+
+// Generated code divides with idiv, which raises SIGFPE for a zero
+// divisor or INT_MIN / -1. Inside Execute that ends just the one
+// execution. Anywhere else the default action is put back, so the
+// faulting instruction runs again and ends the process as it always did.
+static void HandleFault(int signalNumber)
+{
+	if (tFaultReturn)
+	{
+		siglongjmp(*tFaultReturn, 1);
+	}
+	signal(signalNumber, SIG_DFL);
+}
+
+static void InstallFaultHandler()
+{
+	static std::once_flag installed;
+	std::call_once(installed, []() {
+		struct sigaction action;
+		memset(&action, 0, sizeof(action));
+		action.sa_handler = HandleFault;
+		sigemptyset(&action.sa_mask);
+		sigaction(SIGFPE, &action, NULL);
+	});
+}
+
+// What main buffered before it faulted, which it never got to flush.
+static void FlushContext(ExecutionContext * context)
+{
+	int written = 0;
+	while (written < context->length)
+	{
+		ssize_t n = write(context->fileDescriptor, context->buffer + written, context->length - written);
+		if (n <= 0)
+		{
+			break;
+		}
+		written += (int)n;
+	}
+	context->length = 0;
+}
+
+// The code is only read from here on, and each execution writes only its
+// own context and stack, so this is safe to call from several threads
+// at once after MakeExecutable.
+void InstructionsClass::Execute(ExecutionContext * context){
 	// Jump into the main function of what we just coded, 
 	//	found at mCode[mStartOfMain]
 	// std::cout << "About to Execute the machine code..." << std::endl;
+    unsigned char * entry = MakeExecutable();
     try{
-        void * ptr = &(mCode[mStartOfMain]);
+        void * ptr = entry + mStartOfMain;
         // std::cout << "ptr: " << ptr << std::endl;
         try{
-            void (*f)(void);
-            f = (void (*)(void)) ptr ;
-            f();
+            void (*f)(ExecutionContext *);
+            f = (void (*)(ExecutionContext *)) ptr ;
+            InstallFaultHandler();
+            sigjmp_buf faultReturn;
+            if (sigsetjmp(faultReturn, 1) != 0) {
+                tFaultReturn = NULL;
+                FlushContext(context);
+                throw std::runtime_error("Division by zero, or overflow, in main.");
+            }
+            tFaultReturn = &faultReturn;
+            f(context);
+            tFaultReturn = NULL;
         }
         catch(std::bad_alloc &e){
             std::cerr << "Error.  Could not execute the machine code." << std::endl;
             exit(1);
         }
-        // Did everything work?
-        std::cout << "\nThere and back again!" << std::endl; 
     }catch (std::bad_alloc &e){
         std::cerr << "Error.  Could not allocate memory for the machine code." << std::endl;
         std::cerr << "Error.  Could not execute the machine code." << std::endl;
         exit(1);
     } 
+}
 
-
+// Fresh anonymous pages read as zeros, and only those a variable
+// touches are ever backed, so this is cheap however big mDataSize is.
+ExecutionContext * InstructionsClass::NewContext() const
+{
+	ExecutionContext * context = (ExecutionContext *)MapMemory(
+		CONTEXT_SIZE + (size_t)mDataSize * sizeof(int), PROT_READ | PROT_WRITE, MAP_NORESERVE);
+	context->fileDescriptor = mOutput->GetFileDescriptor();
+	return context;
 }
 
-void InstructionsClass::Encode(int x){
+void InstructionsClass::FreeContext(ExecutionContext * context) const
+{
+	munmap(context, CONTEXT_SIZE + (size_t)mDataSize * sizeof(int));
+}
 
-    if(mCurrent + sizeof(unsigned char) < MAX_INSTRUCTIONS)
+void InstructionsClass::Relocate(unsigned char * code) const
+{
+	for (const Relocation & relocation : mRelocations)
 	{
-        *((int *) (&mCode[mCurrent])) = x;
-        mCurrent += sizeof(int);
+		int offset = relocation.target - (relocation.site + (int)sizeof(int));
+		memcpy(code + relocation.site, &offset, sizeof(offset));
 	}
-	else
+}
+
+static void AppendInt(std::vector<unsigned char> & bytes, int x)
+{
+	unsigned char little[sizeof(int)];
+	memcpy(little, &x, sizeof(int));
+	bytes.insert(bytes.end(), little, little + sizeof(int));
+}
+
+// The executable's data segment is an ExecutionContext, with only the
+// file descriptor set, and then the variables, which the kernel zeros.
+// The code goes out as it is, and a stub after it does what Execute
+// does: passes main the context in RDI. Then it exits.
+void InstructionsClass::WriteExecutable(const std::string & filename)
+{
+	std::vector<unsigned char> data(CONTEXT_SIZE, 0);
+	int fileDescriptor = mOutput->GetFileDescriptor();
+	memcpy(&data[offsetof(ExecutionContext, fileDescriptor)], &fileDescriptor, sizeof(int));
+
+	// lea rdi, [rip + context]; call main; mov eax, exit; xor edi, edi; syscall
+	const int STUB_SIZE = 7 + 5 + 5 + 2 + 2;
+	const int EXIT_SYSCALL = 60;
+	std::vector<unsigned char> text(mCode, mCode + mCurrent);
+	ElfWriterClass elf(text.size() + STUB_SIZE, data.size(), (size_t)mDataSize * sizeof(int));
+
+	int entry = (int)text.size();
+	text.push_back((unsigned char)(REX | REX_W));
+	text.push_back(LEA);
+	text.push_back((unsigned char)(((EDI_REGISTER & 7) << 3) | EBP_REGISTER)); // [rip + 4 bytes]
+	AppendInt(text, (int)(elf.GetDataAddress() - (elf.GetTextAddress() + entry + 7)));
+	text.push_back(CALL);
+	AppendInt(text, mStartOfMain - (entry + 12));
+	text.push_back(IMMEDIATE_TO_EAX);
+	AppendInt(text, EXIT_SYSCALL);
+	text.push_back(XOR_RM_REG);
+	text.push_back((unsigned char)(MODRM_REGISTERS | (EDI_REGISTER << 3) | EDI_REGISTER));
+	text.push_back(SYS_CALL1);
+	text.push_back(SYS_CALL2);
+	elf.Write(filename, text, entry, data);
+}
+
+// An image is CODE_IMAGE_MAGIC, then the data size, where main starts,
+// the code size and the number of relocations, then the code, then each
+// relocation's site, kind and target.
+const char CODE_IMAGE_MAGIC[8] = {'S', 'C', 'C', 'O', 'D', 'E', '0', '3'};
+const int RELOCATION_INTS = 3;
+
+static bool ReadInt(const unsigned char * image, size_t size, size_t & at, int & x)
+{
+	if (size - at < sizeof(int))
 	{
-		std::cerr << "Error.  Used up all " << MAX_INSTRUCTIONS 
-			<< " instructions." << std::endl;
-		exit(1);
+		return false;
 	}
+	memcpy(&x, image + at, sizeof(int));
+	at += sizeof(int);
+	return true;
 }
 
-void InstructionsClass::Encode(long long x) {
-    if (mCurrent + sizeof(long long) < MAX_INSTRUCTIONS) {
-        *((long long *)(&mCode[mCurrent])) = x;
-        mCurrent += sizeof(long long);
-    } else {
-        std::cerr << "Error.  Used up all " << MAX_INSTRUCTIONS 
-                  << " instructions." << std::endl;
-        exit(1);
-    }
+void InstructionsClass::SaveCode(std::vector<unsigned char> & image) const
+{
+	image.assign(CODE_IMAGE_MAGIC, CODE_IMAGE_MAGIC + sizeof(CODE_IMAGE_MAGIC));
+	AppendInt(image, mDataSize);
+	AppendInt(image, mStartOfMain);
+	AppendInt(image, mCurrent);
+	AppendInt(image, (int)mRelocations.size());
+	image.insert(image.end(), mCode, mCode + mCurrent);
+	for (const Relocation & relocation : mRelocations)
+	{
+		AppendInt(image, relocation.site);
+		AppendInt(image, (int)relocation.kind);
+		AppendInt(image, relocation.target);
+	}
 }
 
-void InstructionsClass::Encode(void * p){
-        int pointerSize = sizeof(p);
+bool InstructionsClass::LoadCode(const unsigned char * image, size_t size)
+{
+	size_t at = sizeof(CODE_IMAGE_MAGIC);
+	int dataSize, startOfMain, codeSize, relocationCount;
+	if (size < at || memcmp(image, CODE_IMAGE_MAGIC, at) != 0
+		|| !ReadInt(image, size, at, dataSize) || !ReadInt(image, size, at, startOfMain)
+		|| !ReadInt(image, size, at, codeSize) || !ReadInt(image, size, at, relocationCount)
+		|| dataSize != mDataSize || codeSize < 0 || relocationCount < 0
+		|| startOfMain < 0 || startOfMain >= codeSize
+		|| size - at != (size_t)codeSize + (size_t)relocationCount * RELOCATION_INTS * sizeof(int))
+	{
+		return false;
+	}
+	const unsigned char * code = image + at;
+	at += codeSize;
+	std::vector<Relocation> relocations;
+	for (int i = 0; i < relocationCount; i++)
+	{
+		int site, kind, target;
+		ReadInt(image, size, at, site);
+		ReadInt(image, size, at, kind);
+		ReadInt(image, size, at, target);
+		if (kind != CALL_RELOCATION || site < 0 || site > codeSize - (int)sizeof(int)
+			|| target < 0 || target >= codeSize)
+		{
+			return false;
+		}
+		Relocation relocation = {site, (RelocationKind)kind, target};
+		relocations.push_back(relocation);
+	}
 
-        if (pointerSize==4)
-        {
-                Encode((int)(long long)p);
-        }
-        else if(sizeof(p)==8)
-        {
-                Encode((long long)p);
-        }
+	mCurrent = 0;
+	Reserve(codeSize);
+	memcpy(mCode, code, codeSize);
+	mCurrent = codeSize;
+	mStartOfMain = startOfMain;
+	mInstructions.clear();
+	mJumpTargets.clear();
+	mRelocations.swap(relocations);
+	Relocate(mCode);
+	return true;
+}
+
+void InstructionsClass::Encode(int x){
+    Reserve(sizeof(int));
+    memcpy(mCode + mCurrent, &x, sizeof(int));
+    mCurrent += sizeof(int);
 }
 
 void InstructionsClass::PushValue(int value){
+    BeginInstruction(LOAD_IMMEDIATE_INSTRUCTION, value);
     Encode(IMMEDIATE_TO_EAX);
     Encode(value);
+    BeginInstruction(PUSH_EAX_INSTRUCTION);
     Encode(PUSH_EAX);
 }
 
 void InstructionsClass::PushVariable(int p){
-    Encode(MEM_TO_EAX);
-    Encode(GetMem(p));
+    if (IsPromoted(p)) {
+        PushRegister(PromotedRegister(p));
+        return;
+    }
+    BeginInstruction(LOAD_VARIABLE_INSTRUCTION, p);
+    EncodeDataAccess(MOV_REG_RM, EAX_REGISTER, p);
+    BeginInstruction(PUSH_EAX_INSTRUCTION);
     Encode(PUSH_EAX);
 }
 
-int *InstructionsClass::GetMem(int index){
-    if (index < 0 || index >= MAX_DATA) {
+// How far the variable at index is from RBP.
+int InstructionsClass::GetDisplacement(int index){
+    if (index < 0 || index >= mDataSize) {
         std::cerr << "Error.  Index out of bounds." << std::endl;
         exit(1);
     }
-    return &(mData[index]);
+    return index * (int)sizeof(int) - DATA_BASE_BIAS;
+}
+
+// opcode with reg and the variable at index, e.g. mov reg, [rbp + d].
+void InstructionsClass::EncodeDataAccess(unsigned char opcode, RegisterType reg, int index)
+{
+	int displacement = GetDisplacement(index);
+	if (reg >= 8)
+	{
+		Encode((unsigned char)(REX | REX_R));
+	}
+	Encode(opcode);
+	bool small = displacement >= -128 && displacement <= 127;
+	Encode((unsigned char)((small ? MODRM_DISP8 : MODRM_DISP32) |
+		((reg & 7) << 3) | (EBP_REGISTER & 7)));
+	if (small)
+	{
+		Encode((unsigned char)displacement);
+	}
+	else
+	{
+		Encode(displacement);
+	}
 }
 
 void InstructionsClass::PopPopDivPush()
 {
+    BeginInstruction(POP_EBX_INSTRUCTION);
     Encode(POP_EBX);
+    BeginInstruction(POP_EAX_INSTRUCTION);
     Encode(POP_EAX);
+    BeginInstruction(OPAQUE_INSTRUCTION);
     Encode(CDQ); // Necessary to clear the EDX before the divide.
     Encode(DIV_EAX_EBX1); // Divide EAX by EBX. Result in EAX.
     Encode(DIV_EAX_EBX2);
+    BeginInstruction(PUSH_EAX_INSTRUCTION);
     Encode(PUSH_EAX);
 }
 
 void InstructionsClass::PopPopAddPush()
 {
+    BeginInstruction(POP_EBX_INSTRUCTION);
     Encode(POP_EBX);
+    BeginInstruction(POP_EAX_INSTRUCTION);
     Encode(POP_EAX);
+    BeginInstruction(OPAQUE_INSTRUCTION);
     Encode(ADD_EAX_EBX1);
     Encode(ADD_EAX_EBX2);
+    BeginInstruction(PUSH_EAX_INSTRUCTION);
     Encode(PUSH_EAX);
 }
 
 void InstructionsClass::PopPopMulPush()
 {
+    BeginInstruction(POP_EBX_INSTRUCTION);
     Encode(POP_EBX);
+    BeginInstruction(POP_EAX_INSTRUCTION);
     Encode(POP_EAX);
+    BeginInstruction(OPAQUE_INSTRUCTION);
     Encode(MUL_EAX_EBX1);
     Encode(MUL_EAX_EBX2);
+    BeginInstruction(PUSH_EAX_INSTRUCTION);
     Encode(PUSH_EAX);
 }
 
 void InstructionsClass::PopPopModPush()
 {
+	BeginInstruction(POP_EBX_INSTRUCTION);
 	Encode(POP_EBX);
+	BeginInstruction(POP_EAX_INSTRUCTION);
 	Encode(POP_EAX);
+	BeginInstruction(OPAQUE_INSTRUCTION);
 	Encode(CDQ);
 	Encode(DIV_EAX_EBX1);
 	Encode(DIV_EAX_EBX2);
 	Encode(PUSH_EDX);
 }
 
+// The same with a constant right side, which is usually cheaper than a
+// multiply or divide instruction. See MultiplyConstant and DivideConstant.
+void InstructionsClass::PopMulConstantPush(int value)
+{
+	BeginInstruction(POP_EAX_INSTRUCTION);
+	Encode(POP_EAX);
+	MultiplyConstant(EAX_REGISTER, value);
+	BeginInstruction(PUSH_EAX_INSTRUCTION);
+	Encode(PUSH_EAX);
+}
+
+void InstructionsClass::PopDivConstantPush(int value)
+{
+	BeginInstruction(POP_EAX_INSTRUCTION);
+	Encode(POP_EAX);
+	DivideConstant(EAX_REGISTER, value, false);
+	BeginInstruction(PUSH_EAX_INSTRUCTION);
+	Encode(PUSH_EAX);
+}
+
+void InstructionsClass::PopModConstantPush(int value)
+{
+	BeginInstruction(POP_EAX_INSTRUCTION);
+	Encode(POP_EAX);
+	DivideConstant(EAX_REGISTER, value, true);
+	BeginInstruction(PUSH_EAX_INSTRUCTION);
+	Encode(PUSH_EAX);
+}
+
+// Integer power by repeated squaring: at most two multiplies per
+// bit of the exponent. A negative exponent gives what truncating
+// 1 / base**-exponent would: 0, except for bases 1 and -1.
 void InstructionsClass::PopPopExponentPush()
 {
-	Encode(POP_EBX);
+	BeginInstruction(OPAQUE_INSTRUCTION);
+	Encode(POP_EDX); // exponent
+	Encode(POP_ECX); // base
+	ExponentLoop();
+	BeginInstruction(PUSH_EAX_INSTRUCTION);
+	Encode(PUSH_EAX);
+}
+
+// Raises ECX to the power EDX, leaving the result in EAX.
+// ECX is squared each time around the loop and EDX shifted down.
+void InstructionsClass::ExponentLoop()
+{
+	Encode(TEST_EDX_EDX1);
+	Encode(TEST_EDX_EDX2);
+	Encode(JGE);
+	int fillInNotNegative = mCurrent;
+	Encode((unsigned char)0);
+
+		// Negative exponent. Only -1, 0 and 1 are worth working out;
+		// for those, base**-n truncates the same as base**n.
+		Encode(MOV_EAX_ECX1);
+		Encode(MOV_EAX_ECX2);
+		Encode(ADD_EAX1);
+		Encode(ADD_EAX2);
+		Encode((unsigned char)1);
+		Encode(CMP_EAX1);
+		Encode(CMP_EAX2);
+		Encode((unsigned char)2);
+		Encode(JA);
+		int fillInZero = mCurrent;
+		Encode((unsigned char)0);
+		Encode(NEG_EDX1);
+		Encode(NEG_EDX2);
+
+	mCode[fillInNotNegative] = (unsigned char)(mCurrent - (fillInNotNegative + 1));
+	Encode(IMMEDIATE_TO_EAX); // result
+	Encode((int)1);
+	Encode(TEST_EDX_EDX1);
+	Encode(TEST_EDX_EDX2);
+	Encode(JE);
+	int fillInDone1 = mCurrent;
+	Encode((unsigned char)0);
+
+	// Loop over the bits of the exponent, low to high.
+		int power_loop = GetAddress();
+
+		// Multiply in this power of the base if its bit is set.
+		Encode(TEST_DL1);
+		Encode(TEST_DL2);
+		Encode((unsigned char)1);
+		Encode(JE);
+		int fillInSkip = mCurrent;
+		Encode((unsigned char)0);
+		Encode(IMUL1);
+		Encode(IMUL2);
+		Encode(IMUL_EAX_ECX);
+		mCode[fillInSkip] = (unsigned char)(mCurrent - (fillInSkip + 1));
+
+		// Done when no bits are left, otherwise square the base.
+		Encode(SHR_EDX_1_1);
+		Encode(SHR_EDX_1_2);
+		Encode(JE);
+		int fillInDone2 = mCurrent;
+		Encode((unsigned char)0);
+		Encode(IMUL1);
+		Encode(IMUL2);
+		Encode(IMUL_ECX_ECX);
+		int end_power_loop = GetAddress() + 2;
+		Encode(JUMP_ALWAYS);
+		Encode((unsigned char)(power_loop - end_power_loop));
+
+	// Base other than -1, 0 or 1 to a negative power.
+	mCode[fillInZero] = (unsigned char)(mCurrent - (fillInZero + 1));
+	Encode(XOR_EAX_EAX1);
+	Encode(XOR_EAX_EAX2);
+
+	mCode[fillInDone1] = (unsigned char)(mCurrent - (fillInDone1 + 1));
+	mCode[fillInDone2] = (unsigned char)(mCurrent - (fillInDone2 + 1));
+}
+
+// For an exponent known at compile time the squaring loop is unrolled
+// into straight multiplies, left to right over the exponent's bits:
+// x**2 is one multiply, x**3 two, x**10 four.
+void InstructionsClass::PopExponentConstantPush(int exponent)
+{
+	if (exponent < 0)
+	{
+		PushValue(exponent);
+		PopPopExponentPush();
+		return;
+	}
+	BeginInstruction(POP_EAX_INSTRUCTION);
 	Encode(POP_EAX);
-	Encode(IMMEDIATE_TO_ECX);
-	Encode((int)2);
-	Encode(POP_EBX);
-	Encode(CMP_EAX_EBX1);
-	Encode(CMP_EAX_EBX2);
-	Encode(JE); 
-	Encode((unsigned char)7);
-	Encode(IMMEDIATE_TO_EAX); 
-	Encode(1);
-	Encode(PUSH_EAX); 
+	BeginInstruction(OPAQUE_INSTRUCTION);
+	ExponentConstant(EAX_REGISTER, exponent);
+	BeginInstruction(PUSH_EAX_INSTRUCTION);
+	Encode(PUSH_EAX);
+}
+
+// Raises reg to a power of 0 or more in place. Uses ECX for the base.
+void InstructionsClass::ExponentConstant(RegisterType reg, int exponent)
+{
+	if (exponent == 0)
+	{
+		LoadValue(reg, 1);
+		return;
+	}
+
+	MoveRegister(ECX_REGISTER, reg);
+	int highBit = 30;
+	while (!(exponent & (1 << highBit)))
+	{
+		highBit--;
+	}
+	for (int bit = highBit - 1; bit >= 0; bit--)
+	{
+		OperateRegisters(TIMES_TOKEN, reg, reg);
+		if (exponent & (1 << bit))
+		{
+			OperateRegisters(TIMES_TOKEN, reg, ECX_REGISTER);
+		}
+	}
 }
 
 void InstructionsClass::PopPopSubPush()
 {
+    BeginInstruction(POP_EBX_INSTRUCTION);
     Encode(POP_EBX);
+    BeginInstruction(POP_EAX_INSTRUCTION);
     Encode(POP_EAX);
+    BeginInstruction(OPAQUE_INSTRUCTION);
     Encode(SUB_EAX_EBX1);
     Encode(SUB_EAX_EBX2);
+    BeginInstruction(PUSH_EAX_INSTRUCTION);
     Encode(PUSH_EAX);
 }
 
 void InstructionsClass::PopPopComparePush(unsigned char
     relational_operator)
 {
+    BeginInstruction(POP_EBX_INSTRUCTION);
     Encode(POP_EBX);
+    BeginInstruction(POP_EAX_INSTRUCTION);
     Encode(POP_EAX);
+    BeginInstruction(OPAQUE_INSTRUCTION);
     Encode(CMP_EAX_EBX1);
     Encode(CMP_EAX_EBX2); // The FLAG register is now set.
     Encode(IMMEDIATE_TO_EAX); // load A register with 1
@@ -552,6 +1195,7 @@ void InstructionsClass::PopPopComparePush(unsigned char
     Encode((unsigned char)5);
     Encode(IMMEDIATE_TO_EAX); // load A register with 0
     Encode(0);
+    BeginInstruction(PUSH_EAX_INSTRUCTION);
     Encode(PUSH_EAX); // push 1 or 0
 }
 
@@ -581,130 +1225,1049 @@ void InstructionsClass::PopPopNotEqualPush()
         PopPopComparePush(JNE);
 }
 
-void InstructionsClass::PopPopAndPush()
-{
-        Encode(IMMEDIATE_TO_EAX); // load A register with 0
-        Encode(0);
-        Encode(POP_EBX); // load B register with stack item 2
-        Encode(CMP_EAX_EBX1);
-        Encode(CMP_EAX_EBX2);
-        Encode(POP_EBX); // load B register with stack item 1
-        Encode(JE); // if stack item 2 is zero, jump to FALSE code
-        Encode((unsigned char)11);
-        Encode(CMP_EAX_EBX1);
-        Encode(CMP_EAX_EBX2);
-        Encode(JE); // if stack item 1 is zero, jump to FALSE code
-        Encode((unsigned char)7);
-        // TRUE code:
-        Encode(IMMEDIATE_TO_EAX); // load A register with 1
-        Encode(1);
-        Encode(JUMP_ALWAYS); // Jump around FALSE code
-        Encode((unsigned char)5);
-        // FALSE code:
-        Encode(IMMEDIATE_TO_EAX); // load A register with 0
-        Encode(0);
-        // Save A to the stack
-        Encode(PUSH_EAX); // push 1 or 0
-}
-
-void InstructionsClass::PopPopOrPush()
-{
-        Encode(IMMEDIATE_TO_EAX); // load A register with 0
-        Encode(0);
-        Encode(POP_EBX); // load B register with stack item 2
-        Encode(CMP_EAX_EBX1);
-        Encode(CMP_EAX_EBX2);
-        Encode(POP_EBX); // load B register with stack item 1
-        Encode(JNE); // if stack item 2 is not zero, jump to TRUE code
-        Encode((unsigned char)11);
-        Encode(CMP_EAX_EBX1);
-        Encode(CMP_EAX_EBX2);
-        Encode(JNE); // if stack item 1 is not zero, jump to TRUE code
-        Encode((unsigned char)7);
-        // FALSE code:
-        Encode(IMMEDIATE_TO_EAX); // load A register with 0
-        Encode(0);
-        Encode(JUMP_ALWAYS); // Jump around TRUE code
-        Encode((unsigned char)5);
-        // TRUE code:
-        Encode(IMMEDIATE_TO_EAX); // load A register with 1
-        Encode(1);
-        // Save A to the stack
-        Encode(PUSH_EAX); // push 1 or 0
-}
-
-void InstructionsClass::PushTemp()
-{
-	Encode(MEM_TO_EAX);
-	Encode(&mTempInteger);
-	Encode(PUSH_EAX);
-}
-
-unsigned char *InstructionsClass::SkipIfZeroStack()
+int InstructionsClass::SkipIfZeroStack()
 {
-        Encode(POP_EBX);
-        Encode(IMMEDIATE_TO_EAX); // load A register with 0
-        Encode(0);
-        Encode(CMP_EAX_EBX1);
-        Encode(CMP_EAX_EBX2);
+        BeginInstruction(POP_EAX_INSTRUCTION);
+        Encode(POP_EAX);
+        BeginInstruction(OPAQUE_INSTRUCTION);
+        Encode(TEST_EAX_EAX1);
+        Encode(TEST_EAX_EAX2);
+        BeginInstruction(JUMP_INSTRUCTION);
         Encode(JE_FAR1); // If stack had zero, do a jump
         Encode(JE_FAR2);
-        unsigned char * addressToFillInLater = GetAddress();
+        int addressToFillInLater = GetAddress();
         Encode(0); // the exact number of bytes to skip gets set later,
                    // when we know it!  Call SetOffset() to do that.
         return addressToFillInLater;
 }
 
-unsigned char *  InstructionsClass::Jump()
+int InstructionsClass::SkipIfNotZeroStack()
 {
-        Encode(JUMP_ALWAYS_FAR);
-        unsigned char * addressToFillInLater = GetAddress();
-        Encode(0); // the exact number of bytes to jump gets set later,
-                   // when we know it!  Call SetOffset() to do that.
+        BeginInstruction(POP_EAX_INSTRUCTION);
+        Encode(POP_EAX);
+        BeginInstruction(OPAQUE_INSTRUCTION);
+        Encode(TEST_EAX_EAX1);
+        Encode(TEST_EAX_EAX2);
+        BeginInstruction(JUMP_INSTRUCTION);
+        Encode(JNE_FAR1); // If stack had non zero, do a jump
+        Encode(JNE_FAR2);
+        int addressToFillInLater = GetAddress();
+        Encode(0); // Call SetOffset() or SetOffsets() later.
         return addressToFillInLater;
 }
 
-void InstructionsClass::SetOffset(unsigned char * codeAddress, int offset)
+// Compares the top two stack items and jumps if the comparison holds,
+// without first turning it into a 0 or 1 on the stack.
+int InstructionsClass::PopPopCompareJump(ComparisonType comparison)
 {
-        *((int*)codeAddress) = offset;
+        BeginInstruction(POP_EBX_INSTRUCTION);
+        Encode(POP_EBX);
+        BeginInstruction(POP_EAX_INSTRUCTION);
+        Encode(POP_EAX);
+        BeginInstruction(OPAQUE_INSTRUCTION);
+        Encode(CMP_EAX_EBX1);
+        Encode(CMP_EAX_EBX2); // The FLAG register is now set.
+        BeginInstruction(JUMP_INSTRUCTION);
+        Encode(JE_FAR1); // Far jumps are the short ones plus 0x10
+        Encode((unsigned char)(ConditionCode(comparison) + 0x10));
+        int addressToFillInLater = GetAddress();
+        Encode(0); // Call SetOffset() or SetOffsets() later.
+        return addressToFillInLater;
 }
 
-void InstructionsClass::PrintAllMachineCodes()
+ComparisonType InstructionsClass::Opposite(ComparisonType comparison)
 {
-	for (int i=0; i<mCurrent; i++)
-	{
-	printf("HEX: %2x  Decimal: %3i\n", (int)mCode[i], (int)mCode[i]);
-	}
+        switch (comparison)
+        {
+        case LESS_COMPARE:         return GREATEREQUAL_COMPARE;
+        case LESSEQUAL_COMPARE:    return GREATER_COMPARE;
+        case GREATER_COMPARE:      return LESSEQUAL_COMPARE;
+        case GREATEREQUAL_COMPARE: return LESS_COMPARE;
+        case EQUAL_COMPARE:        return NOTEQUAL_COMPARE;
+        default:                   return EQUAL_COMPARE;
+        }
 }
 
-int InstructionsClass::AllocateSlot()
+// The short conditional jump opcode that is taken when comparison holds.
+unsigned char InstructionsClass::ConditionCode(ComparisonType comparison)
 {
-    return NextFreeSlot++;
+        switch (comparison)
+        {
+        case LESS_COMPARE:         return JL;
+        case LESSEQUAL_COMPARE:    return JLE;
+        case GREATER_COMPARE:      return JG;
+        case GREATEREQUAL_COMPARE: return JGE;
+        case EQUAL_COMPARE:        return JE;
+        default:                   return JNE;
+        }
 }
 
-void InstructionsClass::RegisterVariableSlot(int slot)
+int InstructionsClass::Jump()
 {
-	if (slot+1 > NextFreeSlot)
-	{
-		NextFreeSlot = slot + 1;
+        BeginInstruction(JUMP_INSTRUCTION);
+        Encode(JUMP_ALWAYS_FAR);
+        int addressToFillInLater = GetAddress();
+        Encode(0); // the exact number of bytes to jump gets set later,
+                   // when we know it!  Call SetOffset() to do that.
+        return addressToFillInLater;
+}
+
+void InstructionsClass::SetOffset(int codeAddress, int offset)
+{
+        memcpy(mCode + codeAddress, &offset, sizeof(offset));
+        // Remembered so the peephole pass can point it there again.
+        mJumpTargets[codeAddress] = codeAddress + 4 + offset;
+}
+
+// Points every jump in the list at target. Offsets count from the end
+// of the 4 byte offset, which is where the processor is when it jumps.
+void InstructionsClass::SetOffsets(const JumpList & jumps, int target)
+{
+        for (int codeAddress : jumps)
+        {
+                SetOffset(codeAddress, target - (codeAddress + 4));
+        }
+}
+
+void InstructionsClass::PrintAllMachineCodes()
+{
+	for (int i=0; i<mCurrent; i++)
+	{
+	printf("HEX: %2x  Decimal: %3i\n", (int)mCode[i], (int)mCode[i]);
 	}
 }
 
+// Hidden slots follow the symbol table's variables, which count up from
+// 0, once their number is known, and come down from the top otherwise.
+void InstructionsClass::SetVariableCount(int count)
+{
+    mVariableCount = count;
+}
+
+int InstructionsClass::AllocateSlot()
+{
+    if (mVariableCount < 0) {
+        return mDataSize - 1 - NextFreeSlot++;
+    }
+    return mVariableCount + NextFreeSlot++;
+}
+
 void InstructionsClass::WriteEndLinux64()
 {
-	Encode(IMMEDIATE_TO_EAX);
-	Encode((int)1);
+	Call(mStartOfWriteEnd);
+}
 
-	Encode(IMMEDIATE_TO_EDI);
-	Encode((int)1);
+// Register mode.
+// Expressions are coded into registers instead of through the stack.
+// The free registers form a stack of their own (see the Dragon Book's
+// gencode): an expression leaves its value in TopRegister(), and uses
+// registers further down only for its subexpressions. EAX, ECX and EDX
+// are never handed out, so they can be scratch for division, loading
+// variables, and spilled operands. EBX is kept back as well.
 
-	Encode(BIT64);
-	Encode(IMMEDIATE_TO_ESI);
-	Encode(&mEndlString);
+void InstructionsClass::SetRegisterMode(bool on)
+{
+	mRegisterMode = on;
+	// The stack machine pops into EBX, so EBX only holds a loop variable
+	// in register mode.
+	mFreeSavedRegisters.clear();
+	mFreeSavedRegisters.push_back(R15_REGISTER);
+	mFreeSavedRegisters.push_back(R14_REGISTER);
+	mFreeSavedRegisters.push_back(R13_REGISTER);
+	mFreeSavedRegisters.push_back(R12_REGISTER);
+	if (on)
+	{
+		mFreeSavedRegisters.push_back(EBX_REGISTER);
+	}
+}
+
+bool InstructionsClass::UseRegisters() const
+{
+	return mRegisterMode;
+}
+
+RegisterType InstructionsClass::TopRegister() const
+{
+	return mFreeRegisters.back();
+}
+
+RegisterType InstructionsClass::AllocateRegister()
+{
+	RegisterType reg = mFreeRegisters.back();
+	mFreeRegisters.pop_back();
+	return reg;
+}
+
+void InstructionsClass::FreeRegister(RegisterType reg)
+{
+	mFreeRegisters.push_back(reg);
+}
+
+void InstructionsClass::SwapRegisters()
+{
+	int last = (int)mFreeRegisters.size() - 1;
+	RegisterType top = mFreeRegisters[last];
+	mFreeRegisters[last] = mFreeRegisters[last - 1];
+	mFreeRegisters[last - 1] = top;
+}
+
+int InstructionsClass::FreeRegisterCount() const
+{
+	return (int)mFreeRegisters.size();
+}
+
+// A REX prefix is needed for 64 bit operands and for R8 to R15.
+// Every register instruction starts here, so this is also where one
+// is marked for the peephole pass.
+void InstructionsClass::EncodeRex(bool wide, int reg, int rm)
+{
+	BeginInstruction(OPAQUE_INSTRUCTION);
+	if (wide || reg >= 8 || rm >= 8)
+	{
+		Encode((unsigned char)(REX | (wide ? REX_W : 0) |
+			(reg >= 8 ? REX_R : 0) | (rm >= 8 ? REX_B : 0)));
+	}
+}
+
+// The byte after the opcode, for two register operands.
+void InstructionsClass::EncodeModRM(int reg, int rm)
+{
+	Encode((unsigned char)(MODRM_REGISTERS | ((reg & 7) << 3) | (rm & 7)));
+}
+
+// opcode with a register and an r/m register, e.g. add rm, reg.
+void InstructionsClass::EncodeRegisters(unsigned char opcode, int reg, int rm)
+{
+	EncodeRex(false, reg, rm);
+	Encode(opcode);
+	EncodeModRM(reg, rm);
+}
+
+// The 0x81 / 0x83 group: add, sub or cmp rm with an immediate.
+void InstructionsClass::EncodeImmediateGroup(int operation, int rm, int value)
+{
+	EncodeRex(false, 0, rm);
+	if (value >= -128 && value <= 127)
+	{
+		Encode(GROUP_IMMEDIATE8);
+		EncodeModRM(operation, rm);
+		Encode((unsigned char)value);
+	}
+	else
+	{
+		Encode(GROUP_IMMEDIATE32);
+		EncodeModRM(operation, rm);
+		Encode(value);
+	}
+}
+
+// The 0xC1 group: shift rm by count bits.
+void InstructionsClass::EncodeShift(int operation, int rm, int count)
+{
+	EncodeRex(false, 0, rm);
+	Encode(GROUP_SHIFT);
+	EncodeModRM(operation, rm);
+	Encode((unsigned char)count);
+}
+
+// The 0xF7 group: neg, one operand imul and idiv of rm.
+void InstructionsClass::EncodeUnary(int operation, int rm)
+{
+	EncodeRex(false, 0, rm);
+	Encode(IDIV1);
+	EncodeModRM(operation, rm);
+}
+
+// lea dst, [base + index * (1 << scaleBits)]
+void InstructionsClass::EncodeScaledAdd(int dst, int base, int index, int scaleBits)
+{
+	BeginInstruction(OPAQUE_INSTRUCTION);
+	unsigned char rex = (unsigned char)(REX | (dst >= 8 ? REX_R : 0) |
+		(index >= 8 ? REX_X : 0) | (base >= 8 ? REX_B : 0));
+	if (rex != REX)
+	{
+		Encode(rex);
+	}
+	Encode(LEA);
+	// With no displacement, a base of RBP or R13 would mean no base.
+	bool displacement = (base & 7) == EBP_REGISTER;
+	Encode((unsigned char)((displacement ? MODRM_DISP8 : 0) | ((dst & 7) << 3) | MODRM_SIB));
+	Encode((unsigned char)((scaleBits << 6) | ((index & 7) << 3) | (base & 7)));
+	if (displacement)
+	{
+		Encode((unsigned char)0);
+	}
+}
+
+// reg *= value. Powers of two become shifts, and 3, 5 or 9 times a
+// power of two a lea and a shift. Anything else is an imul.
+void InstructionsClass::MultiplyConstant(RegisterType reg, int value)
+{
+	if (value == 0)
+	{
+		LoadValue(reg, 0);
+		return;
+	}
+	unsigned int magnitude = value < 0 ? 0u - (unsigned int)value : (unsigned int)value;
+	int shift = 0;
+	while (!(magnitude & 1))
+	{
+		magnitude >>= 1;
+		shift++;
+	}
+	if (magnitude == 3 || magnitude == 5 || magnitude == 9)
+	{
+		int scaleBits = magnitude == 3 ? 1 : magnitude == 5 ? 2 : 3;
+		EncodeScaledAdd(reg, reg, reg, scaleBits);
+	}
+	else if (magnitude != 1)
+	{
+		EncodeRex(false, reg, reg);
+		if (value >= -128 && value <= 127)
+		{
+			Encode(IMUL_IMMEDIATE8);
+			EncodeModRM(reg, reg);
+			Encode((unsigned char)value);
+		}
+		else
+		{
+			Encode(IMUL_IMMEDIATE32);
+			EncodeModRM(reg, reg);
+			Encode(value);
+		}
+		return;
+	}
+	if (shift > 0)
+	{
+		EncodeShift(SHIFT_LEFT, reg, shift);
+	}
+	if (value < 0)
+	{
+		EncodeUnary(NEG_DIGIT, reg);
+	}
+}
+
+// Multiplier and shift for signed division by a constant, from Hacker's
+// Delight, 10-4. divisor must not be -1, 0 or 1.
+static void DivisionMagic(int divisor, int & multiplier, int & shift)
+{
+	const unsigned int two31 = 0x80000000u;
+	unsigned int magnitude = divisor < 0 ? 0u - (unsigned int)divisor : (unsigned int)divisor;
+	unsigned int t = two31 + ((unsigned int)divisor >> 31);
+	unsigned int anc = t - 1 - t % magnitude; // |nc|
+	int p = 31;
+	unsigned int q1 = two31 / anc;
+	unsigned int r1 = two31 - q1 * anc;
+	unsigned int q2 = two31 / magnitude;
+	unsigned int r2 = two31 - q2 * magnitude;
+	unsigned int delta;
+	do
+	{
+		p++;
+		q1 *= 2;
+		r1 *= 2;
+		if (r1 >= anc)
+		{
+			q1++;
+			r1 -= anc;
+		}
+		q2 *= 2;
+		r2 *= 2;
+		if (r2 >= magnitude)
+		{
+			q2++;
+			r2 -= magnitude;
+		}
+		delta = magnitude - r2;
+	} while (q1 < delta || (q1 == delta && r1 == 0));
+	multiplier = (int)(q2 + 1);
+	if (divisor < 0)
+	{
+		multiplier = -multiplier;
+	}
+	shift = p - 32;
+}
+
+// reg = reg / value, or reg % value when remainder is set, rounding
+// toward zero like idiv. Powers of two shift, after adding 2**k - 1 to
+// negative numbers. Other divisors multiply by a magic number and keep
+// the high half. Divisors of 0, -1 and INT_MIN keep the idiv, so they
+// fault or wrap the way the interpreter's division does.
+// Uses EAX, ECX and EDX.
+void InstructionsClass::DivideConstant(RegisterType reg, int value, bool remainder)
+{
+	if (value == 0 || value == -1 || value == INT_MIN)
+	{
+		LoadValue(ECX_REGISTER, value);
+		OperateRegisters(remainder ? MOD_TOKEN : DIVIDE_TOKEN, reg, ECX_REGISTER);
+		return;
+	}
+	if (value == 1)
+	{
+		if (remainder)
+		{
+			LoadValue(reg, 0);
+		}
+		return;
+	}
+
+	unsigned int magnitude = value < 0 ? 0u - (unsigned int)value : (unsigned int)value;
+	if ((magnitude & (magnitude - 1)) == 0)
+	{
+		int shift = 0;
+		while ((1u << shift) != magnitude)
+		{
+			shift++;
+		}
+		// ECX = reg < 0 ? 2**shift - 1 : 0
+		MoveRegister(ECX_REGISTER, reg);
+		if (shift > 1)
+		{
+			EncodeShift(SHIFT_RIGHT_SIGNED, ECX_REGISTER, 31);
+		}
+		EncodeShift(SHIFT_RIGHT, ECX_REGISTER, 32 - shift);
+		if (remainder)
+		{
+			// reg - ((reg + ECX) & -magnitude)
+			EncodeRegisters(ADD_RM_REG, reg, ECX_REGISTER);
+			EncodeImmediateGroup(GROUP_AND, ECX_REGISTER, -(int)magnitude);
+			EncodeRegisters(SUB_RM_REG, ECX_REGISTER, reg);
+		}
+		else
+		{
+			EncodeRegisters(ADD_RM_REG, ECX_REGISTER, reg);
+			EncodeShift(SHIFT_RIGHT_SIGNED, reg, shift);
+			if (value < 0)
+			{
+				EncodeUnary(NEG_DIGIT, reg);
+			}
+		}
+		return;
+	}
+
+	int multiplier;
+	int shift;
+	DivisionMagic(value, multiplier, shift);
+	// EDX = high half of reg * multiplier, corrected and shifted.
+	MoveRegister(ECX_REGISTER, reg);
+	LoadValue(EAX_REGISTER, multiplier);
+	EncodeUnary(IMUL_DIGIT, ECX_REGISTER);
+	if (value > 0 && multiplier < 0)
+	{
+		EncodeRegisters(ADD_RM_REG, ECX_REGISTER, EDX_REGISTER);
+	}
+	else if (value < 0 && multiplier > 0)
+	{
+		EncodeRegisters(SUB_RM_REG, ECX_REGISTER, EDX_REGISTER);
+	}
+	if (shift > 0)
+	{
+		EncodeShift(SHIFT_RIGHT_SIGNED, EDX_REGISTER, shift);
+	}
+	// Add one if the quotient is negative, to round toward zero.
+	MoveRegister(EAX_REGISTER, EDX_REGISTER);
+	EncodeShift(SHIFT_RIGHT, EAX_REGISTER, 31);
+	EncodeRegisters(ADD_RM_REG, EAX_REGISTER, EDX_REGISTER);
+	if (remainder)
+	{
+		MultiplyConstant(EDX_REGISTER, value);
+		EncodeRegisters(SUB_RM_REG, EDX_REGISTER, ECX_REGISTER);
+		MoveRegister(reg, ECX_REGISTER);
+	}
+	else
+	{
+		MoveRegister(reg, EDX_REGISTER);
+	}
+}
+
+void InstructionsClass::LoadValue(RegisterType reg, int value)
+{
+	if (value == 0)
+	{
+		EncodeRegisters(XOR_RM_REG, reg, reg);
+		return;
+	}
+	EncodeRex(false, 0, reg);
+	Encode((unsigned char)(IMMEDIATE_TO_EAX + (reg & 7)));
+	Encode(value);
+}
+
+// Only loads and stores through EAX are marked for the peephole pass,
+// which knows that EAX holds what was just stored.
+void InstructionsClass::LoadVariable(RegisterType reg, int index)
+{
+	if (IsPromoted(index))
+	{
+		MoveRegister(reg, PromotedRegister(index));
+		return;
+	}
+	BeginInstruction(reg == EAX_REGISTER ? LOAD_VARIABLE_INSTRUCTION
+		: OPAQUE_INSTRUCTION, index);
+	EncodeDataAccess(MOV_REG_RM, reg, index);
+}
+
+void InstructionsClass::StoreVariable(int index, RegisterType reg)
+{
+	if (IsPromoted(index))
+	{
+		MoveRegister(PromotedRegister(index), reg);
+		return;
+	}
+	BeginInstruction(reg == EAX_REGISTER ? STORE_VARIABLE_INSTRUCTION
+		: OPAQUE_INSTRUCTION, index);
+	EncodeDataAccess(MOV_RM_REG, reg, index);
+}
+
+void InstructionsClass::PushRegister(RegisterType reg)
+{
+	EncodeRex(false, 0, reg);
+	Encode((unsigned char)(PUSH_EAX + (reg & 7)));
+}
+
+void InstructionsClass::PopRegister(RegisterType reg)
+{
+	EncodeRex(false, 0, reg);
+	Encode((unsigned char)(POP_EAX + (reg & 7)));
+}
+
+void InstructionsClass::MoveRegister(RegisterType dst, RegisterType src)
+{
+	if (dst != src)
+	{
+		EncodeRegisters(MOV_RM_REG, src, dst);
+	}
+}
+
+// dst = dst operation src, for any binary operator but && and ||.
+// src must not be EAX or EDX.
+void InstructionsClass::OperateRegisters(TokenType operation, RegisterType dst, RegisterType src)
+{
+	switch (operation)
+	{
+	case PLUS_TOKEN:
+		EncodeRegisters(ADD_RM_REG, src, dst);
+		break;
+	case MINUS_TOKEN:
+		EncodeRegisters(SUB_RM_REG, src, dst);
+		break;
+	case TIMES_TOKEN:
+		EncodeRex(false, dst, src);
+		Encode(IMUL1);
+		Encode(IMUL2);
+		EncodeModRM(dst, src);
+		break;
+	case DIVIDE_TOKEN:
+	case MOD_TOKEN:
+		MoveRegister(EAX_REGISTER, dst);
+		Encode(CDQ);
+		EncodeRex(false, 0, src);
+		Encode(IDIV1);
+		EncodeModRM(IDIV_DIGIT, src);
+		MoveRegister(dst, operation == DIVIDE_TOKEN ? EAX_REGISTER : EDX_REGISTER);
+		break;
+	case POWER_TOKEN:
+		MoveRegister(EDX_REGISTER, src); // before ECX, which src may be
+		MoveRegister(ECX_REGISTER, dst);
+		ExponentLoop();
+		MoveRegister(dst, EAX_REGISTER);
+		break;
+	default:
+		CompareRegisters(dst, src);
+		SetIf(ComparisonFor(operation), dst);
+		break;
+	}
+}
+
+// dst = dst operation value.
+void InstructionsClass::OperateValue(TokenType operation, RegisterType dst, int value)
+{
+	switch (operation)
+	{
+	case PLUS_TOKEN:
+		EncodeImmediateGroup(GROUP_ADD, dst, value);
+		break;
+	case MINUS_TOKEN:
+		EncodeImmediateGroup(GROUP_SUB, dst, value);
+		break;
+	case TIMES_TOKEN:
+		MultiplyConstant(dst, value);
+		break;
+	case POWER_TOKEN:
+		if (value >= 0)
+		{
+			ExponentConstant(dst, value);
+			break;
+		}
+		LoadValue(ECX_REGISTER, value);
+		OperateRegisters(operation, dst, ECX_REGISTER);
+		break;
+	case DIVIDE_TOKEN:
+	case MOD_TOKEN:
+		DivideConstant(dst, value, operation == MOD_TOKEN);
+		break;
+	default:
+		CompareValue(dst, value);
+		SetIf(ComparisonFor(operation), dst);
+		break;
+	}
+}
+
+void InstructionsClass::CompareRegisters(RegisterType left, RegisterType right)
+{
+	EncodeRegisters(CMP_RM_REG, right, left);
+}
+
+void InstructionsClass::CompareValue(RegisterType left, int value)
+{
+	EncodeImmediateGroup(GROUP_CMP, left, value);
+}
+
+// After a compare: dst = 1 if comparison held, else 0.
+void InstructionsClass::SetIf(ComparisonType comparison, RegisterType dst)
+{
+	Encode(SETCC1);
+	Encode((unsigned char)(SETCC2 + (ConditionCode(comparison) & 0x0F)));
+	EncodeModRM(0, ECX_REGISTER);
+	EncodeRex(false, dst, ECX_REGISTER);
+	Encode(MOVZX_BYTE1);
+	Encode(MOVZX_BYTE2);
+	EncodeModRM(dst, ECX_REGISTER);
+}
+
+// After a compare: jump if comparison held. Fill in like Jump().
+int InstructionsClass::JumpIf(ComparisonType comparison)
+{
+	BeginInstruction(JUMP_INSTRUCTION);
+	Encode(JE_FAR1);
+	Encode((unsigned char)(ConditionCode(comparison) + 0x10));
+	int addressToFillInLater = GetAddress();
+	Encode(0);
+	return addressToFillInLater;
+}
+
+int InstructionsClass::CountDownJump(int index)
+{
+	if (IsPromoted(index))
+	{
+		EncodeImmediateGroup(GROUP_SUB, PromotedRegister(index), 1);
+	}
+	else
+	{
+		BeginInstruction(OPAQUE_INSTRUCTION, index);
+		EncodeDataAccess(GROUP_IMMEDIATE8, (RegisterType)GROUP_SUB, index);
+		Encode((unsigned char)1);
+	}
+	return JumpIf(NOTEQUAL_COMPARE);
+}
+
+int InstructionsClass::SkipIfZeroRegister(RegisterType reg)
+{
+	EncodeRegisters(TEST_RM_REG, reg, reg);
+	return JumpIf(EQUAL_COMPARE);
+}
+
+int InstructionsClass::SkipIfNotZeroRegister(RegisterType reg)
+{
+	EncodeRegisters(TEST_RM_REG, reg, reg);
+	return JumpIf(NOTEQUAL_COMPARE);
+}
+
+void InstructionsClass::WriteRegister(RegisterType reg)
+{
+	MoveRegister(EAX_REGISTER, reg);
+	Call(mStartOfPrint);
+}
+
+ComparisonType InstructionsClass::ComparisonFor(TokenType operation)
+{
+	switch (operation)
+	{
+	case LESS_TOKEN:         return LESS_COMPARE;
+	case LESSEQUAL_TOKEN:    return LESSEQUAL_COMPARE;
+	case GREATER_TOKEN:      return GREATER_COMPARE;
+	case GREATEREQUAL_TOKEN: return GREATEREQUAL_COMPARE;
+	case EQUAL_TOKEN:        return EQUAL_COMPARE;
+	case NOTEQUAL_TOKEN:     return NOTEQUAL_COMPARE;
+	default:
+		std::cerr << "Error.  No register code for operator "
+			<< TokenClass::GetTokenTypeName(operation) << "." << std::endl;
+		exit(1);
+	}
+}
+
+int InstructionsClass::FreeSavedRegisterCount() const
+{
+	return (int)mFreeSavedRegisters.size();
+}
+
+bool InstructionsClass::IsPromoted(int index) const
+{
+	return mPromoted.count(index) != 0;
+}
+
+RegisterType InstructionsClass::PromotedRegister(int index) const
+{
+	return mPromoted.find(index)->second;
+}
+
+// Loads the variable into a free callee-saved register. Nothing we call
+// touches those, so the variable can stay there across prints.
+void InstructionsClass::PromoteVariable(int index)
+{
+	RegisterType reg = mFreeSavedRegisters.back();
+	mFreeSavedRegisters.pop_back();
+	LoadVariable(reg, index);
+	mPromoted[index] = reg;
+}
+
+void InstructionsClass::DemoteVariable(int index)
+{
+	RegisterType reg = PromotedRegister(index);
+	mPromoted.erase(index);
+	StoreVariable(index, reg);
+	mFreeSavedRegisters.push_back(reg);
+}
+
+// The register a variable lives in, or otherwise if it lives in memory.
+RegisterType InstructionsClass::VariableRegister(int index, RegisterType otherwise) const
+{
+	return IsPromoted(index) ? PromotedRegister(index) : otherwise;
+}
+
+std::vector<int> InstructionsClass::PromotedVariables() const
+{
+	std::vector<int> promoted;
+	for (const auto & variable : mPromoted)
+	{
+		promoted.push_back(variable.first);
+	}
+	return promoted;
+}
+
+// Peephole pass.
+// The emitters mark where each instruction of main starts and what it
+// does. At Finish the instructions are run through a window that looks
+// at the last few kept and rewrites the stack shuffling the stack
+// machine leaves behind. Then main is laid out again and every jump and
+// call offset is worked out afresh.
+
+void InstructionsClass::BeginInstruction(InstructionKind kind, int operand)
+{
+	InstructionRecord record = {mCurrent, kind, operand};
+	if (!mInstructions.empty() && mInstructions.back().start == mCurrent)
+	{
+		mInstructions.back() = record; // nothing was coded for the last one
+	}
+	else
+	{
+		mInstructions.push_back(record);
+	}
+}
+
+void InstructionsClass::SetPeephole(bool on)
+{
+	mPeephole = on;
+}
+
+void InstructionsClass::SetBranchRelaxation(bool on)
+{
+	mRelaxBranches = on;
+}
+
+// An instruction on its way through the pass.
+struct PeepholeItem
+{
+	InstructionKind kind;
+	int operand;
+	bool rewritten;          // bytes are new, not copied from mCode
+	bool label;              // something jumps here; it starts a window
+	std::vector<int> starts; // old positions that now mean this one
+	std::vector<unsigned char> bytes;
+};
+
+// How long each kind is when it is what it says. Anything else emitted
+// into the same record makes it opaque.
+static int ExpectedLength(InstructionKind kind, int operand)
+{
+	switch (kind)
+	{
+	case PUSH_EAX_INSTRUCTION:
+	case POP_EAX_INSTRUCTION:
+	case POP_EBX_INSTRUCTION:
+		return 1;
+	case LOAD_IMMEDIATE_INSTRUCTION:
+		return 5;
+	case LOAD_VARIABLE_INSTRUCTION:
+	case STORE_VARIABLE_INSTRUCTION:
+	{
+		// mov with [rbp + 1 or 4 byte displacement]
+		int displacement = operand * (int)sizeof(int) - DATA_BASE_BIAS;
+		return displacement >= -128 && displacement <= 127 ? 3 : 6;
+	}
+	default:
+		return -1;
+	}
+}
+
+// Tries each pattern on the end of kept. Instructions that disappear
+// hand their old positions on through removedStarts.
+static bool RewriteWindow(std::vector<PeepholeItem> & kept,
+	std::vector<int> & removedStarts, bool & removedLabel,
+	int * counts, int * bytesSaved)
+{
+	int n = (int)kept.size();
+	if (n >= 2 && !kept[n-1].label)
+	{
+		PeepholeItem & first = kept[n-2];
+		PeepholeItem & second = kept[n-1];
+		if (first.kind == PUSH_EAX_INSTRUCTION && second.kind == POP_EAX_INSTRUCTION)
+		{
+			removedStarts.insert(removedStarts.end(), first.starts.begin(), first.starts.end());
+			removedStarts.insert(removedStarts.end(), second.starts.begin(), second.starts.end());
+			removedLabel = removedLabel || first.label;
+			kept.resize(n - 2);
+			counts[PUSH_POP_PATTERN]++;
+			bytesSaved[PUSH_POP_PATTERN] += 2;
+			return true;
+		}
+		if (first.kind == PUSH_EAX_INSTRUCTION && second.kind == POP_EBX_INSTRUCTION)
+		{
+			first.kind = MOVE_EBX_EAX_INSTRUCTION;
+			first.rewritten = true;
+			first.bytes.clear();
+			first.bytes.push_back(0x89); // mov ebx, eax
+			first.bytes.push_back(0xC3);
+			first.starts.insert(first.starts.end(), second.starts.begin(), second.starts.end());
+			kept.resize(n - 1);
+			counts[PUSH_POP_EBX_PATTERN]++;
+			return true;
+		}
+		if (first.kind == STORE_VARIABLE_INSTRUCTION && second.kind == LOAD_VARIABLE_INSTRUCTION
+			&& first.operand == second.operand)
+		{
+			// EAX still holds what was just stored.
+			removedStarts.insert(removedStarts.end(), second.starts.begin(), second.starts.end());
+			bytesSaved[STORE_LOAD_PATTERN] += (int)second.bytes.size();
+			kept.resize(n - 1);
+			counts[STORE_LOAD_PATTERN]++;
+			return true;
+		}
+	}
+	if (n >= 3 && !kept[n-1].label && !kept[n-2].label
+		&& kept[n-3].kind == LOAD_IMMEDIATE_INSTRUCTION
+		&& kept[n-2].kind == MOVE_EBX_EAX_INSTRUCTION
+		&& kept[n-1].kind == POP_EAX_INSTRUCTION)
+	{
+		// EAX is popped over straight away, so the value can go to EBX.
+		PeepholeItem & load = kept[n-3];
+		int value = load.operand;
+		load.kind = OPAQUE_INSTRUCTION;
+		load.rewritten = true;
+		load.bytes.clear();
+		load.bytes.push_back(0xBB); // mov ebx, value
+		for (int i = 0; i < 4; i++)
+		{
+			load.bytes.push_back((unsigned char)(value >> (8 * i)));
+		}
+		load.starts.insert(load.starts.end(), kept[n-2].starts.begin(), kept[n-2].starts.end());
+		kept[n-2] = kept[n-1];
+		kept.resize(n - 1);
+		counts[PUSH_POP_EBX_PATTERN]--; // it is part of this one now
+		counts[IMMEDIATE_EBX_PATTERN]++;
+		bytesSaved[IMMEDIATE_EBX_PATTERN] += 2;
+		return true;
+	}
+	return false;
+}
+
+// Where old position ends up, given where each old start went.
+// Positions inside an instruction keep their distance from its start.
+static int MovedPosition(const std::map<int, int> & moved, int position)
+{
+	std::map<int, int>::const_iterator at = moved.upper_bound(position);
+	--at;
+	return at->second + (position - at->first);
+}
+
+// Rewrites main in one go: the peephole patterns, if on, then branch
+// relaxation, then a fresh layout with every jump and call re-resolved.
+void InstructionsClass::Relayout()
+{
+	mBytesBeforePeephole = mCurrent - mStartOfMain;
 
-    Encode(IMMEDIATE_TO_EDX);
-    Encode((int)1);
+	std::set<int> labels;
+	for (const auto & jump : mJumpTargets)
+	{
+		labels.insert(jump.second);
+	}
 
-    Encode((unsigned char)SYS_CALL1);
-    Encode((unsigned char)SYS_CALL2);
+	std::vector<PeepholeItem> kept;
+	std::vector<int> removedStarts;
+	bool removedLabel = false;
+	for (size_t i = 0; i < mInstructions.size(); i++)
+	{
+		const InstructionRecord & record = mInstructions[i];
+		int end = i + 1 < mInstructions.size() ? mInstructions[i+1].start : mCurrent;
+
+		PeepholeItem item;
+		item.kind = record.kind;
+		item.operand = record.operand;
+		item.rewritten = false;
+		item.label = removedLabel || labels.count(record.start) != 0;
+		item.starts = removedStarts;
+		item.starts.push_back(record.start);
+		item.bytes.assign(mCode + record.start, mCode + end);
+		if (item.kind == JUMP_INSTRUCTION)
+		{
+			// The operand becomes the old position jumped to.
+			std::map<int, int>::iterator jump = mJumpTargets.find(end - 4);
+			if (jump == mJumpTargets.end() || (item.bytes.size() != 5 && item.bytes.size() != 6))
+			{
+				item.kind = OPAQUE_INSTRUCTION;
+			}
+			else
+			{
+				item.operand = jump->second;
+			}
+		}
+		else if (item.kind != CALL_INSTRUCTION && item.kind != OPAQUE_INSTRUCTION
+			&& (int)item.bytes.size() != ExpectedLength(item.kind, item.operand))
+		{
+			item.kind = OPAQUE_INSTRUCTION;
+		}
+		removedStarts.clear();
+		removedLabel = false;
+
+		kept.push_back(item);
+		while (mPeephole && RewriteWindow(kept, removedStarts, removedLabel,
+			mPatternCounts, mPatternBytesSaved))
+		{
+		}
+	}
+
+	// Branch relaxation. Every jump starts out short, and is made long
+	// once its target is out of reach of a 1 byte offset. Jumps only
+	// grow, so this stops, usually after two or three layouts.
+	std::vector<bool> shortJump(kept.size(), false);
+	for (size_t i = 0; i < kept.size(); i++)
+	{
+		shortJump[i] = mRelaxBranches && kept[i].kind == JUMP_INSTRUCTION;
+	}
+	std::vector<int> newStarts(kept.size());
+	std::map<int, int> moved;
+	int newEnd;
+	bool changed;
+	do
+	{
+		moved.clear();
+		int position = mStartOfMain;
+		for (size_t i = 0; i < kept.size(); i++)
+		{
+			newStarts[i] = position;
+			for (int start : kept[i].starts)
+			{
+				moved[start] = position;
+			}
+			position += shortJump[i] ? 2 : (int)kept[i].bytes.size();
+		}
+		newEnd = position;
+		for (int start : removedStarts)
+		{
+			moved[start] = newEnd;
+		}
+		moved[mCurrent] = newEnd;
+
+		changed = false;
+		for (size_t i = 0; i < kept.size(); i++)
+		{
+			if (shortJump[i])
+			{
+				int offset = MovedPosition(moved, kept[i].operand) - (newStarts[i] + 2);
+				if (offset < -128 || offset > 127)
+				{
+					shortJump[i] = false;
+					changed = true;
+				}
+			}
+		}
+	} while (changed);
+
+	// Lay main out again.
+	std::vector<unsigned char> code;
+	std::map<int, int> jumpTargets;
+	std::vector<Relocation> relocations;
+	for (const Relocation & relocation : mRelocations)
+	{
+		if (relocation.site < mStartOfMain)
+		{
+			relocations.push_back(relocation);
+		}
+	}
+	mJumps = 0;
+	mShortJumps = 0;
+	for (size_t i = 0; i < kept.size(); i++)
+	{
+		const PeepholeItem & item = kept[i];
+		int newStart = newStarts[i];
+		if (item.kind == CALL_INSTRUCTION)
+		{
+			int offset = item.operand - (newStart + 5);
+			std::vector<unsigned char> call(item.bytes);
+			memcpy(&call[1], &offset, sizeof(offset));
+			code.insert(code.end(), call.begin(), call.end());
+			Relocation relocation = {newStart + 1, CALL_RELOCATION, item.operand};
+			relocations.push_back(relocation);
+		}
+		else if (item.kind == JUMP_INSTRUCTION)
+		{
+			int target = MovedPosition(moved, item.operand);
+			mJumps++;
+			if (shortJump[i])
+			{
+				// jmp E9 becomes EB; jcc 0F 8x becomes 7x.
+				mShortJumps++;
+				code.push_back(item.bytes[0] == JUMP_ALWAYS_FAR ? JUMP_ALWAYS
+					: (unsigned char)(item.bytes[1] - 0x10));
+				code.push_back((unsigned char)(target - (newStart + 2)));
+			}
+			else
+			{
+				int field = newStart + (int)item.bytes.size() - 4;
+				int offset = target - (field + 4);
+				code.insert(code.end(), item.bytes.begin(), item.bytes.end() - 4);
+				code.insert(code.end(), (unsigned char *)&offset,
+					(unsigned char *)&offset + sizeof(offset));
+				jumpTargets[field] = target;
+			}
+		}
+		else
+		{
+			code.insert(code.end(), item.bytes.begin(), item.bytes.end());
+		}
+	}
+
+	memcpy(mCode + mStartOfMain, code.data(), code.size());
+	mCurrent = newEnd;
+	mJumpTargets.swap(jumpTargets);
+	mRelocations.swap(relocations);
+	mInstructions.clear();
+}
+
+void InstructionsClass::PrintPeepholeStatistics()
+{
+	static const char * names[PEEPHOLE_PATTERN_COUNT] = {
+		"push rax; pop rax",
+		"push rax; pop rbx",
+		"mov eax, k; push rax; pop rbx; pop rax",
+		"store x; load x"
+	};
+	std::cout << "Peephole:" << std::endl;
+	for (int i = 0; i < PEEPHOLE_PATTERN_COUNT; i++)
+	{
+		std::cout << "  " << names[i] << ": " << mPatternCounts[i]
+			<< " matched, " << mPatternBytesSaved[i] << " bytes saved" << std::endl;
+	}
+	std::cout << "  short jumps: " << mShortJumps << " of " << mJumps << std::endl;
+	std::cout << "  main: " << mBytesBeforePeephole << " -> "
+		<< (mCurrent - mStartOfMain) << " bytes" << std::endl;
 }
@@ -1,23 +1,137 @@
-const int MAX_INSTRUCTIONS = 5000;
-const int MAX_DATA = 5000;
+#pragma once
+#include <vector>
+#include <map>
+#include <string>
+#include "Output.h"
+#include "JitMemory.h"
+#include "Token.h"
+
+// Jumps whose offsets are still to be filled in, all to the same place.
+// Code addresses are offsets into the code buffer, which moves as it grows.
+typedef std::vector<int> JumpList;
+
+// The relational operators, for comparing and jumping in one go.
+enum ComparisonType {
+	LESS_COMPARE, LESSEQUAL_COMPARE, GREATER_COMPARE, GREATEREQUAL_COMPARE,
+	EQUAL_COMPARE, NOTEQUAL_COMPARE
+};
+
+// x86 register numbers, as used in ModRM bytes.
+enum RegisterType {
+	EAX_REGISTER, ECX_REGISTER, EDX_REGISTER, EBX_REGISTER,
+	ESP_REGISTER, EBP_REGISTER, ESI_REGISTER, EDI_REGISTER,
+	R8_REGISTER, R9_REGISTER, R10_REGISTER, R11_REGISTER,
+	R12_REGISTER, R13_REGISTER, R14_REGISTER, R15_REGISTER
+};
+// Where a spilled operand comes back to, in register mode.
+const RegisterType SPILL_REGISTER = ECX_REGISTER;
+
+// What the peephole pass needs to know about each instruction of main.
+// Anything it may not touch is OPAQUE_INSTRUCTION.
+enum InstructionKind {
+	OPAQUE_INSTRUCTION,
+	PUSH_EAX_INSTRUCTION, POP_EAX_INSTRUCTION, POP_EBX_INSTRUCTION,
+	LOAD_IMMEDIATE_INSTRUCTION, // mov eax, operand
+	LOAD_VARIABLE_INSTRUCTION,  // mov eax, [variable operand]
+	STORE_VARIABLE_INSTRUCTION, // mov [variable operand], eax
+	MOVE_EBX_EAX_INSTRUCTION,
+	CALL_INSTRUCTION,           // call mCode[operand]
+	JUMP_INSTRUCTION            // jmp or jcc with a 4 byte offset
+};
+// What one execution of main has to itself besides its variables: the
+// output buffer that generated code fills and flushes. It starts the
+// data segment, ahead of the variables, and is addressed off RBP like
+// them, so executions running at the same time share nothing they write.
+struct ExecutionContext {
+	char buffer[OUTPUT_BUFFER_SIZE];
+	int length;
+	int fileDescriptor;
+};
+// The variables start this many bytes into the data segment.
+const int CONTEXT_SIZE = (sizeof(ExecutionContext) + 15) / 16 * 16;
+
+// The places in the code that depend on where something is, so that the
+// code can be copied, saved or linked and pointed at it again.
+enum RelocationKind {
+	CALL_RELOCATION // 4 byte offset of a call to the routine at target in mCode
+};
+struct Relocation {
+	int site; // in mCode
+	RelocationKind kind;
+	int target;
+};
+
+struct InstructionRecord {
+	int start; // in mCode
+	InstructionKind kind;
+	int operand;
+};
+
+// The rewrites the peephole pass makes, for PrintPeepholeStatistics.
+enum PeepholePattern {
+	PUSH_POP_PATTERN,       // push rax; pop rax       ->
+	PUSH_POP_EBX_PATTERN,   // push rax; pop rbx       -> mov ebx, eax
+	IMMEDIATE_EBX_PATTERN,  // mov eax, k; mov ebx, eax; pop rax -> mov ebx, k; pop rax
+	STORE_LOAD_PATTERN,     // mov [x], eax; mov eax, [x] -> mov [x], eax
+	PEEPHOLE_PATTERN_COUNT
+};
+
+// The code buffer starts this big and doubles each time it fills up.
+const int INITIAL_CODE_SIZE = 64 * 1024;
+// Ints in the data segment unless asked otherwise. Pages that no
+// variable uses are never touched, so they cost nothing.
+const int DEFAULT_DATA_SIZE = 1 << 20;
+
 class InstructionsClass
 {
 public:
-	InstructionsClass(); 
+	InstructionsClass(OutputBufferClass * output = &gStandardOutput,
+		int dataSize = DEFAULT_DATA_SIZE);
+	~InstructionsClass();
+	InstructionsClass(const InstructionsClass &) = delete;
+	InstructionsClass & operator=(const InstructionsClass &) = delete;
 	void Finish(); 
 	void Execute(); 
+	// After Finish, or LoadCode: no more code can be added. Once this is
+	// done, any number of threads may Execute at the same time, each on
+	// a context of its own. Returns where the code runs from.
+	unsigned char * MakeExecutable();
+	// Runs main once on context instead of on mContext, saying nothing after.
+	// A division by zero or overflow in main throws std::runtime_error,
+	// once what it printed until then is written out.
+	void Execute(ExecutionContext * context);
+	// A data segment of main's size, with an empty output buffer and all
+	// variables zero, for Execute(context).
+	ExecutionContext * NewContext() const;
+	void FreeContext(ExecutionContext * context) const;
+	// After Finish: writes the program out as a standalone executable
+	// that runs main once and exits, instead of running it here.
+	void WriteExecutable(const std::string & filename);
+	// After Finish: the code as an image that LoadCode can take back in
+	// another process, with its relocations.
+	void SaveCode(std::vector<unsigned char> & image) const;
+	// Instead of coding anything: takes in an image from SaveCode, made
+	// with the same data size. False, and nothing changed, when the image
+	// does not fit.
+	bool LoadCode(const unsigned char * image, size_t size);
+	// Fills in every relocation site of code, a copy of mCode. Calls stay
+	// relative, so where the code itself goes does not matter.
+	void Relocate(unsigned char * code) const;
 	void PushValue(int value);
 	void PopAndWrite();
-	unsigned char * GetAddress();
+	int GetAddress();
 	void PushVariable(int index);
 	void PopAndStore(int index);
-	void PopAndStoreTemp();
 	void PopPopDivPush();
 	void PopPopAddPush();
 	void PopPopSubPush();
 	void PopPopMulPush();
 	void PopPopModPush();
 	void PopPopExponentPush();
+	void PopExponentConstantPush(int exponent);
+	void PopMulConstantPush(int value);
+	void PopDivConstantPush(int value);
+	void PopModConstantPush(int value);
 
 	void PopPopLessPush();
 	void PopPopLessEqualPush();
@@ -26,44 +140,124 @@ public:
 	void PopPopEqualPush();
 	void PopPopNotEqualPush();
 
-	void PopPopAndPush();
-	void PopPopOrPush();
-
-	void PushTemp();
-	unsigned char * SkipIfZeroStack();
-	unsigned char * Jump();
-	void SetOffset(unsigned char * codeAddress, int offset);
+	int SkipIfZeroStack();
+	int SkipIfNotZeroStack();
+	int PopPopCompareJump(ComparisonType comparison);
+	// Counts the variable at index down by one, and jumps unless it is
+	// then zero: the test of a loop that counts its trips down.
+	int CountDownJump(int index);
+	static ComparisonType Opposite(ComparisonType comparison);
+	int Jump();
+	void SetOffset(int codeAddress, int offset);
+	void SetOffsets(const JumpList & jumps, int target);
 	void PrintAllMachineCodes();
+	void SetPeephole(bool on);
+	void SetBranchRelaxation(bool on);
+	void PrintPeepholeStatistics();
 
+	// Before anything is coded: the program's own variables are the ones
+	// below count, so hidden slots can go right after them, where short
+	// displacements reach. Until then they come from the top of the data.
+	void SetVariableCount(int count);
 	int AllocateSlot();
-	void RegisterVariableSlot(int slot);
 
 	void WriteEndLinux64();
 
+	// Register mode, see ExpressionNode::CodeRegister.
+	void SetRegisterMode(bool on);
+	bool UseRegisters() const;
+	RegisterType TopRegister() const;
+	RegisterType AllocateRegister();
+	void FreeRegister(RegisterType reg);
+	void SwapRegisters();
+	int FreeRegisterCount() const;
+
+	void LoadValue(RegisterType reg, int value);
+	void LoadVariable(RegisterType reg, int index);
+	void StoreVariable(int index, RegisterType reg);
+	void PushRegister(RegisterType reg);
+	void PopRegister(RegisterType reg);
+	void MoveRegister(RegisterType dst, RegisterType src);
+	void OperateRegisters(TokenType operation, RegisterType dst, RegisterType src);
+	void OperateValue(TokenType operation, RegisterType dst, int value);
+	void CompareRegisters(RegisterType left, RegisterType right);
+	void CompareValue(RegisterType left, int value);
+	void SetIf(ComparisonType comparison, RegisterType dst);
+	int JumpIf(ComparisonType comparison);
+	int SkipIfZeroRegister(RegisterType reg);
+	int SkipIfNotZeroRegister(RegisterType reg);
+	void WriteRegister(RegisterType reg);
+	static ComparisonType ComparisonFor(TokenType operation);
+
+	// Loop variables kept in callee-saved registers. While a variable is
+	// promoted every access to it uses the register; DemoteVariable
+	// writes it back to mData.
+	int FreeSavedRegisterCount() const;
+	bool IsPromoted(int index) const;
+	RegisterType PromotedRegister(int index) const;
+	void PromoteVariable(int index);
+	void DemoteVariable(int index);
+	RegisterType VariableRegister(int index, RegisterType otherwise) const;
+	std::vector<int> PromotedVariables() const;
+
 
 private:
-	unsigned char mCode[MAX_INSTRUCTIONS]; 
+	JitMemoryClass mMemory;
+	unsigned char * mCode; // mMemory's writable view
+	int mCodeSize;
 	int mCurrent;
-	int mTempInteger; 
-    int mPrintInteger;
+	int mStartOfFlush;
 	int mStartOfPrint;
+	int mStartOfWriteEnd;
 	int mStartOfMain; 
-	char mMinusString; // Holds '-'
-	char mSpaceString; // Holds ' '
-    int mData[MAX_DATA];
-	char mEndlString = '\n';
+	std::vector<Relocation> mRelocations;
+    ExecutionContext * mContext; // mmap'ed apart from the code, passed to main in RDI
+    int mDataSize; // in variables, after the context
+	OutputBufferClass * mOutput; // only for its file descriptor
 	int NextFreeSlot = 0;
+	int mVariableCount = -1; // not known
+	bool mRegisterMode = false;
+	std::vector<RegisterType> mFreeRegisters;
+	std::vector<RegisterType> mFreeSavedRegisters;
+	std::map<int, RegisterType> mPromoted;
+
+	// Recorded for the peephole pass and branch relaxation, which
+	// rewrite main in Finish.
+	bool mPeephole = true;
+	bool mRelaxBranches = true;
+	int mJumps = 0;
+	int mShortJumps = 0;
+	std::vector<InstructionRecord> mInstructions;
+	std::map<int, int> mJumpTargets; // offset field -> target, in mCode
+	int mPatternCounts[PEEPHOLE_PATTERN_COUNT];
+	int mPatternBytesSaved[PEEPHOLE_PATTERN_COUNT];
+	int mBytesBeforePeephole;
 
     void Encode(unsigned char c);
     void Encode(int x);
-    void Encode(long long x);
-    void Encode(void * p);
-    int * GetMem(int index);
+    void EncodeContextAccess(unsigned char opcode, RegisterType reg, int field, bool wide = false);
+    int GetDisplacement(int index);
+    void EncodeDataAccess(unsigned char opcode, RegisterType reg, int index);
+    void FlushLinux64();
     void PrintIntegerLinux64();
-    void WriteMinusLinux64();
-    void WriteSpaceLinux64();
-    void Call(void *function_address);
+    void WriteEndRoutine();
+    void Reserve(int bytes);
+    void Call(int function_address);
     void PopPopComparePush(unsigned char relational_operator);
+    static unsigned char ConditionCode(ComparisonType comparison);
+    void ExponentLoop();
+    void ExponentConstant(RegisterType reg, int exponent);
+    void BeginInstruction(InstructionKind kind, int operand = 0);
+    void Relayout();
+    void EncodeRex(bool wide, int reg, int rm);
+    void EncodeModRM(int reg, int rm);
+    void EncodeRegisters(unsigned char opcode, int reg, int rm);
+    void EncodeImmediateGroup(int operation, int rm, int value);
+    void EncodeShift(int operation, int rm, int count);
+    void EncodeUnary(int operation, int rm);
+    void EncodeScaledAdd(int dst, int base, int index, int scaleBits);
+    void MultiplyConstant(RegisterType reg, int value);
+    void DivideConstant(RegisterType reg, int value, bool remainder);
 
 
 };
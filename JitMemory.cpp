@@ -0,0 +1,121 @@
+#include <sys/mman.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include "JitMemory.h"
+
+static std::runtime_error SystemError(const std::string & what, int error)
+{
+	return std::runtime_error(what + ": " + strerror(error));
+}
+
+JitMemoryClass::JitMemoryClass(size_t size)
+	: mWritable(NULL), mExecutable(NULL), mSize(size), mFile(-1)
+{
+	void * memory = mmap(NULL, mSize, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (memory == MAP_FAILED)
+	{
+		throw SystemError("Could not map " + std::to_string(mSize)
+			+ " bytes for machine code", errno);
+	}
+	mWritable = (unsigned char *)memory;
+}
+
+JitMemoryClass::~JitMemoryClass()
+{
+	if (mExecutable && mExecutable != mWritable)
+	{
+		munmap(mExecutable, mSize);
+	}
+	munmap(mWritable, mSize);
+	if (mFile != -1)
+	{
+		close(mFile);
+	}
+}
+
+unsigned char * JitMemoryClass::GetWritable()
+{
+	return mWritable;
+}
+
+size_t JitMemoryClass::GetSize() const
+{
+	return mSize;
+}
+
+void JitMemoryClass::Grow(size_t size)
+{
+	if (mExecutable)
+	{
+		throw std::runtime_error("Machine code cannot grow once it is executable");
+	}
+	void * moved = mremap(mWritable, mSize, size, MREMAP_MAYMOVE);
+	if (moved == MAP_FAILED)
+	{
+		throw SystemError("Could not grow the machine code to "
+			+ std::to_string(size) + " bytes", errno);
+	}
+	mWritable = (unsigned char *)moved;
+	mSize = size;
+}
+
+unsigned char * JitMemoryClass::MakeExecutable()
+{
+	if (mExecutable)
+	{
+		return mExecutable;
+	}
+	if (mprotect(mWritable, mSize, PROT_READ | PROT_EXEC) == 0)
+	{
+		mExecutable = mWritable;
+		return mExecutable;
+	}
+	int error = errno;
+	if (error != EACCES && error != EPERM)
+	{
+		throw SystemError("Could not make the machine code executable", error);
+	}
+	return DualMap();
+}
+
+bool JitMemoryClass::IsExecutable() const
+{
+	return mExecutable != NULL;
+}
+
+// The code goes into a memfd, and the memfd is mapped again RX. The RW
+// view stays as it is, but nothing more is written through it.
+unsigned char * JitMemoryClass::DualMap()
+{
+	mFile = memfd_create("jit-code", MFD_CLOEXEC);
+	if (mFile == -1)
+	{
+		throw SystemError("Could not make the machine code executable"
+			" (no memfd for a second mapping)", errno);
+	}
+	size_t written = 0;
+	while (written < mSize)
+	{
+		ssize_t result = write(mFile, mWritable + written, mSize - written);
+		if (result < 0 && errno == EINTR)
+		{
+			continue;
+		}
+		if (result <= 0)
+		{
+			throw SystemError("Could not copy the machine code to a memfd", errno);
+		}
+		written += (size_t)result;
+	}
+	void * memory = mmap(NULL, mSize, PROT_READ | PROT_EXEC, MAP_SHARED, mFile, 0);
+	if (memory == MAP_FAILED)
+	{
+		throw SystemError("Could not map the machine code executable", errno);
+	}
+	mExecutable = (unsigned char *)memory;
+	return mExecutable;
+}
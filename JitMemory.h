@@ -0,0 +1,35 @@
+#pragma once
+#include <cstddef>
+
+// Memory for generated code that is never writable and executable at
+// the same time. Code is written through an RW mapping; MakeExecutable
+// then flips it to RX. Where the kernel will not let a mapping that was
+// once writable become executable, the code is copied into a memfd and
+// mapped a second time, RX, leaving the RW view behind.
+// Failures throw std::runtime_error saying what the system refused.
+class JitMemoryClass
+{
+public:
+	JitMemoryClass(size_t size);
+	~JitMemoryClass();
+	JitMemoryClass(const JitMemoryClass &) = delete;
+	JitMemoryClass & operator=(const JitMemoryClass &) = delete;
+
+	unsigned char * GetWritable();
+	size_t GetSize() const;
+	// Only while writable. The writable view may move.
+	void Grow(size_t size);
+
+	// No more writes after this. Returns where the code can be run from,
+	// which is not the writable address when dual mapped.
+	unsigned char * MakeExecutable();
+	bool IsExecutable() const;
+
+private:
+	unsigned char * DualMap();
+
+	unsigned char * mWritable;
+	unsigned char * mExecutable; // null until MakeExecutable
+	size_t mSize;
+	int mFile; // the memfd when dual mapped, else -1
+};
@@ -4,10 +4,26 @@
 #include "Symbol.h"
 #include "Node.h"
 #include "Parser.h"
+#include "Optimizer.h"
+#include "Passes.h"
+#include "CompiledProgram.h"
+#include "ThreadPool.h"
 #include "Debug.h"
 #include <iostream>
+#include <iomanip>
 #include <cassert>
+#include <cstring>
+#include <cstdlib>
 #include <stdexcept>
+#include <thread>
+#include <vector>
+#include <chrono>
+#include <algorithm>
+#include <memory>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <unistd.h>
 
 // void TestScanner();
 // void TestSymbolTable();
@@ -16,9 +32,40 @@
 // void TestOutputParser();
 // void TestInterpreter();
 // void TestTest();
-void CodeAndExecute(const std::string &filename);
+void CodeAndExecute(const std::string &filename, int count, int threads, bool useCache,
+    const CompileOptions &options);
+void CodeAndWriteExecutable(const std::string &filename, const std::string &executable,
+    const CompileOptions &options);
+int CodeAndExecuteBatch(const std::vector<std::string> &sources, int threads, bool useCache,
+    const CompileOptions &options);
+
+static int Number(const char *option, const char *value, int least)
+{
+    char *end;
+    long number = strtol(value, &end, 10);
+    if (*value == '\0' || *end != '\0' || number < least || number > 1000000000) {
+        std::cerr << "Error.  " << option << " needs a number of at least " << least << "." << std::endl;
+        exit(1);
+    }
+    return (int)number;
+}
 
-int main() {
+// ./main [source] compiles and runs source, test.txt by default.
+// ./main -n count [source] runs it count times, compiling it once.
+// ./main -n count -j threads [source] spreads those runs over threads.
+// ./main -o executable [source] writes it out as a standalone program
+// instead, to be run any number of times without compiling again.
+// ./main [-j threads] -b source-or-directory... compiles and runs many
+// programs at once, each on its own, on every core unless told otherwise.
+// One that fails is reported with the rest, and makes the exit status 1.
+// Before any of these:
+// -i codes through the SSA IR instead of the AST.
+// -s prints what the optimizer, the IR passes and the peephole pass did.
+// -u nodes unrolls loops of up to that many nodes in all, 0 for none.
+// --no-peephole and --no-relax leave the code as first coded, without
+// the peephole rewrites or short jumps.
+// --no-cache neither looks in the code cache nor stores to it.
+int main(int argc, char* argv[]) {
     // TestScanner();
     // TestSymbolTable();
     // TestParseTree();
@@ -26,7 +73,76 @@ int main() {
     // TestOutputParser();
     // TestInterpreter();
     // TestTest();
-    CodeAndExecute("test.txt");
+    std::string executable;
+    int count = 1;
+    int threads = 0; // 1, or every core for a batch
+    bool batch = false;
+    bool useCache = true;
+    CompileOptions options;
+    int arg = 1;
+    for (; arg < argc && argv[arg][0] == '-'; arg++) {
+        const char *option = argv[arg];
+        if (strcmp(option, "-b") == 0) {
+            batch = true;
+            arg++;
+            break;
+        } else if (strcmp(option, "-i") == 0) {
+            options.throughIR = true;
+            continue;
+        } else if (strcmp(option, "-s") == 0) {
+            options.statistics = true;
+            continue;
+        } else if (strcmp(option, "--no-peephole") == 0) {
+            options.peephole = false;
+            continue;
+        } else if (strcmp(option, "--no-relax") == 0) {
+            options.relaxBranches = false;
+            continue;
+        } else if (strcmp(option, "--no-cache") == 0) {
+            useCache = false;
+            continue;
+        }
+        if (arg + 1 >= argc) {
+            std::cerr << "Error.  Option " << option << " needs a value." << std::endl;
+            exit(1);
+        }
+        const char *value = argv[++arg];
+        if (strcmp(option, "-o") == 0) {
+            executable = value;
+        } else if (strcmp(option, "-n") == 0) {
+            count = Number(option, value, 1);
+        } else if (strcmp(option, "-j") == 0) {
+            threads = Number(option, value, 1);
+        } else if (strcmp(option, "-u") == 0) {
+            options.unrollBudget = Number(option, value, 0);
+        } else {
+            std::cerr << "Error.  Unknown option " << option << "." << std::endl;
+            exit(1);
+        }
+    }
+    std::string source = arg < argc ? argv[arg] : "test.txt";
+
+    try {
+        if (batch) {
+            if (arg >= argc || !executable.empty() || count != 1 || options.statistics) {
+                std::cerr << "Error.  -b takes one or more sources, and no -o, -n or -s." << std::endl;
+                exit(1);
+            }
+            if (threads == 0) {
+                threads = std::max(1, (int)std::thread::hardware_concurrency());
+            }
+            int failures = CodeAndExecuteBatch(std::vector<std::string>(argv + arg, argv + argc),
+                threads, useCache, options);
+            return failures == 0 ? 0 : 1;
+        } else if (!executable.empty()) {
+            CodeAndWriteExecutable(source, executable, options);
+        } else {
+            CodeAndExecute(source, count, std::max(threads, 1), useCache, options);
+        }
+    } catch (const std::exception &e) {
+        std::cerr << "Error.  " << e.what() << std::endl;
+        return 1;
+    }
 
     return 0;
 }
@@ -249,6 +365,9 @@ void TestInterpreter() {
     std::cout << "\n--- Parsed Tree Output ---\n" << std::endl;
     root->PrintTree();
     
+    OptimizerClass optimizer;
+    optimizer.Optimize(root);
+
     std::cout << "\nInterpreting Program Output:\n" << std::endl;
     root->Interpret();
     std::cout << std::endl;
@@ -271,6 +390,9 @@ void TestTest(){
     std::cout << "\n--- Parsed Tree Output ---\n" << std::endl;
     root->PrintTree();
     
+    OptimizerClass optimizer;
+    optimizer.Optimize(root);
+
     std::cout << "\nInterpreting Program Output:\n" << std::endl;
     root->Interpret();
     std::cout << std::endl;
@@ -280,25 +402,179 @@ void TestTest(){
     std::cout << "\nTest test completed." << std::endl;
 }
 
-void CodeAndExecute(const std::string &filename)
+// Unchanged programs come straight from the code cache. The program
+// runs count times, compiled once, each run with its variables at zero,
+// on as many threads at once as asked for. The first run to fail, if
+// any, throws once all are done.
+void CodeAndExecute(const std::string &filename, int count, int threads, bool useCache,
+    const CompileOptions &options)
 {
-    // 1) build the scanner, symbol table, and parser
-    ScannerClass    scanner(filename);
-    SymbolTableClass symbolTable;
-    ParserClass     parser(&scanner, &symbolTable);
+    std::unique_ptr<CodeCacheClass> cache(useCache ? new CodeCacheClass() : NULL);
+    CompiledProgramClass program(filename, cache.get(), &gStandardOutput, options);
+
+    // 6) run them on VM
+    ThreadPoolClass pool(threads);
+    std::vector<std::string> errors(count);
+    for (int i = 0; i < count; i++) {
+        pool.Add([&program, &errors, i]() {
+            try {
+                program.Execute();
+            } catch (const std::exception &e) {
+                errors[i] = e.what();
+            }
+        });
+    }
+    pool.Run();
+    for (const std::string &error : errors) {
+        if (!error.empty()) {
+            throw std::runtime_error(error);
+        }
+    }
+    // Did everything work?
+    std::cout << "\nThere and back again!" << std::endl;
+}
 
-    // 2) parse → AST
-    StartNode * root = parser.Start();
+void CodeAndWriteExecutable(const std::string &filename, const std::string &executable,
+    const CompileOptions &options)
+{
+    CompiledProgramClass program(filename, NULL, &gStandardOutput, options);
 
-    // 3) generate bytecodes
-    InstructionsClass machineCode;
-    root->Code(machineCode);
-    machineCode.Finish();
-    // machineCode.PrintAllMachineCodes();
+    // 6) or write them out, with what they need to run on their own
+    program.GetMachineCode().WriteExecutable(executable);
+}
 
-    // 4) run them on VM
-    machineCode.Execute();
+// One program of a batch: what it printed, and how long it took, or
+// why it failed and what it printed until then.
+struct BatchResult {
+    std::string output;
+    bool compiled = false;
+    double compileMilliseconds = 0; // or to load it from the code cache
+    double runMilliseconds = 0;
+    std::string error; // empty when it ran to the end
+};
+
+static double MillisecondsSince(std::chrono::steady_clock::time_point start)
+{
+    std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+    return elapsed.count();
+}
 
-    // 5) tear down the AST
-    delete root;
+// The sources named, with a directory standing for the files in it, in
+// order of name.
+static std::vector<std::string> BatchSources(const std::vector<std::string> &names)
+{
+    std::vector<std::string> sources;
+    for (const std::string &name : names) {
+        struct stat status;
+        if (stat(name.c_str(), &status) != 0 || !S_ISDIR(status.st_mode)) {
+            sources.push_back(name);
+            continue;
+        }
+        DIR *directory = opendir(name.c_str());
+        if (!directory) {
+            std::cerr << "Error.  Could not read the directory " << name << "." << std::endl;
+            exit(1);
+        }
+        std::vector<std::string> files;
+        while (struct dirent *entry = readdir(directory)) {
+            std::string path = name + "/" + entry->d_name;
+            if (entry->d_name[0] != '.' && stat(path.c_str(), &status) == 0 && S_ISREG(status.st_mode)) {
+                files.push_back(path);
+            }
+        }
+        closedir(directory);
+        std::sort(files.begin(), files.end());
+        sources.insert(sources.end(), files.begin(), files.end());
+    }
+    return sources;
+}
+
+// Scans, parses, compiles and runs one program with a scanner, symbol
+// table and machine code of its own. Its output goes to a memfd, to be
+// read back once it is done. A program that cannot be read, parsed or
+// coded, or that divides by zero, fails on its own: the others go on.
+static void RunBatchProgram(const std::string &filename, CodeCacheClass *cache,
+    const CompileOptions &options, BatchResult &result)
+{
+    int file = memfd_create("output", MFD_CLOEXEC);
+    if (file == -1) {
+        std::cerr << "Error.  Could not make a memfd for the output of " << filename << "." << std::endl;
+        exit(1);
+    }
+    {
+        OutputBufferClass output(file);
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        try {
+            CompiledProgramClass program(filename, cache, &output, options);
+            result.compileMilliseconds = MillisecondsSince(start);
+            result.compiled = true;
+            start = std::chrono::steady_clock::now();
+            program.Execute();
+            result.runMilliseconds = MillisecondsSince(start);
+        } catch (const std::exception &e) {
+            result.error = e.what();
+        }
+    }
+    off_t size = lseek(file, 0, SEEK_END);
+    result.output.resize(size > 0 ? (size_t)size : 0);
+    if (size > 0 && pread(file, &result.output[0], (size_t)size, 0) != size) {
+        std::cerr << "Error.  Could not read back the output of " << filename << "." << std::endl;
+        exit(1);
+    }
+    close(file);
+}
+
+// Every program runs on the thread pool. Their outputs, with their
+// timings or why they failed, are printed when all are done, in the
+// order they were named. Returns how many failed.
+int CodeAndExecuteBatch(const std::vector<std::string> &names, int threads, bool useCache,
+    const CompileOptions &options)
+{
+    std::vector<std::string> sources = BatchSources(names);
+    std::vector<BatchResult> results(sources.size());
+    std::unique_ptr<CodeCacheClass> cache(useCache ? new CodeCacheClass() : NULL);
+    ThreadPoolClass pool(threads);
+    for (size_t i = 0; i < sources.size(); i++) {
+        pool.Add([&sources, &cache, &options, &results, i]() {
+            // Whatever a program throws fails that program alone.
+            try {
+                RunBatchProgram(sources[i], cache.get(), options, results[i]);
+            } catch (const std::exception &e) {
+                results[i].error = e.what();
+            }
+        });
+    }
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    pool.Run();
+    double total = MillisecondsSince(start);
+
+    std::cout << std::fixed << std::setprecision(2);
+    int failures = 0;
+    for (size_t i = 0; i < sources.size(); i++) {
+        const BatchResult &result = results[i];
+        std::cout << "== " << sources[i] << ": ";
+        if (!result.compiled) {
+            std::cout << "failed to compile: " << result.error << std::endl;
+        } else if (!result.error.empty()) {
+            std::cout << "compiled in " << result.compileMilliseconds
+                << " ms, failed: " << result.error << std::endl;
+        } else {
+            std::cout << "compiled in " << result.compileMilliseconds
+                << " ms, ran in " << result.runMilliseconds << " ms" << std::endl;
+        }
+        std::cout << result.output;
+        if (!result.output.empty() && result.output.back() != '\n') {
+            std::cout << std::endl;
+        }
+        if (!result.error.empty()) {
+            failures++;
+        }
+    }
+    std::cout << "== " << sources.size() << " programs in " << total << " ms on "
+        << threads << (threads == 1 ? " thread" : " threads");
+    if (failures > 0) {
+        std::cout << ", " << failures << " failed";
+    }
+    std::cout << std::endl;
+    return failures;
 }
@@ -1,7 +1,276 @@
+#include <algorithm>
+#include <climits>
 #include "Node.h"
 #include "Symbol.h"
 #include "Debug.h"
-#include <cmath>
+#include "Output.h"
+
+// Optimizes child in place, deleting it if it is replaced.
+template <class NodeType>
+static void OptimizeChild(NodeType* &child, OptimizerClass &optimizer) {
+    if (!child) {
+        return;
+    }
+    NodeType* optimized = child->Optimize(optimizer);
+    if (optimized != child) {
+        delete child;
+        child = optimized;
+    }
+}
+
+// The constant an optimized condition became, if it became one.
+static bool IsConstant(const ExpressionNode* expression, int &value) {
+    const IntegerNode* constant = dynamic_cast<const IntegerNode*>(expression);
+    if (constant) {
+        value = constant->Evaluate();
+    }
+    return constant != nullptr;
+}
+
+// Like OptimizeChild, for EliminateDeadCode.
+static void EliminateChild(StatementNode* &child, LiveVariables &live, OptimizerClass &optimizer) {
+    if (!child) {
+        return;
+    }
+    StatementNode* kept = child->EliminateDeadCode(live, optimizer);
+    if (kept != child) {
+        delete child;
+        child = kept;
+    }
+}
+
+// A store is needed if the variable is read later, or if working out the
+// value may trap.
+static bool StoreIsLive(const IdentifierNode* identifier, const ExpressionNode* expression,
+                        const LiveVariables &live) {
+    return live.count(identifier->GetLabel()) || (expression && expression->MayTrap());
+}
+
+// The variables live at the head of a loop: head = entry + through(head),
+// where entry is what the loop reads on leaving or testing, and through
+// gives what the rest of the loop reads with head live after it.
+template <class Through>
+static LiveVariables LoopHeadLiveness(const LiveVariables &entry, Through through) {
+    LiveVariables head = entry;
+    while (true) {
+        LiveVariables next = head;
+        through(next);
+        next.insert(entry.begin(), entry.end());
+        if (next == head) {
+            return head;
+        }
+        head.swap(next);
+    }
+}
+
+// A loop whose only statement is step can go when step counts a variable
+// nobody reads afterwards towards a bound it must reach: v < bound with
+// v++, or v > bound with v--, the bound not changing.
+static bool IsDeadCountingLoop(const ExpressionNode* condition, const StatementNode* step,
+                               const LiveVariables &after) {
+    std::string label;
+    int direction = step ? step->CountingStep(label) : 0;
+    const BinaryOperatorNode* test = dynamic_cast<const BinaryOperatorNode*>(condition);
+    if (!direction || after.count(label) || !test
+        || test->GetOperator() != (direction > 0 ? LESS_TOKEN : GREATER_TOKEN)) {
+        return false;
+    }
+    const IdentifierNode* counter = dynamic_cast<const IdentifierNode*>(test->GetLeft());
+    VariableNames boundReads;
+    test->GetRight()->AddReads(boundReads);
+    return counter && counter->GetLabel() == label && !boundReads.count(label)
+        && !test->GetRight()->MayTrap();
+}
+
+// Like OptimizeChild, for Propagate.
+static void PropagateChild(ExpressionNode* &child, const KnownValues &known, OptimizerClass &optimizer) {
+    if (!child) {
+        return;
+    }
+    ExpressionNode* propagated = child->Propagate(known, optimizer);
+    if (propagated != child) {
+        delete child;
+        child = propagated;
+    }
+}
+
+// Nothing is known about label any more, nor about the copies of it.
+static void Forget(KnownValues &known, const std::string &label) {
+    known.erase(label);
+    for (auto it = known.begin(); it != known.end(); ) {
+        if (it->second.copy == label) {
+            it = known.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+// Keeps only what is known along both ways into a merge.
+static void Meet(KnownValues &known, const KnownValues &other) {
+    for (auto it = known.begin(); it != known.end(); ) {
+        auto same = other.find(it->first);
+        if (same == other.end() || !(same->second == it->second)) {
+            it = known.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+// What holds at the head of a loop on every trip: what held before it,
+// less anything about the variables it writes.
+static void LoopHeadKnown(KnownValues &known, const VariableNames &written) {
+    for (const std::string &label : written) {
+        Forget(known, label);
+    }
+}
+
+// After label = expression.
+static void StoreKnown(KnownValues &known, const std::string &label, const ExpressionNode* expression) {
+    Forget(known, label);
+    int value;
+    const IdentifierNode* source = dynamic_cast<const IdentifierNode*>(expression);
+    if (expression && IsConstant(expression, value)) {
+        known[label] = KnownValue{true, value, ""};
+    } else if (source && source->GetLabel() != label) {
+        known[label] = KnownValue{false, 0, source->GetLabel()};
+    }
+}
+
+// After label += amount, which stays a constant only if both were.
+static void AddKnown(KnownValues &known, const std::string &label, bool amountKnown, int amount) {
+    auto it = known.find(label);
+    bool stays = amountKnown && it != known.end() && it->second.isConstant;
+    int value = stays ? (int)((unsigned int)it->second.value + (unsigned int)amount) : 0;
+    Forget(known, label);
+    if (stays) {
+        known[label] = KnownValue{true, value, ""};
+    }
+}
+
+// Hoists out of the simple statements' expressions; a loop adds itself
+// to loops first, so depth is always all of them.
+static void HoistChild(ExpressionNode* &child, const LoopNest &loops, OptimizerClass &optimizer) {
+    if (child) {
+        child = child->HoistInvariants(loops, loops.size(), optimizer);
+    }
+}
+
+// What a loop writes, and so what it cannot hoist reads of. The loop
+// sets a counter itself, if it has one.
+static LoopHoist LoopWrites(const StatementNode* a, const StatementNode* b, Invariants* invariants) {
+    LoopHoist loop;
+    if (a) a->AddWrites(loop.written);
+    if (b) b->AddWrites(loop.written);
+    loop.invariants = invariants;
+    loop.step = 0;
+    loop.inductions = nullptr;
+    return loop;
+}
+
+// How many times a for loop runs, when its init, condition and step fix
+// it: v = a; v < b; v++, or <=, or > and >= counting down, around a body
+// that leaves v alone.
+static bool TripCount(const StatementNode* init, const ExpressionNode* condition,
+                      const StatementNode* step, const StatementNode* body, int &count) {
+    std::string label;
+    std::string initLabel;
+    int first;
+    int bound;
+    int direction = step ? step->CountingStep(label) : 0;
+    if (!direction || !init || !init->ConstantStore(initLabel, first) || initLabel != label) {
+        return false;
+    }
+    const BinaryOperatorNode* test = dynamic_cast<const BinaryOperatorNode*>(condition);
+    if (!test) {
+        return false;
+    }
+    const IdentifierNode* counter = dynamic_cast<const IdentifierNode*>(test->GetLeft());
+    if (!counter || counter->GetLabel() != label || !IsConstant(test->GetRight(), bound)) {
+        return false;
+    }
+    VariableNames written;
+    body->AddWrites(written);
+    if (written.count(label)) {
+        return false;
+    }
+    long long trips;
+    switch (test->GetOperator()) {
+    case LESS_TOKEN:
+        trips = (long long)bound - first;
+        break;
+    case LESSEQUAL_TOKEN:
+        if (bound == INT_MAX) return false; // never ends
+        trips = (long long)bound - first + 1;
+        break;
+    case GREATER_TOKEN:
+        trips = (long long)first - bound;
+        break;
+    case GREATEREQUAL_TOKEN:
+        if (bound == INT_MIN) return false;
+        trips = (long long)first - bound + 1;
+        break;
+    default:
+        return false;
+    }
+    bool up = test->GetOperator() == LESS_TOKEN || test->GetOperator() == LESSEQUAL_TOKEN;
+    if (direction != (up ? 1 : -1) || trips < 1 || trips > INT_MAX) {
+        return false;
+    }
+    count = (int)trips;
+    return true;
+}
+
+// How many copies of its body an unrolled loop makes.
+static int UnrolledCopies(int count, int unroll) {
+    if (!unroll) {
+        return 1;
+    }
+    return unroll >= count ? count : unroll + count % unroll;
+}
+
+// Codes count runs of a loop body, by calling copy, without the loop's
+// own test. When unroll covers count the copies come one after another;
+// otherwise a loop of unroll copies runs count / unroll times, counted
+// down in a hidden slot, and the rest follow it.
+template <class Copy>
+static void CodeUnrolled(InstructionsClass &machineCode, int count, int unroll, Copy copy) {
+    int rest = count;
+    if (unroll < count) {
+        int slot = machineCode.AllocateSlot();
+        if (machineCode.UseRegisters()) {
+            machineCode.LoadValue(EAX_REGISTER, count / unroll);
+            machineCode.StoreVariable(slot, EAX_REGISTER);
+        } else {
+            machineCode.PushValue(count / unroll);
+            machineCode.PopAndStore(slot);
+        }
+        int top = machineCode.GetAddress();
+        for (int i = 0; i < unroll; i++) {
+            copy();
+        }
+        JumpList again;
+        if (machineCode.UseRegisters()) {
+            machineCode.LoadVariable(EAX_REGISTER, slot);
+            machineCode.OperateValue(MINUS_TOKEN, EAX_REGISTER, 1);
+            machineCode.StoreVariable(slot, EAX_REGISTER);
+            again.push_back(machineCode.SkipIfNotZeroRegister(EAX_REGISTER));
+        } else {
+            machineCode.PushVariable(slot);
+            machineCode.PushValue(1);
+            machineCode.PopPopSubPush();
+            machineCode.PopAndStore(slot);
+            machineCode.PushVariable(slot);
+            again.push_back(machineCode.SkipIfNotZeroStack());
+        }
+        machineCode.SetOffsets(again, top);
+        rest = count % unroll;
+    }
+    for (int i = 0; i < rest; i++) {
+        copy();
+    }
+}
 
 StartNode::StartNode(ProgramNode* program) : program(program) {}
 
@@ -12,6 +281,7 @@ StartNode::~StartNode() {
 
 void StartNode::Interpret() const {
     program->Interpret();
+    gStandardOutput.Flush();
 }
 
 void StartNode::Code(InstructionsClass &machineCode)
@@ -19,6 +289,37 @@ void StartNode::Code(InstructionsClass &machineCode)
     program->Code(machineCode);
 }
 
+void StartNode::Optimize(OptimizerClass &optimizer)
+{
+    program->Optimize(optimizer);
+}
+
+// Nothing is known before main starts.
+void StartNode::Propagate(OptimizerClass &optimizer)
+{
+    KnownValues known;
+    program->Propagate(known, optimizer);
+}
+
+void StartNode::BuildIR(IRBuilderClass &builder)
+{
+    program->BuildIR(builder);
+    builder.Return();
+}
+
+// Nothing is read once main returns.
+void StartNode::EliminateDeadCode(OptimizerClass &optimizer)
+{
+    LiveVariables live;
+    program->EliminateDeadCode(live, optimizer);
+}
+
+void StartNode::HoistInvariants(OptimizerClass &optimizer)
+{
+    LoopNest loops;
+    program->HoistInvariants(loops, optimizer);
+}
+
 void StartNode::PrintTree(int indent) const {
     for (int i = 0; i < indent; i++) std::cout << "  ";
     std::cout << "Start" << std::endl;
@@ -43,6 +344,31 @@ void ProgramNode::Code(InstructionsClass &machineCode)
     block->Code(machineCode);
 }
 
+void ProgramNode::Optimize(OptimizerClass &optimizer)
+{
+    block->Optimize(optimizer);
+}
+
+void ProgramNode::Propagate(KnownValues &known, OptimizerClass &optimizer)
+{
+    block->Propagate(known, optimizer);
+}
+
+void ProgramNode::BuildIR(IRBuilderClass &builder)
+{
+    block->BuildIR(builder);
+}
+
+void ProgramNode::EliminateDeadCode(LiveVariables &live, OptimizerClass &optimizer)
+{
+    block->EliminateDeadCode(live, optimizer);
+}
+
+void ProgramNode::HoistInvariants(LoopNest &loops, OptimizerClass &optimizer)
+{
+    block->HoistInvariants(loops, optimizer);
+}
+
 void ProgramNode::PrintTree(int indent) const {
     for (int i = 0; i < indent; i++) {
         std::cout << "  ";
@@ -54,6 +380,123 @@ void ProgramNode::PrintTree(int indent) const {
 }
 
 
+// GetChildren only takes the children's addresses, so the passes that
+// leave the tree alone use it too.
+ChildSlots StatementNode::Children() const
+{
+    ChildSlots children;
+    const_cast<StatementNode*>(this)->GetChildren(children);
+    return children;
+}
+
+void StatementNode::CountVariableUses(VariableUses &uses) const
+{
+    for (const ChildSlot &child : Children()) {
+        if (child.statement && *child.statement) {
+            (*child.statement)->CountVariableUses(uses);
+        } else if (child.expression && *child.expression) {
+            (*child.expression)->CountVariableUses(uses);
+        } else if (child.group) {
+            child.group->CountVariableUses(uses);
+        }
+    }
+}
+
+StatementNode* StatementNode::Optimize(OptimizerClass &optimizer)
+{
+    for (ChildSlot &child : Children()) {
+        if (child.statement) {
+            OptimizeChild(*child.statement, optimizer);
+        } else if (child.expression) {
+            OptimizeChild(*child.expression, optimizer);
+        } else if (child.group) {
+            child.group->Optimize(optimizer);
+        }
+    }
+    return this;
+}
+
+void StatementNode::Propagate(KnownValues &known, OptimizerClass &optimizer)
+{
+    for (ChildSlot &child : Children()) {
+        if (child.statement && *child.statement) {
+            (*child.statement)->Propagate(known, optimizer);
+        } else if (child.expression) {
+            PropagateChild(*child.expression, known, optimizer);
+        } else if (child.group) {
+            child.group->Propagate(known, optimizer);
+        }
+    }
+}
+
+void StatementNode::Liveness(LiveVariables &live) const
+{
+    ChildSlots children = Children();
+    for (auto child = children.rbegin(); child != children.rend(); ++child) {
+        if (child->statement && *child->statement) {
+            (*child->statement)->Liveness(live);
+        } else if (child->expression && *child->expression) {
+            (*child->expression)->AddReads(live);
+        } else if (child->group) {
+            child->group->Liveness(live);
+        }
+    }
+}
+
+StatementNode* StatementNode::EliminateDeadCode(LiveVariables &live, OptimizerClass &optimizer)
+{
+    ChildSlots children = Children();
+    for (auto child = children.rbegin(); child != children.rend(); ++child) {
+        if (child->statement) {
+            EliminateChild(*child->statement, live, optimizer);
+        } else if (child->expression && *child->expression) {
+            (*child->expression)->AddReads(live);
+        } else if (child->group) {
+            child->group->EliminateDeadCode(live, optimizer);
+        }
+    }
+    return this;
+}
+
+void StatementNode::HoistInvariants(LoopNest &loops, OptimizerClass &optimizer)
+{
+    for (ChildSlot &child : Children()) {
+        if (child.statement && *child.statement) {
+            (*child.statement)->HoistInvariants(loops, optimizer);
+        } else if (child.expression) {
+            HoistChild(*child.expression, loops, optimizer);
+        } else if (child.group) {
+            child.group->HoistInvariants(loops, optimizer);
+        }
+    }
+}
+
+void StatementNode::AddWrites(VariableNames &written) const
+{
+    for (const ChildSlot &child : Children()) {
+        if (child.statement && *child.statement) {
+            (*child.statement)->AddWrites(written);
+        } else if (child.group) {
+            child.group->AddWrites(written);
+        }
+    }
+}
+
+int StatementNode::Size() const
+{
+    int size = 1;
+    for (const ChildSlot &child : Children()) {
+        if (child.statement && *child.statement) {
+            size += (*child.statement)->Size();
+        } else if (child.expression && *child.expression) {
+            size += (*child.expression)->Size();
+        } else if (child.group) {
+            size += child.group->Size();
+        }
+    }
+    return size;
+}
+
 BlockNode::BlockNode(StatementGroupNode* statementGroup) : statementGroup(statementGroup) {}
 
 BlockNode::~BlockNode() {
@@ -70,6 +513,36 @@ void BlockNode::Code(InstructionsClass &machineCode)
     statementGroup->Code(machineCode);
 }
 
+void BlockNode::GetChildren(ChildSlots &children)
+{
+    children.push_back(Child(statementGroup));
+}
+
+void BlockNode::BuildIR(IRBuilderClass &builder)
+{
+    statementGroup->BuildIR(builder);
+}
+
+bool BlockNode::IsEmpty() const
+{
+    return statementGroup->IsEmpty();
+}
+
+int BlockNode::CountingStep(std::string &label) const
+{
+    return statementGroup->CountingStep(label);
+}
+
+int BlockNode::TrailingStep(std::string &label) const
+{
+    return statementGroup->TrailingStep(label);
+}
+
+int BlockNode::Size() const
+{
+    return statementGroup->Size();
+}
+
 void BlockNode::PrintTree(int indent) const {
     for (int i = 0; i < indent; i++) std::cout << "  ";
     std::cout << "Block" << std::endl;
@@ -102,6 +575,134 @@ void StatementGroupNode::Code(InstructionsClass &machineCode)
     }
 }
 
+void StatementGroupNode::CountVariableUses(VariableUses &uses) const
+{
+    for (StatementNode* stmt : statements) {
+        stmt->CountVariableUses(uses);
+    }
+}
+
+// Pruned statements come back as NullStatementNodes, which are dropped.
+void StatementGroupNode::Optimize(OptimizerClass &optimizer)
+{
+    std::vector<StatementNode*> kept;
+    for (StatementNode* stmt : statements) {
+        OptimizeChild(stmt, optimizer);
+        if (dynamic_cast<NullStatementNode*>(stmt)) {
+            delete stmt;
+        } else {
+            kept.push_back(stmt);
+        }
+    }
+    statements.swap(kept);
+}
+
+void StatementGroupNode::Propagate(KnownValues &known, OptimizerClass &optimizer)
+{
+    for (StatementNode* stmt : statements) {
+        stmt->Propagate(known, optimizer);
+    }
+}
+
+void StatementGroupNode::BuildIR(IRBuilderClass &builder)
+{
+    for (StatementNode* stmt : statements) {
+        stmt->BuildIR(builder);
+    }
+}
+
+void StatementGroupNode::Liveness(LiveVariables &live) const
+{
+    for (auto stmt = statements.rbegin(); stmt != statements.rend(); ++stmt) {
+        (*stmt)->Liveness(live);
+    }
+}
+
+void StatementGroupNode::EliminateDeadCode(LiveVariables &live, OptimizerClass &optimizer)
+{
+    std::vector<StatementNode*> kept;
+    for (auto stmt = statements.rbegin(); stmt != statements.rend(); ++stmt) {
+        EliminateChild(*stmt, live, optimizer);
+        if (dynamic_cast<NullStatementNode*>(*stmt)) {
+            delete *stmt;
+        } else {
+            kept.push_back(*stmt);
+        }
+    }
+    std::reverse(kept.begin(), kept.end());
+    statements.swap(kept);
+}
+
+bool StatementGroupNode::IsEmpty() const
+{
+    for (StatementNode* stmt : statements) {
+        if (!stmt->IsEmpty()) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// The counting step of a group with one statement that is not empty.
+int StatementGroupNode::CountingStep(std::string &label) const
+{
+    const StatementNode* only = nullptr;
+    for (StatementNode* stmt : statements) {
+        if (stmt->IsEmpty()) {
+            continue;
+        }
+        if (only) {
+            return 0;
+        }
+        only = stmt;
+    }
+    return only ? only->CountingStep(label) : 0;
+}
+
+void StatementGroupNode::HoistInvariants(LoopNest &loops, OptimizerClass &optimizer)
+{
+    for (StatementNode* stmt : statements) {
+        stmt->HoistInvariants(loops, optimizer);
+    }
+}
+
+void StatementGroupNode::AddWrites(VariableNames &written) const
+{
+    for (StatementNode* stmt : statements) {
+        stmt->AddWrites(written);
+    }
+}
+
+int StatementGroupNode::TrailingStep(std::string &label) const
+{
+    const StatementNode* last = nullptr;
+    for (StatementNode* stmt : statements) {
+        if (!stmt->IsEmpty()) {
+            last = stmt;
+        }
+    }
+    int step = last ? last->TrailingStep(label) : 0;
+    if (!step) {
+        return 0;
+    }
+    VariableNames written;
+    for (StatementNode* stmt : statements) {
+        if (stmt != last) {
+            stmt->AddWrites(written);
+        }
+    }
+    return written.count(label) ? 0 : step;
+}
+
+int StatementGroupNode::Size() const
+{
+    int size = 0;
+    for (StatementNode* stmt : statements) {
+        size += stmt->Size();
+    }
+    return size;
+}
+
 void StatementGroupNode::PrintTree(int indent) const {
     for (int i = 0; i < indent; i++) std::cout << "  ";
     std::cout << "StatementGroup" << std::endl;
@@ -132,67 +733,323 @@ void IfStatementNode::Interpret() const {
 
 void IfStatementNode::Code(InstructionsClass &machineCode)
 {
-    condition->CodeEvaluate(machineCode);
-
-    unsigned char* skipThenAddr = machineCode.SkipIfZeroStack();
-    unsigned char* thenStart   = machineCode.GetAddress();
+    JumpList skipThen;
+    condition->CodeJumpIfFalse(machineCode, skipThen);
 
     thenStmt->Code(machineCode);
 
-    unsigned char* jumpOverElse = machineCode.Jump();
-    unsigned char* elseStart    = machineCode.GetAddress();
-
-    machineCode.SetOffset(skipThenAddr,
-                         static_cast<int>(elseStart - thenStart));
-
     if (elseStmt) {
+        int jumpOverElse = machineCode.Jump();
+        int elseStart    = machineCode.GetAddress();
+        machineCode.SetOffsets(skipThen, elseStart);
+
         elseStmt->Code(machineCode);
+        int afterElse = machineCode.GetAddress();
+
+        machineCode.SetOffset(jumpOverElse,
+                             static_cast<int>(afterElse - elseStart));
+    } else {
+        machineCode.SetOffsets(skipThen, machineCode.GetAddress());
     }
-    unsigned char* afterElse = machineCode.GetAddress();
+}
 
-    machineCode.SetOffset(jumpOverElse,
-                         static_cast<int>(afterElse - elseStart));
+void IfStatementNode::GetChildren(ChildSlots &children)
+{
+    children.push_back(Child(condition));
+    children.push_back(Child(thenStmt));
+    children.push_back(Child(elseStmt));
 }
 
-void IfStatementNode::PrintTree(int indent) const {
-    for (int i = 0; i < indent; i++) std::cout << "  ";
-    std::cout << "IfStatement" << std::endl;
-    condition->PrintTree(indent + 1);
-    thenStmt->PrintTree(indent + 1);
-    if(elseStmt){
-        elseStmt->PrintTree(indent + 1);
+StatementNode* IfStatementNode::Optimize(OptimizerClass &optimizer)
+{
+    StatementNode::Optimize(optimizer);
+    int value;
+    if (!IsConstant(condition, value)) {
+        return this;
     }
+    optimizer.CountPruned();
+    StatementNode* taken;
+    if (value) {
+        taken = thenStmt;
+        thenStmt = nullptr;
+    } else {
+        taken = elseStmt;
+        elseStmt = nullptr;
+    }
+    return taken ? taken : new NullStatementNode();
 }
 
-WhileStatementNode::WhileStatementNode(ExpressionNode* condition, StatementNode* body) 
-    : condition(condition), body(body) {}
+void IfStatementNode::Propagate(KnownValues &known, OptimizerClass &optimizer)
+{
+    PropagateChild(condition, known, optimizer);
+    KnownValues elseKnown = known;
+    thenStmt->Propagate(known, optimizer);
+    if (elseStmt) {
+        elseStmt->Propagate(elseKnown, optimizer);
+    }
+    Meet(known, elseKnown);
+}
 
-WhileStatementNode::~WhileStatementNode() {
-    MSG("Deleting WhileStatementNode\n");
-    delete condition;
-    delete body;
+void IfStatementNode::BuildIR(IRBuilderClass &builder)
+{
+    IRFunctionClass* function = builder.GetFunction();
+    IRBlock* thenBlock = function->NewBlock();
+    IRBlock* elseBlock = elseStmt ? function->NewBlock() : nullptr;
+    IRBlock* after = function->NewBlock();
+    condition->BuildBranch(builder, thenBlock, elseBlock ? elseBlock : after);
+
+    builder.SealBlock(thenBlock);
+    builder.SetBlock(thenBlock);
+    thenStmt->BuildIR(builder);
+    builder.Jump(after);
+    if (elseBlock) {
+        builder.SealBlock(elseBlock);
+        builder.SetBlock(elseBlock);
+        elseStmt->BuildIR(builder);
+        builder.Jump(after);
+    }
+    builder.SealBlock(after);
+    builder.SetBlock(after);
 }
 
-void WhileStatementNode::Interpret() const {
-    while (condition->Evaluate()) {
-        body->Interpret();
+void IfStatementNode::Liveness(LiveVariables &live) const
+{
+    LiveVariables elseLive = live;
+    thenStmt->Liveness(live);
+    if (elseStmt) {
+        elseStmt->Liveness(elseLive);
     }
+    live.insert(elseLive.begin(), elseLive.end());
+    condition->AddReads(live);
 }
 
-void WhileStatementNode::Code(InstructionsClass &machineCode)
+// An if left with nothing to do on either side goes too.
+StatementNode* IfStatementNode::EliminateDeadCode(LiveVariables &live, OptimizerClass &optimizer)
 {
-    unsigned char* address1 = machineCode.GetAddress();
-    condition->CodeEvaluate(machineCode);
-    unsigned char* insertSkip = machineCode.SkipIfZeroStack();
-    unsigned char* address2 = machineCode.GetAddress();
-    body->Code(machineCode);
-    unsigned char* insertJump = machineCode.Jump();
-    unsigned char* address3 = machineCode.GetAddress();
-    machineCode.SetOffset(insertSkip, static_cast<int>(address3 - address2));
-    machineCode.SetOffset(insertJump, static_cast<int>(address1 - address3));
+    LiveVariables elseLive = live;
+    EliminateChild(thenStmt, live, optimizer);
+    EliminateChild(elseStmt, elseLive, optimizer);
+    live.insert(elseLive.begin(), elseLive.end());
+    if (thenStmt->IsEmpty() && (!elseStmt || elseStmt->IsEmpty()) && !condition->MayTrap()) {
+        optimizer.CountDeadCode();
+        return new NullStatementNode();
+    }
+    condition->AddReads(live);
+    return this;
 }
 
-void WhileStatementNode::PrintTree(int indent) const {
+void IfStatementNode::PrintTree(int indent) const {
+    for (int i = 0; i < indent; i++) std::cout << "  ";
+    std::cout << "IfStatement" << std::endl;
+    condition->PrintTree(indent + 1);
+    thenStmt->PrintTree(indent + 1);
+    if(elseStmt){
+        elseStmt->PrintTree(indent + 1);
+    }
+}
+
+// What a loop moved into registers. Once none are free, it borrows the
+// registers of enclosing loops' variables it never uses: each pair is
+// the variable written back and the one promoted in its place.
+struct LoopRegisters {
+    std::vector<int> promoted;
+    std::vector<std::pair<int, int> > borrowed;
+};
+
+// Moves the variables a loop uses most into callee-saved registers for
+// the length of the loop. Returns the ones moved, for DemoteLoopVariables.
+static LoopRegisters PromoteLoopVariables(InstructionsClass &machineCode,
+                                          const VariableUses &uses)
+{
+    std::vector<std::pair<int, int> > byUse; // (-uses, index)
+    for (const auto &use : uses) {
+        if (!machineCode.IsPromoted(use.first)) {
+            byUse.push_back(std::make_pair(-use.second, use.first));
+        }
+    }
+    std::sort(byUse.begin(), byUse.end());
+
+    std::vector<int> unused;
+    for (int index : machineCode.PromotedVariables()) {
+        if (!uses.count(index)) {
+            unused.push_back(index);
+        }
+    }
+
+    LoopRegisters registers;
+    for (const auto &use : byUse) {
+        if (machineCode.FreeSavedRegisterCount() == 0) {
+            if (unused.empty()) {
+                break;
+            }
+            machineCode.DemoteVariable(unused.back());
+            registers.borrowed.push_back(std::make_pair(unused.back(), use.second));
+            unused.pop_back();
+            machineCode.PromoteVariable(use.second);
+            continue;
+        }
+        machineCode.PromoteVariable(use.second);
+        registers.promoted.push_back(use.second);
+    }
+    return registers;
+}
+
+// Writes the loop's registers back and gives borrowed ones back, in
+// reverse, so each variable gets the register it had. Every way out of
+// a loop comes here.
+static void DemoteLoopVariables(InstructionsClass &machineCode,
+                                const LoopRegisters &registers)
+{
+    for (size_t i = registers.borrowed.size(); i-- > 0; ) {
+        machineCode.DemoteVariable(registers.borrowed[i].second);
+        machineCode.PromoteVariable(registers.borrowed[i].first);
+    }
+    for (int index : registers.promoted) {
+        machineCode.DemoteVariable(index);
+    }
+}
+
+WhileStatementNode::WhileStatementNode(ExpressionNode* condition, StatementNode* body) 
+    : condition(condition), body(body) {}
+
+WhileStatementNode::~WhileStatementNode() {
+    MSG("Deleting WhileStatementNode\n");
+    delete condition;
+    delete body;
+}
+
+void WhileStatementNode::Interpret() const {
+    for (InvariantNode* invariant : invariants) {
+        invariant->InterpretPreheader();
+    }
+    for (InductionNode* induction : inductions) {
+        induction->InterpretPreheader();
+    }
+    while (condition->Evaluate()) {
+        body->Interpret();
+        for (InductionNode* induction : inductions) {
+            induction->InterpretStep();
+        }
+    }
+}
+
+void WhileStatementNode::Code(InstructionsClass &machineCode)
+{
+    for (InvariantNode* invariant : invariants) {
+        invariant->CodePreheader(machineCode);
+    }
+    for (InductionNode* induction : inductions) {
+        induction->CodePreheader(machineCode);
+    }
+    VariableUses uses;
+    CountVariableUses(uses);
+    for (InductionNode* induction : inductions) {
+        induction->CountVariableUses(uses);
+    }
+    LoopRegisters promoted = PromoteLoopVariables(machineCode, uses);
+
+    int address1 = machineCode.GetAddress();
+    JumpList exitJumps;
+    condition->CodeJumpIfFalse(machineCode, exitJumps);
+    body->Code(machineCode);
+    for (InductionNode* induction : inductions) {
+        induction->CodeStep(machineCode);
+    }
+    int insertJump = machineCode.Jump();
+    int address3 = machineCode.GetAddress();
+    machineCode.SetOffsets(exitJumps, address3);
+    machineCode.SetOffset(insertJump, static_cast<int>(address1 - address3));
+    DemoteLoopVariables(machineCode, promoted);
+}
+
+void WhileStatementNode::GetChildren(ChildSlots &children)
+{
+    children.push_back(Child(condition));
+    children.push_back(Child(body));
+}
+
+StatementNode* WhileStatementNode::Optimize(OptimizerClass &optimizer)
+{
+    StatementNode::Optimize(optimizer);
+    int value;
+    if (IsConstant(condition, value) && !value) {
+        optimizer.CountPruned();
+        return new NullStatementNode();
+    }
+    return this;
+}
+
+// The loop is left from its head, so what holds there holds after it.
+void WhileStatementNode::Propagate(KnownValues &known, OptimizerClass &optimizer)
+{
+    VariableNames written;
+    body->AddWrites(written);
+    LoopHeadKnown(known, written);
+    PropagateChild(condition, known, optimizer);
+    KnownValues bodyKnown = known;
+    body->Propagate(bodyKnown, optimizer);
+}
+
+// The loop head is sealed only once the body has jumped back to it.
+void WhileStatementNode::BuildIR(IRBuilderClass &builder)
+{
+    IRFunctionClass* function = builder.GetFunction();
+    IRBlock* head = function->NewBlock();
+    IRBlock* bodyBlock = function->NewBlock();
+    IRBlock* after = function->NewBlock();
+    for (InvariantNode* invariant : invariants) {
+        invariant->BuildPreheaderIR(builder);
+    }
+    builder.Jump(head);
+
+    builder.SetBlock(head);
+    condition->BuildBranch(builder, bodyBlock, after);
+    builder.SealBlock(bodyBlock);
+    builder.SetBlock(bodyBlock);
+    body->BuildIR(builder);
+    builder.Jump(head);
+    builder.SealBlock(head);
+
+    builder.SealBlock(after);
+    builder.SetBlock(after);
+}
+
+void WhileStatementNode::Liveness(LiveVariables &live) const
+{
+    condition->AddReads(live);
+    live = LoopHeadLiveness(live, [this](LiveVariables &through) {
+        body->Liveness(through);
+    });
+}
+
+StatementNode* WhileStatementNode::EliminateDeadCode(LiveVariables &live, OptimizerClass &optimizer)
+{
+    LiveVariables after = live;
+    Liveness(live);
+    LiveVariables bodyLive = live;
+    EliminateChild(body, bodyLive, optimizer);
+    if (IsDeadCountingLoop(condition, body, after)) {
+        optimizer.CountDeadCode();
+        live.swap(after);
+        return new NullStatementNode();
+    }
+    return this;
+}
+
+void WhileStatementNode::HoistInvariants(LoopNest &loops, OptimizerClass &optimizer)
+{
+    LoopHoist loop = LoopWrites(body, nullptr, &invariants);
+    loop.step = body->TrailingStep(loop.counter);
+    if (loop.step) {
+        loop.inductions = &inductions;
+    }
+    loops.push_back(loop);
+    HoistChild(condition, loops, optimizer);
+    body->HoistInvariants(loops, optimizer);
+    loops.pop_back();
+}
+
+void WhileStatementNode::PrintTree(int indent) const {
     for (int i = 0; i < indent; i++) std::cout << "  ";
     std::cout << "WhileStatement" << std::endl;
     condition->PrintTree(indent + 1);
@@ -209,6 +1066,9 @@ DoWhileStatementNode::~DoWhileStatementNode() {
 }
 
 void DoWhileStatementNode::Interpret() const {
+    for (InvariantNode* invariant : invariants) {
+        invariant->InterpretPreheader();
+    }
     do {
         body->Interpret();
     } while (condition->Evaluate());
@@ -216,21 +1076,99 @@ void DoWhileStatementNode::Interpret() const {
 
 void DoWhileStatementNode::Code(InstructionsClass &machineCode)
 {
-    unsigned char* address1 = machineCode.GetAddress();
+    for (InvariantNode* invariant : invariants) {
+        invariant->CodePreheader(machineCode);
+    }
+    int address1 = machineCode.GetAddress();
 
     body->Code(machineCode);
 
-    condition->CodeEvaluate(machineCode);
+    JumpList repeatJumps;
+    condition->CodeJumpIfTrue(machineCode, repeatJumps);
+    machineCode.SetOffsets(repeatJumps, address1);
+}
 
-    unsigned char* insertSkip = machineCode.SkipIfZeroStack();
-    unsigned char* address2 = machineCode.GetAddress();
+void DoWhileStatementNode::GetChildren(ChildSlots &children)
+{
+    children.push_back(Child(body));
+    children.push_back(Child(condition));
+}
 
-    unsigned char* insertJump = machineCode.Jump();
-    unsigned char* address3 = machineCode.GetAddress();
+// The body of a do-while that never repeats runs once, on its own.
+StatementNode* DoWhileStatementNode::Optimize(OptimizerClass &optimizer)
+{
+    StatementNode::Optimize(optimizer);
+    int value;
+    if (IsConstant(condition, value) && !value) {
+        optimizer.CountPruned();
+        StatementNode* once = body;
+        body = nullptr;
+        return once;
+    }
+    return this;
+}
 
-    machineCode.SetOffset(insertSkip, static_cast<int>(address3 - address2));
+// The test, and the way out, come right after the body.
+void DoWhileStatementNode::Propagate(KnownValues &known, OptimizerClass &optimizer)
+{
+    VariableNames written;
+    body->AddWrites(written);
+    LoopHeadKnown(known, written);
+    body->Propagate(known, optimizer);
+    PropagateChild(condition, known, optimizer);
+}
 
-    machineCode.SetOffset(insertJump, static_cast<int>(address1 - address3));
+void DoWhileStatementNode::BuildIR(IRBuilderClass &builder)
+{
+    IRFunctionClass* function = builder.GetFunction();
+    IRBlock* bodyBlock = function->NewBlock();
+    IRBlock* after = function->NewBlock();
+    for (InvariantNode* invariant : invariants) {
+        invariant->BuildPreheaderIR(builder);
+    }
+    builder.Jump(bodyBlock);
+
+    builder.SetBlock(bodyBlock);
+    body->BuildIR(builder);
+    condition->BuildBranch(builder, bodyBlock, after);
+    builder.SealBlock(bodyBlock);
+
+    builder.SealBlock(after);
+    builder.SetBlock(after);
+}
+
+// After the body come the test and then the body again, or the exit.
+void DoWhileStatementNode::Liveness(LiveVariables &live) const
+{
+    condition->AddReads(live);
+    live = LoopHeadLiveness(live, [this](LiveVariables &through) {
+        body->Liveness(through);
+    });
+    body->Liveness(live);
+}
+
+StatementNode* DoWhileStatementNode::EliminateDeadCode(LiveVariables &live, OptimizerClass &optimizer)
+{
+    LiveVariables after = live;
+    condition->AddReads(live);
+    live = LoopHeadLiveness(live, [this](LiveVariables &through) {
+        body->Liveness(through);
+    });
+    EliminateChild(body, live, optimizer);
+    if (IsDeadCountingLoop(condition, body, after)) {
+        optimizer.CountDeadCode();
+        live.swap(after);
+        return new NullStatementNode();
+    }
+    return this;
+}
+
+void DoWhileStatementNode::HoistInvariants(LoopNest &loops, OptimizerClass &optimizer)
+{
+    loops.push_back(LoopWrites(body, nullptr, &invariants));
+    body->HoistInvariants(loops, optimizer);
+    HoistChild(condition, loops, optimizer);
+    loops.pop_back();
 }
 
 void DoWhileStatementNode::PrintTree(int indent) const {
@@ -242,7 +1180,7 @@ void DoWhileStatementNode::PrintTree(int indent) const {
 
 
 RepeatStatementNode::RepeatStatementNode(ExpressionNode* expression, StatementGroupNode* statementGroup) 
-    : expression(expression), statementGroup(statementGroup) {}
+    : expression(expression), statementGroup(statementGroup), unroll(0) {}
 
 RepeatStatementNode::~RepeatStatementNode() {
     MSG("Deleting RepeatStatementNode\n");
@@ -252,6 +1190,9 @@ RepeatStatementNode::~RepeatStatementNode() {
 
 void RepeatStatementNode::Interpret() const {
     int count = expression->Evaluate();
+    for (InvariantNode* invariant : invariants) {
+        invariant->InterpretPreheader();
+    }
     for(int i = 0; i < count; i++) {
         statementGroup->Interpret();
     }   
@@ -259,31 +1200,147 @@ void RepeatStatementNode::Interpret() const {
 
 void RepeatStatementNode::Code(InstructionsClass &machineCode)
 {
-    int slot = machineCode.AllocateSlot();
+    int count;
+    if (unroll && IsConstant(expression, count) && count > 0) {
+        for (InvariantNode* invariant : invariants) {
+            invariant->CodePreheader(machineCode);
+        }
+        CodeUnrolled(machineCode, count, unroll, [this, &machineCode]() {
+            statementGroup->Code(machineCode);
+        });
+        return;
+    }
 
-    expression->CodeEvaluate(machineCode);
-    machineCode.PopAndStore(slot);
+    int slot = machineCode.AllocateSlot();
 
-    unsigned char* loopHead = machineCode.GetAddress();
+    expression->CodeAndStore(machineCode, slot);
+    for (InvariantNode* invariant : invariants) {
+        invariant->CodePreheader(machineCode);
+    }
 
-    machineCode.PushVariable(slot);
-    unsigned char* skipAddr = machineCode.SkipIfZeroStack();
-    unsigned char* bodyStart = machineCode.GetAddress();
+    // A count of zero or less runs the body no times, as in Interpret.
+    // Past that one test the count only goes down, to zero at the bottom.
+    int skipAddr;
+    if (machineCode.UseRegisters()) {
+        machineCode.LoadVariable(EAX_REGISTER, slot);
+        machineCode.CompareValue(EAX_REGISTER, 0);
+        skipAddr = machineCode.JumpIf(LESSEQUAL_COMPARE);
+    } else {
+        machineCode.PushVariable(slot);
+        machineCode.PushValue(0);
+        skipAddr = machineCode.PopPopCompareJump(LESSEQUAL_COMPARE);
+    }
+    int bodyStart = machineCode.GetAddress();
 
     statementGroup->Code(machineCode);
 
-    machineCode.PushVariable(slot);
-    machineCode.PushValue(1);
-    machineCode.PopPopSubPush();
-    machineCode.PopAndStore(slot);
+    int again = machineCode.CountDownJump(slot);
+    int afterLoop = machineCode.GetAddress();
 
-    unsigned char* backJump = machineCode.Jump();
-    unsigned char* afterLoop = machineCode.GetAddress();
+    machineCode.SetOffset(again, bodyStart - afterLoop);
+    machineCode.SetOffset(skipAddr, afterLoop - bodyStart);
+}
 
-    machineCode.SetOffset(skipAddr,
-                         static_cast<int>(afterLoop - bodyStart));
-    machineCode.SetOffset(backJump,
-                         static_cast<int>(loopHead - afterLoop));
+void RepeatStatementNode::GetChildren(ChildSlots &children)
+{
+    children.push_back(Child(expression));
+    children.push_back(Child(statementGroup));
+}
+
+StatementNode* RepeatStatementNode::Optimize(OptimizerClass &optimizer)
+{
+    StatementNode::Optimize(optimizer);
+    int value;
+    if (IsConstant(expression, value) && value <= 0) {
+        optimizer.CountPruned();
+        return new NullStatementNode();
+    }
+    if (IsConstant(expression, value)) {
+        unroll = optimizer.UnrollFactor(value, statementGroup->Size());
+    }
+    return this;
+}
+
+void RepeatStatementNode::Propagate(KnownValues &known, OptimizerClass &optimizer)
+{
+    PropagateChild(expression, known, optimizer);
+    VariableNames written;
+    statementGroup->AddWrites(written);
+    LoopHeadKnown(known, written);
+    KnownValues bodyKnown = known;
+    statementGroup->Propagate(bodyKnown, optimizer);
+}
+
+// The count lives in a variable of the builder's own, counting down.
+void RepeatStatementNode::BuildIR(IRBuilderClass &builder)
+{
+    IRFunctionClass* function = builder.GetFunction();
+    int counter = builder.NewVariable();
+    builder.WriteVariable(counter, expression->BuildIR(builder));
+    IRBlock* head = function->NewBlock();
+    IRBlock* bodyBlock = function->NewBlock();
+    IRBlock* after = function->NewBlock();
+    for (InvariantNode* invariant : invariants) {
+        invariant->BuildPreheaderIR(builder);
+    }
+    builder.Jump(head);
+
+    builder.SetBlock(head);
+    IRInstruction* more = builder.Binary(GREATER_TOKEN, builder.ReadVariable(counter),
+                                         function->Constant(0));
+    builder.Branch(more, bodyBlock, after);
+    builder.SealBlock(bodyBlock);
+    builder.SetBlock(bodyBlock);
+    statementGroup->BuildIR(builder);
+    builder.WriteVariable(counter, builder.Binary(MINUS_TOKEN, builder.ReadVariable(counter),
+                                                  function->Constant(1)));
+    builder.Jump(head);
+    builder.SealBlock(head);
+
+    builder.SealBlock(after);
+    builder.SetBlock(after);
+}
+
+void RepeatStatementNode::Liveness(LiveVariables &live) const
+{
+    live = LoopHeadLiveness(live, [this](LiveVariables &through) {
+        statementGroup->Liveness(through);
+    });
+    expression->AddReads(live);
+}
+
+// A repeat always ends, so one with an empty body can go.
+StatementNode* RepeatStatementNode::EliminateDeadCode(LiveVariables &live, OptimizerClass &optimizer)
+{
+    live = LoopHeadLiveness(live, [this](LiveVariables &through) {
+        statementGroup->Liveness(through);
+    });
+    LiveVariables bodyLive = live;
+    statementGroup->EliminateDeadCode(bodyLive, optimizer);
+    if (statementGroup->IsEmpty() && !expression->MayTrap()) {
+        optimizer.CountDeadCode();
+        return new NullStatementNode();
+    }
+    expression->AddReads(live);
+    return this;
+}
+
+// The count is worked out once already, outside the loop.
+void RepeatStatementNode::HoistInvariants(LoopNest &loops, OptimizerClass &optimizer)
+{
+    HoistChild(expression, loops, optimizer);
+    LoopHoist loop = LoopWrites(nullptr, nullptr, &invariants);
+    statementGroup->AddWrites(loop.written);
+    loops.push_back(loop);
+    statementGroup->HoistInvariants(loops, optimizer);
+    loops.pop_back();
+}
+
+int RepeatStatementNode::Size() const
+{
+    int count;
+    int copies = IsConstant(expression, count) ? UnrolledCopies(count, unroll) : 1;
+    return 1 + expression->Size() + statementGroup->Size() * copies;
 }
 
 void RepeatStatementNode::PrintTree(int indent) const {
@@ -297,6 +1354,60 @@ ExpressionNode::~ExpressionNode() {
     MSG("Deleting ExpressionNode\n");
 }
 
+void ExpressionNode::CodeJumpIfFalse(InstructionsClass &machineCode, JumpList &falseJumps)
+{
+    if (machineCode.UseRegisters()) {
+        CodeRegister(machineCode);
+        falseJumps.push_back(machineCode.SkipIfZeroRegister(machineCode.TopRegister()));
+        return;
+    }
+    CodeEvaluate(machineCode);
+    falseJumps.push_back(machineCode.SkipIfZeroStack());
+}
+
+void ExpressionNode::CodeJumpIfTrue(InstructionsClass &machineCode, JumpList &trueJumps)
+{
+    if (machineCode.UseRegisters()) {
+        CodeRegister(machineCode);
+        trueJumps.push_back(machineCode.SkipIfNotZeroRegister(machineCode.TopRegister()));
+        return;
+    }
+    CodeEvaluate(machineCode);
+    trueJumps.push_back(machineCode.SkipIfNotZeroStack());
+}
+
+void ExpressionNode::BuildBranch(IRBuilderClass &builder, IRBlock* whenTrue, IRBlock* whenFalse)
+{
+    builder.Branch(BuildIR(builder), whenTrue, whenFalse);
+}
+
+int ExpressionNode::RegisterNeed() const
+{
+    return 1;
+}
+
+void ExpressionNode::CodeAndStore(InstructionsClass &machineCode, int index)
+{
+    if (machineCode.UseRegisters()) {
+        CodeRegister(machineCode);
+        machineCode.StoreVariable(index, machineCode.TopRegister());
+    } else {
+        CodeEvaluate(machineCode);
+        machineCode.PopAndStore(index);
+    }
+}
+
+void ExpressionNode::CodeAndWrite(InstructionsClass &machineCode)
+{
+    if (machineCode.UseRegisters()) {
+        CodeRegister(machineCode);
+        machineCode.WriteRegister(machineCode.TopRegister());
+    } else {
+        CodeEvaluate(machineCode);
+        machineCode.PopAndWrite();
+    }
+}
+
 CoutStatementNode::CoutStatementNode(const std::vector<ExpressionNode *> &items) : items(items) {}
 
 CoutStatementNode::~CoutStatementNode()
@@ -307,13 +1418,23 @@ CoutStatementNode::~CoutStatementNode()
     }
 }
 
+// endl items are null.
+void CoutStatementNode::GetChildren(ChildSlots &children)
+{
+    for (ExpressionNode* &item : items) {
+        children.push_back(Child(item));
+    }
+}
+
 void CoutStatementNode::Interpret() const {
+    // Same format as the print routine in InstructionsClass.
     for (auto ptr : items) {
         if (ptr) {
-            std::cout << ptr->Evaluate() << " ";
+            gStandardOutput.WriteInteger(ptr->Evaluate());
+            gStandardOutput.WriteCharacter(' ');
         }
         else {
-            std::cout << std::endl;
+            gStandardOutput.WriteCharacter('\n');
         }
 
     }
@@ -323,14 +1444,33 @@ void CoutStatementNode::Code(InstructionsClass &machineCode)
 {
     for (auto ptr : items){
         if (ptr){
-            ptr->CodeEvaluate(machineCode);
-            machineCode.PopAndWrite();
+            ptr->CodeAndWrite(machineCode);
         }else{
             machineCode.WriteEndLinux64();
         }
     }
 }
 
+void CoutStatementNode::BuildIR(IRBuilderClass &builder)
+{
+    for (auto ptr : items) {
+        if (ptr) {
+            builder.Write(ptr->BuildIR(builder));
+        } else {
+            builder.WriteEnd();
+        }
+    }
+}
+
+int CoutStatementNode::Size() const
+{
+    int size = 1;
+    for (auto ptr : items) {
+        size += ptr ? ptr->Size() : 1;
+    }
+    return size;
+}
+
 void CoutStatementNode::PrintTree(int indent) const {
     for (int i = 0; i < indent; i++) std::cout << "  ";
     std::cout << "CoutChain" << std::endl;
@@ -356,6 +1496,10 @@ void IdentifierNode::SetValue(int v) const {
 int IdentifierNode::GetIndex() const {
     return symbolTable->GetIndex(label);
 }
+
+const std::string& IdentifierNode::GetLabel() const {
+    return label;
+}
 int IdentifierNode::Evaluate() const {
     return symbolTable->GetValue(label);
 }
@@ -363,107 +1507,674 @@ void IdentifierNode::CodeEvaluate(InstructionsClass &machineCode)
 {
     machineCode.PushVariable(this->GetIndex());
 }
+void IdentifierNode::CodeRegister(InstructionsClass &machineCode)
+{
+    machineCode.LoadVariable(machineCode.TopRegister(), this->GetIndex());
+}
+
+IRInstruction* IdentifierNode::BuildIR(IRBuilderClass &builder)
+{
+    return builder.ReadVariable(GetIndex());
+}
+
+ExpressionNode* IdentifierNode::Propagate(const KnownValues &known, OptimizerClass &optimizer)
+{
+    auto it = known.find(label);
+    if (it == known.end()) {
+        return this;
+    }
+    if (it->second.isConstant) {
+        optimizer.CountPropagated();
+        return new IntegerNode(it->second.value);
+    }
+    optimizer.CountCopied();
+    return new IdentifierNode(it->second.copy, symbolTable);
+}
+
+void IdentifierNode::AddReads(VariableNames &reads) const
+{
+    reads.insert(label);
+}
+// Variables declared further on have no index yet; they are not counted.
+void IdentifierNode::CountVariableUses(VariableUses &uses) const
+{
+    if (symbolTable->Exists(label)) {
+        uses[GetIndex()]++;
+    }
+}
+
 void IdentifierNode::PrintTree(int indent) const
 {
     for (int i = 0; i < indent; i++) std::cout << "  ";
     std::cout << "Identifier: " << label << std::endl;
 }
 
-DeclarationStatementNode::DeclarationStatementNode(IdentifierNode* identifier, ExpressionNode* expression) : identifier(identifier), expression(expression) {}
+StoreStatementNode::StoreStatementNode(IdentifierNode* identifier, ExpressionNode* expression) : identifier(identifier), expression(expression) {}
 
-DeclarationStatementNode::~DeclarationStatementNode() {
-    MSG("Deleting DeclarationStatementNode\n");
+StoreStatementNode::~StoreStatementNode() {
+    MSG("Deleting StoreStatementNode\n");
     delete identifier;
     delete expression;
 }
 
-void DeclarationStatementNode::Interpret() const {
-    identifier->DeclareVariable();
-    if(expression){
-        identifier->SetValue(expression->Evaluate());
+void StoreStatementNode::CountVariableUses(VariableUses &uses) const
+{
+    identifier->CountVariableUses(uses);
+    StatementNode::CountVariableUses(uses);
+}
+
+void StoreStatementNode::AddWrites(VariableNames &written) const
+{
+    written.insert(identifier->GetLabel());
+}
+
+void StoreStatementNode::GetChildren(ChildSlots &children)
+{
+    children.push_back(Child(expression));
+}
+
+DeclarationStatementNode::DeclarationStatementNode(IdentifierNode* identifier, ExpressionNode* expression) : AssignmentStatementNode(identifier, expression), declared(false) {}
+
+void DeclarationStatementNode::Interpret() const {
+    identifier->DeclareVariable();
+    if(expression){
+        identifier->SetValue(expression->Evaluate());
+    }
+}
+
+void DeclarationStatementNode::Code(InstructionsClass &machineCode)
+{
+    if (!declared) {
+        identifier->DeclareVariable();
+        declared = true;
+    }
+    if(expression){
+        int slot = identifier->GetIndex();
+        expression->CodeAndStore(machineCode, slot);
+        MSG("Storing value in slot: " << slot << std::endl);
+    }
+}
+
+// The variable's own store is not counted.
+void DeclarationStatementNode::CountVariableUses(VariableUses &uses) const
+{
+    StatementNode::CountVariableUses(uses);
+}
+
+// Declared without a value, a variable starts at 0.
+void DeclarationStatementNode::BuildIR(IRBuilderClass &builder)
+{
+    identifier->DeclareVariable();
+    IRInstruction* value = expression ? expression->BuildIR(builder)
+                                      : builder.GetFunction()->Constant(0);
+    builder.WriteVariable(identifier->GetIndex(), value);
+}
+
+// Only the value goes; later statements may still name the variable.
+StatementNode* DeclarationStatementNode::EliminateDeadCode(LiveVariables &live, OptimizerClass &optimizer)
+{
+    if (expression && !StoreIsLive(identifier, expression, live)) {
+        optimizer.CountDeadStore();
+        delete expression;
+        expression = nullptr;
+    }
+    Liveness(live);
+    return this;
+}
+
+void DeclarationStatementNode::PrintTree(int indent) const {
+    for (int i = 0; i < indent; i++) std::cout << "  ";
+    std::cout << "DeclarationStatement" << std::endl;
+    if (identifier) {
+        identifier->PrintTree(indent + 1);
+    }
+}
+
+AssignmentStatementNode::AssignmentStatementNode(IdentifierNode* identifier, ExpressionNode* expression) : StoreStatementNode(identifier, expression) {}
+
+void AssignmentStatementNode::Interpret() const {
+    identifier->SetValue(expression->Evaluate());
+}
+
+void AssignmentStatementNode::Code(InstructionsClass &machineCode)
+{
+    int slot = identifier->GetIndex();
+    expression->CodeAndStore(machineCode, slot);
+    MSG("Storing value in slot: " << slot << std::endl);
+}
+
+void AssignmentStatementNode::Propagate(KnownValues &known, OptimizerClass &optimizer)
+{
+    PropagateChild(expression, known, optimizer);
+    StoreKnown(known, identifier->GetLabel(), expression);
+}
+
+void AssignmentStatementNode::BuildIR(IRBuilderClass &builder)
+{
+    builder.WriteVariable(identifier->GetIndex(), expression->BuildIR(builder));
+}
+
+void AssignmentStatementNode::Liveness(LiveVariables &live) const
+{
+    bool stored = expression && StoreIsLive(identifier, expression, live);
+    live.erase(identifier->GetLabel());
+    if (stored) {
+        expression->AddReads(live);
+    }
+}
+
+StatementNode* AssignmentStatementNode::EliminateDeadCode(LiveVariables &live, OptimizerClass &optimizer)
+{
+    if (!StoreIsLive(identifier, expression, live)) {
+        optimizer.CountDeadStore();
+        return new NullStatementNode();
+    }
+    Liveness(live);
+    return this;
+}
+
+bool AssignmentStatementNode::ConstantStore(std::string &label, int &value) const
+{
+    label = identifier->GetLabel();
+    return IsConstant(expression, value);
+}
+
+void AssignmentStatementNode::PrintTree(int indent) const {
+    for (int i = 0; i < indent; i++) std::cout << "  ";
+    std::cout << "AssignmentStatement" << std::endl;
+    if (identifier) {
+        identifier->PrintTree(indent + 1);
+    }
+    if (expression) {
+        expression->PrintTree(indent + 1);
+    }
+}
+
+IntegerNode::IntegerNode(int value) : value(value) {}
+
+int IntegerNode::Evaluate() const {
+    return value;
+}
+
+void IntegerNode::CodeEvaluate(InstructionsClass &machineCode)
+{
+    machineCode.PushValue(value);
+}
+
+void IntegerNode::CodeRegister(InstructionsClass &machineCode)
+{
+    machineCode.LoadValue(machineCode.TopRegister(), value);
+}
+
+IRInstruction* IntegerNode::BuildIR(IRBuilderClass &builder)
+{
+    return builder.GetFunction()->Constant(value);
+}
+
+void IntegerNode::PrintTree(int indent) const {
+    for (int i = 0; i < indent; i++) std::cout << "  ";
+    std::cout << "Integer: " << value << std::endl;
+}
+
+
+InvariantNode::InvariantNode(ExpressionNode* expression)
+    : expression(expression), slot(-1), value(0), irValue(nullptr) {}
+
+InvariantNode::~InvariantNode() {
+    MSG("Deleting InvariantNode\n");
+    delete expression;
+}
+
+void InvariantNode::CodePreheader(InstructionsClass &machineCode)
+{
+    slot = machineCode.AllocateSlot();
+    expression->CodeAndStore(machineCode, slot);
+}
+
+void InvariantNode::InterpretPreheader()
+{
+    value = expression->Evaluate();
+}
+
+void InvariantNode::BuildPreheaderIR(IRBuilderClass &builder)
+{
+    irValue = expression->BuildIR(builder);
+}
+
+int InvariantNode::Evaluate() const {
+    return value;
+}
+
+void InvariantNode::CodeEvaluate(InstructionsClass &machineCode)
+{
+    machineCode.PushVariable(slot);
+}
+
+void InvariantNode::CodeRegister(InstructionsClass &machineCode)
+{
+    machineCode.LoadVariable(machineCode.TopRegister(), slot);
+}
+
+// Before its loop has been coded there is no slot yet.
+void InvariantNode::CountVariableUses(VariableUses &uses) const
+{
+    if (slot >= 0) {
+        uses[slot]++;
+    } else {
+        expression->CountVariableUses(uses);
+    }
+}
+
+IRInstruction* InvariantNode::BuildIR(IRBuilderClass &builder)
+{
+    return irValue;
+}
+
+void InvariantNode::AddReads(VariableNames &reads) const
+{
+    expression->AddReads(reads);
+}
+
+void InvariantNode::PrintTree(int indent) const {
+    for (int i = 0; i < indent; i++) std::cout << "  ";
+    std::cout << "Invariant" << std::endl;
+    expression->PrintTree(indent + 1);
+}
+
+InductionNode::InductionNode(ExpressionNode* expression, int increment)
+    : expression(expression), increment(increment), slot(-1), value(0) {}
+
+InductionNode::~InductionNode() {
+    MSG("Deleting InductionNode\n");
+    delete expression;
+}
+
+void InductionNode::CodePreheader(InstructionsClass &machineCode)
+{
+    slot = machineCode.AllocateSlot();
+    expression->CodeAndStore(machineCode, slot);
+}
+
+void InductionNode::CodeStep(InstructionsClass &machineCode)
+{
+    if (machineCode.UseRegisters()) {
+        RegisterType reg = machineCode.VariableRegister(slot, EAX_REGISTER);
+        machineCode.LoadVariable(reg, slot);
+        machineCode.OperateValue(PLUS_TOKEN, reg, increment);
+        machineCode.StoreVariable(slot, reg);
+        return;
+    }
+    machineCode.PushVariable(slot);
+    machineCode.PushValue(increment);
+    machineCode.PopPopAddPush();
+    machineCode.PopAndStore(slot);
+}
+
+void InductionNode::InterpretPreheader()
+{
+    value = expression->Evaluate();
+}
+
+void InductionNode::InterpretStep()
+{
+    value = (int)((unsigned int)value + (unsigned int)increment);
+}
+
+int InductionNode::Evaluate() const {
+    return value;
+}
+
+void InductionNode::CodeEvaluate(InstructionsClass &machineCode)
+{
+    machineCode.PushVariable(slot);
+}
+
+void InductionNode::CodeRegister(InstructionsClass &machineCode)
+{
+    machineCode.LoadVariable(machineCode.TopRegister(), slot);
+}
+
+void InductionNode::CountVariableUses(VariableUses &uses) const
+{
+    if (slot >= 0) {
+        uses[slot]++;
+    } else {
+        expression->CountVariableUses(uses);
+    }
+}
+
+// The SSA form already sees the whole loop; the expression stays.
+IRInstruction* InductionNode::BuildIR(IRBuilderClass &builder)
+{
+    return expression->BuildIR(builder);
+}
+
+void InductionNode::AddReads(VariableNames &reads) const
+{
+    expression->AddReads(reads);
+}
+
+void InductionNode::PrintTree(int indent) const {
+    for (int i = 0; i < indent; i++) std::cout << "  ";
+    std::cout << "Induction" << std::endl;
+    expression->PrintTree(indent + 1);
+}
+
+BinaryOperatorNode::BinaryOperatorNode(ExpressionNode* left, ExpressionNode* right) : left(left), right(right) {}
+
+BinaryOperatorNode::~BinaryOperatorNode() {
+    MSG( "Deleting BinaryOperatorNode\n");
+    delete left;
+    delete right;
+}
+
+void BinaryOperatorNode::CountVariableUses(VariableUses &uses) const
+{
+    left->CountVariableUses(uses);
+    right->CountVariableUses(uses);
+}
+
+// Folds operators on two constants, using Evaluate so that the result is
+// what the interpreter would get. Division by zero (and INT_MIN / -1) is
+// left to fail at run time. && and || with a constant left side decide
+// without the right side or become its truth value, and adding 0 or
+// multiplying by 1 leaves the other side.
+ExpressionNode* BinaryOperatorNode::Optimize(OptimizerClass &optimizer) {
+    OptimizeChild(left, optimizer);
+    OptimizeChild(right, optimizer);
+    TokenType operation = GetOperator();
+    int leftValue = 0;
+    int rightValue = 0;
+    bool leftConstant = IsConstant(left, leftValue);
+    bool rightConstant = IsConstant(right, rightValue);
+
+    if (leftConstant && rightConstant) {
+        if ((operation == DIVIDE_TOKEN || operation == MOD_TOKEN)
+            && (rightValue == 0 || (rightValue == -1 && leftValue == INT_MIN))) {
+            return this;
+        }
+        optimizer.CountFolded();
+        return new IntegerNode(Evaluate());
     }
-}
 
-void DeclarationStatementNode::Code(InstructionsClass &machineCode)
-{
-    identifier->DeclareVariable();
-    if(expression){
-        expression->CodeEvaluate(machineCode);
-        int slot = identifier->GetIndex();
-        machineCode.PopAndStore(slot);
-        MSG("Storing value in slot: " << slot << std::endl);
+    if (leftConstant && (operation == AND_TOKEN || operation == OR_TOKEN)) {
+        optimizer.CountFolded();
+        bool leftTrue = leftValue != 0;
+        if (leftTrue == (operation == OR_TOKEN)) {
+            return new IntegerNode(leftTrue ? 1 : 0);
+        }
+        ExpressionNode* truth = right;
+        right = nullptr;
+        if (dynamic_cast<RelationalOperatorNode*>(truth) || dynamic_cast<AndNode*>(truth)
+            || dynamic_cast<OrNode*>(truth)) {
+            return truth; // already 0 or 1
+        }
+        return new NotEqualNode(truth, new IntegerNode(0));
     }
-}
 
-void DeclarationStatementNode::PrintTree(int indent) const {
-    for (int i = 0; i < indent; i++) std::cout << "  ";
-    std::cout << "DeclarationStatement" << std::endl;
-    if (identifier) {
-        identifier->PrintTree(indent + 1);
+    ExpressionNode* same = nullptr;
+    switch (operation) {
+    case PLUS_TOKEN:
+        if (rightConstant && rightValue == 0) same = left;
+        if (leftConstant && leftValue == 0) same = right;
+        break;
+    case MINUS_TOKEN:
+        if (rightConstant && rightValue == 0) same = left;
+        break;
+    case TIMES_TOKEN:
+        if (rightConstant && rightValue == 1) same = left;
+        if (leftConstant && leftValue == 1) same = right;
+        break;
+    case DIVIDE_TOKEN:
+    case POWER_TOKEN:
+        if (rightConstant && rightValue == 1) same = left;
+        break;
+    default:
+        break;
+    }
+    if (!same) {
+        return this;
     }
+    optimizer.CountSimplified();
+    if (same == left) {
+        left = nullptr;
+    } else {
+        right = nullptr;
+    }
+    return same;
 }
 
-AssignmentStatementNode::AssignmentStatementNode(IdentifierNode* identifier, ExpressionNode* expression) : identifier(identifier), expression(expression) {}
+ExpressionNode* BinaryOperatorNode::Propagate(const KnownValues &known, OptimizerClass &optimizer)
+{
+    PropagateChild(left, known, optimizer);
+    PropagateChild(right, known, optimizer);
+    return this;
+}
 
-AssignmentStatementNode::~AssignmentStatementNode() {
-    MSG("Deleting AssignmentStatementNode\n");
-    delete identifier;
-    delete expression;
+IRInstruction* BinaryOperatorNode::BuildIR(IRBuilderClass &builder)
+{
+    IRInstruction* leftValue = left->BuildIR(builder);
+    IRInstruction* rightValue = right->BuildIR(builder);
+    return builder.Binary(GetOperator(), leftValue, rightValue);
 }
 
-void AssignmentStatementNode::Interpret() const {
-    identifier->SetValue(expression->Evaluate());
+void BinaryOperatorNode::AddReads(VariableNames &reads) const
+{
+    left->AddReads(reads);
+    right->AddReads(reads);
 }
 
-void AssignmentStatementNode::Code(InstructionsClass &machineCode)
+// Dividing by anything but a constant other than 0 and -1 may trap.
+int BinaryOperatorNode::Size() const
 {
-    expression->CodeEvaluate(machineCode);
-    int slot = identifier->GetIndex();
-    machineCode.PopAndStore(slot);
-    MSG("Storing value in slot: " << slot << std::endl);
+    return 1 + left->Size() + right->Size();
 }
 
-void AssignmentStatementNode::PrintTree(int indent) const {
-    for (int i = 0; i < indent; i++) std::cout << "  ";
-    std::cout << "AssignmentStatement" << std::endl;
-    if (identifier) {
-        identifier->PrintTree(indent + 1);
+bool BinaryOperatorNode::MayTrap() const
+{
+    if (left->MayTrap() || right->MayTrap()) {
+        return true;
     }
-    if (expression) {
-        expression->PrintTree(indent + 1);
+    TokenType operation = GetOperator();
+    if (operation != DIVIDE_TOKEN && operation != MOD_TOKEN) {
+        return false;
     }
+    int divisor;
+    return !IsConstant(right, divisor) || divisor == 0 || divisor == -1;
 }
 
-IntegerNode::IntegerNode(int value) : value(value) {}
-
-int IntegerNode::Evaluate() const {
-    return value;
+// i * c, or c * i, where the innermost of the loops counts i by one,
+// becomes an InductionNode of that loop.
+InductionNode* BinaryOperatorNode::Induction(const LoopNest &loops, size_t depth,
+                                             OptimizerClass &optimizer)
+{
+    if (GetOperator() != TIMES_TOKEN) {
+        return nullptr;
+    }
+    const IdentifierNode* counter = dynamic_cast<const IdentifierNode*>(left);
+    int factor;
+    bool constant = IsConstant(right, factor);
+    if (!counter) {
+        counter = dynamic_cast<const IdentifierNode*>(right);
+        constant = IsConstant(left, factor);
+    }
+    if (!counter || !constant || factor == 0 || factor == 1 || factor == -1) {
+        return nullptr;
+    }
+    if (!depth || !loops[depth - 1].inductions || loops[depth - 1].counter != counter->GetLabel()) {
+        return nullptr;
+    }
+    optimizer.CountReduced();
+    int increment = (int)((unsigned int)factor * (unsigned int)loops[depth - 1].step);
+    InductionNode* induction = new InductionNode(this, increment);
+    loops[depth - 1].inductions->push_back(induction);
+    return induction;
+}
+
+// Moves the expression before the outermost loop that writes none of
+// what it reads. Only expressions that cannot trap move: the loop might
+// not have run them at all.
+ExpressionNode* BinaryOperatorNode::HoistInvariants(const LoopNest &loops, size_t depth,
+                                                    OptimizerClass &optimizer)
+{
+    VariableNames reads;
+    AddReads(reads);
+    size_t outermost = depth;
+    if (!reads.empty() && !MayTrap()) {
+        for (size_t i = 0; i < depth && outermost == depth; i++) {
+            bool invariant = true;
+            for (const std::string &label : reads) {
+                if (loops[i].written.count(label)) {
+                    invariant = false;
+                    break;
+                }
+            }
+            if (invariant) {
+                outermost = i;
+            }
+        }
+    }
+    // Stepped by the loop just outside where it is invariant.
+    if (InductionNode* induction = Induction(loops, outermost, optimizer)) {
+        return induction;
+    }
+    if (outermost == depth) {
+        left = left->HoistInvariants(loops, depth, optimizer);
+        right = right->HoistInvariants(loops, depth, optimizer);
+        return this;
+    }
+    optimizer.CountHoisted();
+    InvariantNode* invariant = new InvariantNode(this);
+    loops[outermost].invariants->push_back(invariant);
+    // Parts of it may be invariant further out still.
+    left = left->HoistInvariants(loops, outermost, optimizer);
+    right = right->HoistInvariants(loops, outermost, optimizer);
+    return invariant;
 }
 
-void IntegerNode::CodeEvaluate(InstructionsClass &machineCode)
+// && and || as values: branch on them, then merge a 1 and a 0.
+static IRInstruction* BuildTruthValue(ExpressionNode* expression, IRBuilderClass &builder)
 {
-    machineCode.PushValue(value);
+    IRFunctionClass* function = builder.GetFunction();
+    IRBlock* whenTrue = function->NewBlock();
+    IRBlock* whenFalse = function->NewBlock();
+    IRBlock* after = function->NewBlock();
+    int truth = builder.NewVariable();
+    expression->BuildBranch(builder, whenTrue, whenFalse);
+    builder.SealBlock(whenTrue);
+    builder.SealBlock(whenFalse);
+
+    builder.SetBlock(whenTrue);
+    builder.WriteVariable(truth, function->Constant(1));
+    builder.Jump(after);
+    builder.SetBlock(whenFalse);
+    builder.WriteVariable(truth, function->Constant(0));
+    builder.Jump(after);
+
+    builder.SealBlock(after);
+    builder.SetBlock(after);
+    return builder.ReadVariable(truth);
 }
 
-void IntegerNode::PrintTree(int indent) const {
+void BinaryOperatorNode::PrintTree(int indent) const {
     for (int i = 0; i < indent; i++) std::cout << "  ";
-    std::cout << "Integer: " << value << std::endl;
+    std::cout << "Binary Operator" << std::endl;
+    if (left) left->PrintTree(indent + 1);
+    if (right) right->PrintTree(indent + 1);
 }
 
+// A constant on the right goes into the instruction, so needs no register.
+int BinaryOperatorNode::RegisterNeed() const {
+    if (ConstantOnLeft()) {
+        return right->RegisterNeed();
+    }
+    int leftNeed = left->RegisterNeed();
+    int rightNeed = dynamic_cast<IntegerNode*>(right) ? 0 : right->RegisterNeed();
+    if (leftNeed == rightNeed) {
+        return leftNeed + 1;
+    }
+    return leftNeed > rightNeed ? leftNeed : rightNeed;
+}
 
-BinaryOperatorNode::BinaryOperatorNode(ExpressionNode* left, ExpressionNode* right) : left(left), right(right) {}
+void BinaryOperatorNode::CodeRegister(InstructionsClass &mc) {
+    CodeRegisterOperands(mc, false);
+}
 
-BinaryOperatorNode::~BinaryOperatorNode() {
-    MSG( "Deleting BinaryOperatorNode\n");
-    delete left;
-    delete right;
+// 8 * x is coded as x * 8, for the operators where that is the same.
+bool BinaryOperatorNode::ConstantOnLeft() const {
+    TokenType operation = GetOperator();
+    return (operation == PLUS_TOKEN || operation == TIMES_TOKEN)
+        && dynamic_cast<IntegerNode*>(left) && !dynamic_cast<IntegerNode*>(right);
 }
 
-void BinaryOperatorNode::PrintTree(int indent) const {
-    for (int i = 0; i < indent; i++) std::cout << "  ";
-    std::cout << "Binary Operator" << std::endl;
-    if (left) left->PrintTree(indent + 1);
-    if (right) right->PrintTree(indent + 1);
+// gencode from the Dragon Book. The result ends up in the register that
+// was on top when we started; the needier side is coded first so that
+// the other side fits in the registers left over.
+void BinaryOperatorNode::CodeRegisterOperands(InstructionsClass &mc, bool compareOnly) {
+    if (!compareOnly && ConstantOnLeft()) {
+        right->CodeRegister(mc);
+        mc.OperateValue(GetOperator(), mc.TopRegister(), left->Evaluate());
+        return;
+    }
+    IntegerNode* constant = dynamic_cast<IntegerNode*>(right);
+    if (constant) {
+        left->CodeRegister(mc);
+        if (compareOnly) {
+            mc.CompareValue(mc.TopRegister(), constant->Evaluate());
+        } else {
+            mc.OperateValue(GetOperator(), mc.TopRegister(), constant->Evaluate());
+        }
+        return;
+    }
+
+    // So does a variable held in a register.
+    IdentifierNode* variable = dynamic_cast<IdentifierNode*>(right);
+    if (variable && mc.IsPromoted(variable->GetIndex())) {
+        left->CodeRegister(mc);
+        RegisterType operand = mc.PromotedRegister(variable->GetIndex());
+        if (compareOnly) {
+            mc.CompareRegisters(mc.TopRegister(), operand);
+        } else {
+            mc.OperateRegisters(GetOperator(), mc.TopRegister(), operand);
+        }
+        return;
+    }
+
+    int leftNeed = left->RegisterNeed();
+    int rightNeed = right->RegisterNeed();
+    int freeCount = mc.FreeRegisterCount();
+    RegisterType result;
+    RegisterType operand;
+    if (leftNeed < rightNeed && leftNeed < freeCount) {
+        // Right side first, into the second register.
+        mc.SwapRegisters();
+        right->CodeRegister(mc);
+        operand = mc.AllocateRegister();
+        left->CodeRegister(mc);
+        result = mc.TopRegister();
+        mc.FreeRegister(operand);
+        mc.SwapRegisters();
+    } else if (rightNeed <= leftNeed && rightNeed < freeCount) {
+        left->CodeRegister(mc);
+        result = mc.AllocateRegister();
+        right->CodeRegister(mc);
+        operand = mc.TopRegister();
+        mc.FreeRegister(result);
+    } else {
+        // Both sides need every register: spill the right side.
+        right->CodeRegister(mc);
+        mc.PushRegister(mc.TopRegister());
+        left->CodeRegister(mc);
+        result = mc.TopRegister();
+        operand = SPILL_REGISTER;
+        mc.PopRegister(operand);
+    }
+
+    if (compareOnly) {
+        mc.CompareRegisters(result, operand);
+    } else {
+        mc.OperateRegisters(GetOperator(), result, operand);
+    }
 }
 
 
@@ -521,6 +2232,18 @@ int TimesNode::Evaluate() const {
 
 void TimesNode::CodeEvaluate(InstructionsClass &machineCode)
 {
+    // Either side may be the constant, since multiplying commutes.
+    IntegerNode* constant = dynamic_cast<IntegerNode*>(right);
+    ExpressionNode* other = left;
+    if (!constant) {
+        constant = dynamic_cast<IntegerNode*>(left);
+        other = right;
+    }
+    if (constant) {
+        other->CodeEvaluate(machineCode);
+        machineCode.PopMulConstantPush(constant->Evaluate());
+        return;
+    }
     left ->CodeEvaluate(machineCode);
     right->CodeEvaluate(machineCode);
     machineCode.PopPopMulPush();
@@ -547,6 +2270,11 @@ int DivideNode::Evaluate() const {
 void DivideNode::CodeEvaluate(InstructionsClass &machineCode)
 {
     left ->CodeEvaluate(machineCode);
+    IntegerNode* constant = dynamic_cast<IntegerNode*>(right);
+    if (constant) {
+        machineCode.PopDivConstantPush(constant->Evaluate());
+        return;
+    }
     right->CodeEvaluate(machineCode);
     machineCode.PopPopDivPush();
 }
@@ -558,7 +2286,35 @@ void DivideNode::PrintTree(int indent) const {
     if (right) right->PrintTree(indent + 1);
 }
 
-LessNode::LessNode(ExpressionNode* left, ExpressionNode* right) : BinaryOperatorNode(left, right) {}
+RelationalOperatorNode::RelationalOperatorNode(ExpressionNode* left, ExpressionNode* right) : BinaryOperatorNode(left, right) {}
+
+void RelationalOperatorNode::CodeJumpIfFalse(InstructionsClass &machineCode, JumpList &falseJumps)
+{
+    if (machineCode.UseRegisters()) {
+        CodeRegisterOperands(machineCode, true);
+        falseJumps.push_back(machineCode.JumpIf(
+            InstructionsClass::Opposite(GetComparison())));
+        return;
+    }
+    left ->CodeEvaluate(machineCode);
+    right->CodeEvaluate(machineCode);
+    falseJumps.push_back(machineCode.PopPopCompareJump(
+        InstructionsClass::Opposite(GetComparison())));
+}
+
+void RelationalOperatorNode::CodeJumpIfTrue(InstructionsClass &machineCode, JumpList &trueJumps)
+{
+    if (machineCode.UseRegisters()) {
+        CodeRegisterOperands(machineCode, true);
+        trueJumps.push_back(machineCode.JumpIf(GetComparison()));
+        return;
+    }
+    left ->CodeEvaluate(machineCode);
+    right->CodeEvaluate(machineCode);
+    trueJumps.push_back(machineCode.PopPopCompareJump(GetComparison()));
+}
+
+LessNode::LessNode(ExpressionNode* left, ExpressionNode* right) : RelationalOperatorNode(left, right) {}
 
 int LessNode::Evaluate() const {
     return left->Evaluate() < right->Evaluate() ? 1 : 0;
@@ -578,7 +2334,7 @@ void LessNode::PrintTree(int indent) const {
     if (right) right->PrintTree(indent + 1);
 }
 
-LessEqualNode::LessEqualNode(ExpressionNode* left, ExpressionNode* right) : BinaryOperatorNode(left, right) {}
+LessEqualNode::LessEqualNode(ExpressionNode* left, ExpressionNode* right) : RelationalOperatorNode(left, right) {}
 
 int LessEqualNode::Evaluate() const {
     return left->Evaluate() <= right->Evaluate() ? 1 : 0;
@@ -598,7 +2354,7 @@ void LessEqualNode::PrintTree(int indent) const {
     if (right) right->PrintTree(indent + 1);
 }
 
-GreaterNode::GreaterNode(ExpressionNode* left, ExpressionNode* right) : BinaryOperatorNode(left, right) {}
+GreaterNode::GreaterNode(ExpressionNode* left, ExpressionNode* right) : RelationalOperatorNode(left, right) {}
 
 int GreaterNode::Evaluate() const {
     return left->Evaluate() > right->Evaluate() ? 1 : 0;
@@ -618,7 +2374,7 @@ void GreaterNode::PrintTree(int indent) const {
     if (right) right->PrintTree(indent + 1);
 }
 
-GreaterEqualNode::GreaterEqualNode(ExpressionNode* left, ExpressionNode* right) : BinaryOperatorNode(left, right) {}
+GreaterEqualNode::GreaterEqualNode(ExpressionNode* left, ExpressionNode* right) : RelationalOperatorNode(left, right) {}
 
 int GreaterEqualNode::Evaluate() const {
     return left->Evaluate() >= right->Evaluate() ? 1 : 0;
@@ -638,7 +2394,7 @@ void GreaterEqualNode::PrintTree(int indent) const {
     if (right) right->PrintTree(indent + 1);
 }
 
-EqualNode::EqualNode(ExpressionNode* left, ExpressionNode* right) : BinaryOperatorNode(left, right) {}
+EqualNode::EqualNode(ExpressionNode* left, ExpressionNode* right) : RelationalOperatorNode(left, right) {}
 
 int EqualNode::Evaluate() const {
     return left->Evaluate() == right->Evaluate() ? 1 : 0;
@@ -658,7 +2414,7 @@ void EqualNode::PrintTree(int indent) const {
     if (right) right->PrintTree(indent + 1);
 }
 
-NotEqualNode::NotEqualNode(ExpressionNode* left, ExpressionNode* right) : BinaryOperatorNode(left, right) {}
+NotEqualNode::NotEqualNode(ExpressionNode* left, ExpressionNode* right) : RelationalOperatorNode(left, right) {}
 
 int NotEqualNode::Evaluate() const {
     return left->Evaluate() != right->Evaluate() ? 1 : 0;
@@ -691,6 +2447,11 @@ int ModNode::Evaluate() const {
 void ModNode::CodeEvaluate(InstructionsClass &machineCode)
 {
     left ->CodeEvaluate(machineCode);
+    IntegerNode* constant = dynamic_cast<IntegerNode*>(right);
+    if (constant) {
+        machineCode.PopModConstantPush(constant->Evaluate());
+        return;
+    }
     right->CodeEvaluate(machineCode);
     machineCode.PopPopModPush();
 }
@@ -705,12 +2466,70 @@ void ModNode::PrintTree(int indent) const {
 
 AndNode::AndNode(ExpressionNode* left, ExpressionNode* right) : BinaryOperatorNode(left, right) {}
 
+// && and || only run their right side when the left side does not
+// already decide the result.
 void AndNode::CodeEvaluate(InstructionsClass &machineCode)
 {
-    left ->CodeEvaluate(machineCode);
-    right->CodeEvaluate(machineCode);
-    machineCode.PopPopAndPush();
+    JumpList falseJumps;
+    CodeJumpIfFalse(machineCode, falseJumps);
+    machineCode.PushValue(1);
+    int jumpOverFalse = machineCode.Jump();
+    int falseStart = machineCode.GetAddress();
+    machineCode.SetOffsets(falseJumps, falseStart);
+    machineCode.PushValue(0);
+    machineCode.SetOffset(jumpOverFalse,
+                         static_cast<int>(machineCode.GetAddress() - falseStart));
+}
+
+// Each side is coded on its own into the same register.
+int AndNode::RegisterNeed() const
+{
+    int leftNeed = left->RegisterNeed();
+    int rightNeed = right->RegisterNeed();
+    return leftNeed > rightNeed ? leftNeed : rightNeed;
+}
+
+void AndNode::CodeRegister(InstructionsClass &machineCode)
+{
+    JumpList falseJumps;
+    CodeJumpIfFalse(machineCode, falseJumps);
+    machineCode.LoadValue(machineCode.TopRegister(), 1);
+    int jumpOverFalse = machineCode.Jump();
+    int falseStart = machineCode.GetAddress();
+    machineCode.SetOffsets(falseJumps, falseStart);
+    machineCode.LoadValue(machineCode.TopRegister(), 0);
+    machineCode.SetOffset(jumpOverFalse,
+                         static_cast<int>(machineCode.GetAddress() - falseStart));
+}
+
+void AndNode::CodeJumpIfFalse(InstructionsClass &machineCode, JumpList &falseJumps)
+{
+    left->CodeJumpIfFalse(machineCode, falseJumps);
+    right->CodeJumpIfFalse(machineCode, falseJumps);
+}
+
+void AndNode::CodeJumpIfTrue(InstructionsClass &machineCode, JumpList &trueJumps)
+{
+    JumpList falseJumps;
+    left->CodeJumpIfFalse(machineCode, falseJumps);
+    right->CodeJumpIfTrue(machineCode, trueJumps);
+    machineCode.SetOffsets(falseJumps, machineCode.GetAddress());
+}
+
+IRInstruction* AndNode::BuildIR(IRBuilderClass &builder)
+{
+    return BuildTruthValue(this, builder);
+}
+
+void AndNode::BuildBranch(IRBuilderClass &builder, IRBlock* whenTrue, IRBlock* whenFalse)
+{
+    IRBlock* rightBlock = builder.GetFunction()->NewBlock();
+    left->BuildBranch(builder, rightBlock, whenFalse);
+    builder.SealBlock(rightBlock);
+    builder.SetBlock(rightBlock);
+    right->BuildBranch(builder, whenTrue, whenFalse);
 }
+
 int AndNode::Evaluate() const
 {
     return left->Evaluate() && right->Evaluate() ? 1 : 0;
@@ -731,9 +2550,63 @@ int OrNode::Evaluate() const {
 
 void OrNode::CodeEvaluate(InstructionsClass &machineCode)
 {
-    left ->CodeEvaluate(machineCode);
-    right->CodeEvaluate(machineCode);
-    machineCode.PopPopOrPush();
+    JumpList trueJumps;
+    CodeJumpIfTrue(machineCode, trueJumps);
+    machineCode.PushValue(0);
+    int jumpOverTrue = machineCode.Jump();
+    int trueStart = machineCode.GetAddress();
+    machineCode.SetOffsets(trueJumps, trueStart);
+    machineCode.PushValue(1);
+    machineCode.SetOffset(jumpOverTrue,
+                         static_cast<int>(machineCode.GetAddress() - trueStart));
+}
+
+int OrNode::RegisterNeed() const
+{
+    int leftNeed = left->RegisterNeed();
+    int rightNeed = right->RegisterNeed();
+    return leftNeed > rightNeed ? leftNeed : rightNeed;
+}
+
+void OrNode::CodeRegister(InstructionsClass &machineCode)
+{
+    JumpList trueJumps;
+    CodeJumpIfTrue(machineCode, trueJumps);
+    machineCode.LoadValue(machineCode.TopRegister(), 0);
+    int jumpOverTrue = machineCode.Jump();
+    int trueStart = machineCode.GetAddress();
+    machineCode.SetOffsets(trueJumps, trueStart);
+    machineCode.LoadValue(machineCode.TopRegister(), 1);
+    machineCode.SetOffset(jumpOverTrue,
+                         static_cast<int>(machineCode.GetAddress() - trueStart));
+}
+
+void OrNode::CodeJumpIfFalse(InstructionsClass &machineCode, JumpList &falseJumps)
+{
+    JumpList trueJumps;
+    left->CodeJumpIfTrue(machineCode, trueJumps);
+    right->CodeJumpIfFalse(machineCode, falseJumps);
+    machineCode.SetOffsets(trueJumps, machineCode.GetAddress());
+}
+
+void OrNode::CodeJumpIfTrue(InstructionsClass &machineCode, JumpList &trueJumps)
+{
+    left->CodeJumpIfTrue(machineCode, trueJumps);
+    right->CodeJumpIfTrue(machineCode, trueJumps);
+}
+
+IRInstruction* OrNode::BuildIR(IRBuilderClass &builder)
+{
+    return BuildTruthValue(this, builder);
+}
+
+void OrNode::BuildBranch(IRBuilderClass &builder, IRBlock* whenTrue, IRBlock* whenFalse)
+{
+    IRBlock* rightBlock = builder.GetFunction()->NewBlock();
+    left->BuildBranch(builder, whenTrue, rightBlock);
+    builder.SealBlock(rightBlock);
+    builder.SetBlock(rightBlock);
+    right->BuildBranch(builder, whenTrue, whenFalse);
 }
 
 void OrNode::PrintTree(int indent) const {
@@ -748,12 +2621,56 @@ void NullStatementNode::Code(InstructionsClass &machineCode)
 }
 
 
+UpdateStatementNode::UpdateStatementNode(IdentifierNode* identifier, ExpressionNode* expression, int sign)
+  : StoreStatementNode(identifier, expression), sign(sign) {}
+
+void UpdateStatementNode::Propagate(KnownValues &known, OptimizerClass &optimizer)
+{
+    PropagateChild(expression, known, optimizer);
+    int amount = 1;
+    bool amountKnown = !expression || IsConstant(expression, amount);
+    AddKnown(known, identifier->GetLabel(), amountKnown,
+             amountKnown ? (int)((unsigned int)sign * (unsigned int)amount) : 0);
+}
+
+// Without a value to read, v stays live if it was; if not, the
+// statement goes.
+void UpdateStatementNode::Liveness(LiveVariables &live) const
+{
+    if (expression && StoreIsLive(identifier, expression, live)) {
+        live.insert(identifier->GetLabel());
+        expression->AddReads(live);
+    }
+}
+
+StatementNode* UpdateStatementNode::EliminateDeadCode(LiveVariables &live, OptimizerClass &optimizer)
+{
+    if (!StoreIsLive(identifier, expression, live)) {
+        optimizer.CountDeadStore();
+        return new NullStatementNode();
+    }
+    Liveness(live);
+    return this;
+}
+
+int UpdateStatementNode::CountingStep(std::string &label) const
+{
+    int value = 1;
+    if (expression && (!IsConstant(expression, value) || value != 1)) {
+        return 0;
+    }
+    label = identifier->GetLabel();
+    return sign;
+}
+
 PlusEqualsStatementNode::PlusEqualsStatementNode(IdentifierNode* id, ExpressionNode* expr)
-  : identifier(id), expression(expr) {}
+  : UpdateStatementNode(id, expr, 1) {}
 
-PlusEqualsStatementNode::~PlusEqualsStatementNode() {
-    delete identifier;
-    delete expression;
+void PlusEqualsStatementNode::BuildIR(IRBuilderClass &builder)
+{
+    int index = identifier->GetIndex();
+    IRInstruction* old = builder.ReadVariable(index);
+    builder.WriteVariable(index, builder.Binary(PLUS_TOKEN, old, expression->BuildIR(builder)));
 }
 
 void PlusEqualsStatementNode::PrintTree(int indent) const
@@ -775,6 +2692,15 @@ void PlusEqualsStatementNode::Interpret() const {
 }
 
 void PlusEqualsStatementNode::Code(InstructionsClass &machineCode) {
+    if (machineCode.UseRegisters()) {
+        int index = identifier->GetIndex();
+        RegisterType reg = machineCode.VariableRegister(index, EAX_REGISTER);
+        expression->CodeRegister(machineCode);
+        machineCode.LoadVariable(reg, index);
+        machineCode.OperateRegisters(PLUS_TOKEN, reg, machineCode.TopRegister());
+        machineCode.StoreVariable(index, reg);
+        return;
+    }
     machineCode.PushVariable(identifier->GetIndex());
     expression->CodeEvaluate(machineCode);
     machineCode.PopPopAddPush();
@@ -782,13 +2708,15 @@ void PlusEqualsStatementNode::Code(InstructionsClass &machineCode) {
 }
 
 MinusEqualsStatementNode::MinusEqualsStatementNode(IdentifierNode* id, ExpressionNode* expr)
-  : identifier(id), expression(expr) {}
-
-MinusEqualsStatementNode::~MinusEqualsStatementNode() {
-    delete identifier;
-    delete expression;
+  : UpdateStatementNode(id, expr, -1) {}
 
+void MinusEqualsStatementNode::BuildIR(IRBuilderClass &builder)
+{
+    int index = identifier->GetIndex();
+    IRInstruction* old = builder.ReadVariable(index);
+    builder.WriteVariable(index, builder.Binary(MINUS_TOKEN, old, expression->BuildIR(builder)));
 }
+
 void MinusEqualsStatementNode::PrintTree(int indent) const
 {
     for (int i = 0; i < indent; i++) std::cout << "  ";
@@ -806,6 +2734,15 @@ void MinusEqualsStatementNode::Interpret() const {
     identifier->SetValue(old - right);
 }
 void MinusEqualsStatementNode::Code(InstructionsClass &machineCode) {
+    if (machineCode.UseRegisters()) {
+        int index = identifier->GetIndex();
+        RegisterType reg = machineCode.VariableRegister(index, EAX_REGISTER);
+        expression->CodeRegister(machineCode);
+        machineCode.LoadVariable(reg, index);
+        machineCode.OperateRegisters(MINUS_TOKEN, reg, machineCode.TopRegister());
+        machineCode.StoreVariable(index, reg);
+        return;
+    }
     machineCode.PushVariable(identifier->GetIndex());
     expression->CodeEvaluate(machineCode);
     machineCode.PopPopSubPush();
@@ -816,7 +2753,8 @@ ForStatementNode::ForStatementNode(StatementNode* init,
     ExpressionNode* cond,
     StatementNode* step,
     StatementNode* body)
-: initStmt(init), condition(cond), stepStmt(step), body(body) {}
+: initStmt(init), condition(cond), stepStmt(step), body(body), unroll(0),
+  counterDead(false) {}
 
 ForStatementNode::~ForStatementNode() {
 delete initStmt;
@@ -827,38 +2765,317 @@ delete body;
 
 void ForStatementNode::Interpret() const {
     if (initStmt) initStmt->Interpret();
+    for (InvariantNode* invariant : invariants) {
+        invariant->InterpretPreheader();
+    }
+    for (InductionNode* induction : inductions) {
+        induction->InterpretPreheader();
+    }
     while (!condition || condition->Evaluate()) {
         body->Interpret();
         if (stepStmt) stepStmt->Interpret();
+        for (InductionNode* induction : inductions) {
+            induction->InterpretStep();
+        }
+    }
+}
+
+// When nothing but the loop reads its counter, i < n with i++ runs
+// n - i times: tests once, then counts that down in a hidden slot with
+// sub and jnz at the bottom, leaving the counter alone. Returns the
+// slot, or -1 when the loop does not qualify; a slot of 0 trips has
+// already jumped to exitJumps.
+int ForStatementNode::CodeCountDown(InstructionsClass &machineCode, JumpList &exitJumps)
+{
+    std::string label;
+    int direction = stepStmt ? stepStmt->CountingStep(label) : 0;
+    BinaryOperatorNode* test = dynamic_cast<BinaryOperatorNode*>(condition);
+    if (!counterDead || !direction || !test) {
+        return -1;
+    }
+    const IdentifierNode* counter = dynamic_cast<const IdentifierNode*>(test->GetLeft());
+    if (!counter || counter->GetLabel() != label) {
+        return -1;
+    }
+    // An inclusive bound at the end of the range never ends the loop.
+    int bound;
+    bool constant = IsConstant(test->GetRight(), bound);
+    bool inclusive = false;
+    switch (test->GetOperator()) {
+    case LESSEQUAL_TOKEN:
+        if (!constant || bound == INT_MAX) return -1;
+        inclusive = true;
+        // fall through
+    case LESS_TOKEN:
+        if (direction != 1) return -1;
+        break;
+    case GREATEREQUAL_TOKEN:
+        if (!constant || bound == INT_MIN) return -1;
+        inclusive = true;
+        // fall through
+    case GREATER_TOKEN:
+        if (direction != -1) return -1;
+        break;
+    default:
+        return -1;
+    }
+    VariableNames written;
+    VariableNames boundReads;
+    body->AddWrites(written);
+    stepStmt->AddWrites(written);
+    test->GetRight()->AddReads(boundReads);
+    for (const std::string &read : boundReads) {
+        if (written.count(read)) {
+            return -1;
+        }
+    }
+    VariableUses bodyUses;
+    body->CountVariableUses(bodyUses);
+    int index = counter->GetIndex();
+    if (bodyUses.count(index)) {
+        return -1;
+    }
+
+    condition->CodeJumpIfFalse(machineCode, exitJumps);
+    int slot = machineCode.AllocateSlot();
+    test->GetRight()->CodeAndStore(machineCode, slot);
+    // up: bound - i, down: i - bound
+    int from = direction == 1 ? slot : index;
+    int to = direction == 1 ? index : slot;
+    if (machineCode.UseRegisters()) {
+        machineCode.LoadVariable(EAX_REGISTER, from);
+        machineCode.LoadVariable(ECX_REGISTER, to);
+        machineCode.OperateRegisters(MINUS_TOKEN, EAX_REGISTER, ECX_REGISTER);
+        if (inclusive) {
+            machineCode.OperateValue(PLUS_TOKEN, EAX_REGISTER, 1);
+        }
+        machineCode.StoreVariable(slot, EAX_REGISTER);
+    } else {
+        machineCode.PushVariable(from);
+        machineCode.PushVariable(to);
+        machineCode.PopPopSubPush();
+        if (inclusive) {
+            machineCode.PushValue(1);
+            machineCode.PopPopAddPush();
+        }
+        machineCode.PopAndStore(slot);
     }
+    return slot;
 }
 
 void ForStatementNode::Code(InstructionsClass& machineCode) {
     if (initStmt) initStmt->Code(machineCode);
+    for (InvariantNode* invariant : invariants) {
+        invariant->CodePreheader(machineCode);
+    }
+    for (InductionNode* induction : inductions) {
+        induction->CodePreheader(machineCode);
+    }
+
+    JumpList exitJumps;
+    int count;
+    bool unrolled = unroll && TripCount(initStmt, condition, stepStmt, body, count);
+    int countDown = unrolled ? -1 : CodeCountDown(machineCode, exitJumps);
+
+    // The init statement has run, so it is only the loop proper that
+    // keeps variables in registers.
+    VariableUses uses;
+    if (countDown < 0) {
+        if (condition) condition->CountVariableUses(uses);
+        if (stepStmt)  stepStmt->CountVariableUses(uses);
+    } else {
+        uses[countDown] = INT_MAX;
+    }
+    body->CountVariableUses(uses);
+    for (InductionNode* induction : inductions) {
+        induction->CountVariableUses(uses);
+    }
+    LoopRegisters promoted = PromoteLoopVariables(machineCode, uses);
+
+    // With a fixed trip count, unrolled copies need no test at all.
+    if (unrolled) {
+        CodeUnrolled(machineCode, count, unroll, [this, &machineCode]() {
+            body->Code(machineCode);
+            stepStmt->Code(machineCode);
+            for (InductionNode* induction : inductions) {
+                induction->CodeStep(machineCode);
+            }
+        });
+        DemoteLoopVariables(machineCode, promoted);
+        return;
+    }
 
-    unsigned char* address1 = machineCode.GetAddress();
+    int address1 = machineCode.GetAddress();
+
+    if (countDown >= 0) {
+        body->Code(machineCode);
+        for (InductionNode* induction : inductions) {
+            induction->CodeStep(machineCode);
+        }
+        int again = machineCode.CountDownJump(countDown);
+        machineCode.SetOffset(again, address1 - machineCode.GetAddress());
+        DemoteLoopVariables(machineCode, promoted);
+        machineCode.SetOffsets(exitJumps, machineCode.GetAddress());
+        return;
+    }
 
     if (condition) {
-        condition->CodeEvaluate(machineCode);
+        condition->CodeJumpIfFalse(machineCode, exitJumps);
     }
-    unsigned char* insertSkip = condition
-    ? machineCode.SkipIfZeroStack()
-    : nullptr;
-    unsigned char* address2 = machineCode.GetAddress();
 
     body->Code(machineCode);
 
     if (stepStmt) stepStmt->Code(machineCode);
+    for (InductionNode* induction : inductions) {
+        induction->CodeStep(machineCode);
+    }
 
-    unsigned char* insertJump = machineCode.Jump();
-    unsigned char* address3    = machineCode.GetAddress();
+    int insertJump = machineCode.Jump();
+    int address3    = machineCode.GetAddress();
 
     machineCode.SetOffset(insertJump,
     static_cast<int>(address1 - address3));
+    machineCode.SetOffsets(exitJumps, address3);
+    DemoteLoopVariables(machineCode, promoted);
+}
+
+void ForStatementNode::GetChildren(ChildSlots &children)
+{
+    children.push_back(Child(initStmt));
+    children.push_back(Child(condition));
+    children.push_back(Child(stepStmt));
+    children.push_back(Child(body));
+}
+
+// A for loop whose condition is false from the start only initializes.
+StatementNode* ForStatementNode::Optimize(OptimizerClass &optimizer)
+{
+    StatementNode::Optimize(optimizer);
+    int value;
+    if (condition && IsConstant(condition, value) && !value) {
+        optimizer.CountPruned();
+        StatementNode* init = initStmt;
+        initStmt = nullptr;
+        return init ? init : new NullStatementNode();
+    }
+    int count;
+    if (TripCount(initStmt, condition, stepStmt, body, count)) {
+        unroll = optimizer.UnrollFactor(count, body->Size() + stepStmt->Size());
+    }
+    return this;
+}
+
+void ForStatementNode::Propagate(KnownValues &known, OptimizerClass &optimizer)
+{
+    if (initStmt) initStmt->Propagate(known, optimizer);
+    VariableNames written;
+    AddWrites(written);
+    LoopHeadKnown(known, written);
+    PropagateChild(condition, known, optimizer);
+    KnownValues bodyKnown = known;
+    body->Propagate(bodyKnown, optimizer);
+    if (stepStmt) stepStmt->Propagate(bodyKnown, optimizer);
+}
+
+void ForStatementNode::BuildIR(IRBuilderClass &builder)
+{
+    if (initStmt) initStmt->BuildIR(builder);
+    IRFunctionClass* function = builder.GetFunction();
+    IRBlock* head = function->NewBlock();
+    IRBlock* bodyBlock = function->NewBlock();
+    IRBlock* after = function->NewBlock();
+    for (InvariantNode* invariant : invariants) {
+        invariant->BuildPreheaderIR(builder);
+    }
+    builder.Jump(head);
+
+    builder.SetBlock(head);
     if (condition) {
-    machineCode.SetOffset(insertSkip,
-    static_cast<int>(address3 - address2));
+        condition->BuildBranch(builder, bodyBlock, after);
+    } else {
+        builder.Jump(bodyBlock);
+    }
+    builder.SealBlock(bodyBlock);
+    builder.SetBlock(bodyBlock);
+    body->BuildIR(builder);
+    if (stepStmt) stepStmt->BuildIR(builder);
+    builder.Jump(head);
+    builder.SealBlock(head);
+
+    builder.SealBlock(after);
+    builder.SetBlock(after);
+}
+
+void ForStatementNode::Liveness(LiveVariables &live) const
+{
+    if (condition) condition->AddReads(live);
+    live = LoopHeadLiveness(live, [this](LiveVariables &through) {
+        if (stepStmt) stepStmt->Liveness(through);
+        body->Liveness(through);
+    });
+    if (initStmt) initStmt->Liveness(live);
+}
+
+// A dead counting loop leaves only its init statement behind.
+StatementNode* ForStatementNode::EliminateDeadCode(LiveVariables &live, OptimizerClass &optimizer)
+{
+    LiveVariables after = live;
+    if (condition) condition->AddReads(live);
+    live = LoopHeadLiveness(live, [this](LiveVariables &through) {
+        if (stepStmt) stepStmt->Liveness(through);
+        body->Liveness(through);
+    });
+    LiveVariables bodyLive = live;
+    EliminateChild(stepStmt, bodyLive, optimizer);
+    EliminateChild(body, bodyLive, optimizer);
+
+    StatementNode* step = nullptr;
+    if (body->IsEmpty()) {
+        step = stepStmt;
+    } else if (!stepStmt || stepStmt->IsEmpty()) {
+        step = body;
+    }
+    if (condition && IsDeadCountingLoop(condition, step, after)) {
+        optimizer.CountDeadCode();
+        live.swap(after);
+        StatementNode* init = initStmt;
+        initStmt = nullptr;
+        EliminateChild(init, live, optimizer);
+        return init ? init : new NullStatementNode();
+    }
+    std::string label;
+    if (stepStmt && stepStmt->CountingStep(label)) {
+        counterDead = !after.count(label);
+    }
+    EliminateChild(initStmt, live, optimizer);
+    return this;
+}
+
+// The init statement runs once, before the loop's invariants.
+void ForStatementNode::HoistInvariants(LoopNest &loops, OptimizerClass &optimizer)
+{
+    if (initStmt) initStmt->HoistInvariants(loops, optimizer);
+    LoopHoist loop = LoopWrites(body, stepStmt, &invariants);
+    VariableNames bodyWrites;
+    body->AddWrites(bodyWrites);
+    loop.step = stepStmt ? stepStmt->CountingStep(loop.counter) : 0;
+    if (loop.step && !bodyWrites.count(loop.counter)) {
+        loop.inductions = &inductions;
     }
+    loops.push_back(loop);
+    HoistChild(condition, loops, optimizer);
+    body->HoistInvariants(loops, optimizer);
+    if (stepStmt) stepStmt->HoistInvariants(loops, optimizer);
+    loops.pop_back();
+}
+
+int ForStatementNode::Size() const
+{
+    int count;
+    int copies = TripCount(initStmt, condition, stepStmt, body, count)
+        ? UnrolledCopies(count, unroll) : 1;
+    return 1 + (initStmt ? initStmt->Size() : 0) + (condition ? condition->Size() : 0)
+        + ((stepStmt ? stepStmt->Size() : 0) + body->Size()) * copies;
 }
 
 void ForStatementNode::PrintTree(int indent) const {
@@ -871,11 +3088,7 @@ void ForStatementNode::PrintTree(int indent) const {
 }
 
 PlusPlusStatementNode::PlusPlusStatementNode(IdentifierNode *id)
-  : identifier(id) {}
-
-PlusPlusStatementNode::~PlusPlusStatementNode() {
-    delete identifier;
-}
+  : UpdateStatementNode(id, nullptr, 1) {}
 
 void PlusPlusStatementNode::PrintTree(int indent) const
 {
@@ -892,19 +3105,30 @@ void PlusPlusStatementNode::Interpret() const {
 }
 
 void PlusPlusStatementNode::Code(InstructionsClass &machineCode) {
+    if (machineCode.UseRegisters()) {
+        int index = identifier->GetIndex();
+        RegisterType reg = machineCode.VariableRegister(index, EAX_REGISTER);
+        machineCode.LoadVariable(reg, index);
+        machineCode.OperateValue(PLUS_TOKEN, reg, 1);
+        machineCode.StoreVariable(index, reg);
+        return;
+    }
     machineCode.PushVariable(identifier->GetIndex());
     machineCode.PushValue(1);
     machineCode.PopPopAddPush();
     machineCode.PopAndStore(identifier->GetIndex());
 }
 
-MinusMinusStatementNode::MinusMinusStatementNode(IdentifierNode *id)
-  : identifier(id) {}
-
-MinusMinusStatementNode::~MinusMinusStatementNode() {
-    delete identifier;
+void PlusPlusStatementNode::BuildIR(IRBuilderClass &builder)
+{
+    int index = identifier->GetIndex();
+    IRInstruction* one = builder.GetFunction()->Constant(1);
+    builder.WriteVariable(index, builder.Binary(PLUS_TOKEN, builder.ReadVariable(index), one));
 }
 
+MinusMinusStatementNode::MinusMinusStatementNode(IdentifierNode *id)
+  : UpdateStatementNode(id, nullptr, -1) {}
+
 void MinusMinusStatementNode::PrintTree(int indent) const
 {
     for (int i = 0; i < indent; i++) std::cout << "  ";
@@ -920,22 +3144,65 @@ void MinusMinusStatementNode::Interpret() const {
 }
 
 void MinusMinusStatementNode::Code(InstructionsClass &machineCode) {
+    if (machineCode.UseRegisters()) {
+        int index = identifier->GetIndex();
+        RegisterType reg = machineCode.VariableRegister(index, EAX_REGISTER);
+        machineCode.LoadVariable(reg, index);
+        machineCode.OperateValue(MINUS_TOKEN, reg, 1);
+        machineCode.StoreVariable(index, reg);
+        return;
+    }
     machineCode.PushVariable(identifier->GetIndex());
     machineCode.PushValue(1);
     machineCode.PopPopSubPush();
     machineCode.PopAndStore(identifier->GetIndex());
 }
 
+void MinusMinusStatementNode::BuildIR(IRBuilderClass &builder)
+{
+    int index = identifier->GetIndex();
+    IRInstruction* one = builder.GetFunction()->Constant(1);
+    builder.WriteVariable(index, builder.Binary(MINUS_TOKEN, builder.ReadVariable(index), one));
+}
+
 ExponentNode::ExponentNode(ExpressionNode *left, ExpressionNode *right): BinaryOperatorNode(left, right) {}
 
 void ExponentNode::CodeEvaluate(InstructionsClass &mc) {
-    int result = this->Evaluate();
-    mc.PushValue(result);
+    left->CodeEvaluate(mc);
+    IntegerNode* constant = dynamic_cast<IntegerNode*>(right);
+    if (constant) {
+        mc.PopExponentConstantPush(constant->Evaluate());
+    } else {
+        right->CodeEvaluate(mc);
+        mc.PopPopExponentPush();
+    }
+}
+
+// Integer power by repeated squaring, matching PopPopExponentPush.
+// Works in unsigned so that overflow wraps like the machine code does.
+int IntegerPower(int base, int exponent)
+{
+    if (exponent < 0) {
+        if (base == 1 || base == -1 || base == 0) {
+            exponent = -(unsigned int)exponent;
+        } else {
+            return 0;
+        }
+    }
+    unsigned int result = 1;
+    unsigned int square = (unsigned int)base;
+    unsigned int bits = (unsigned int)exponent;
+    while (bits) {
+        if (bits & 1) result *= square;
+        square *= square;
+        bits >>= 1;
+    }
+    return (int)result;
 }
 
 int ExponentNode::Evaluate() const
 {
-    return pow(left->Evaluate(), right->Evaluate());
+    return IntegerPower(left->Evaluate(), right->Evaluate());
 }
 
 void ExponentNode::PrintTree(int indent) const {
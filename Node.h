@@ -1,9 +1,13 @@
 #pragma once
 #include <vector>
+#include <map>
 #include <string>
+#include <set>
 #include <iostream>
 #include "Instructions.h"
 #include "Symbol.h"
+#include "Optimizer.h"
+#include "IR.h"
 class Node;
 class StartNode;
 class ProgramNode;
@@ -28,12 +32,63 @@ class GreaterEqualNode;
 class EqualNode;
 class NotEqualNode;
 
+// How many times each variable, by symbol table index, is used.
+typedef std::map<int, int> VariableUses;
+// Variables by name. Dead code elimination and hoisting run before the
+// symbol table has any indexes.
+typedef std::set<std::string> VariableNames;
+// Those whose values may still be read.
+typedef VariableNames LiveVariables;
+
+class InvariantNode;
+class InductionNode;
+// A loop's invariant expressions, worked out once before it starts.
+typedef std::vector<InvariantNode*> Invariants;
+// Expressions a loop keeps up to date as its counter steps.
+typedef std::vector<InductionNode*> Inductions;
+// What hoisting needs to know about a loop: the variables it writes,
+// and where its invariants go. A loop whose counter only its step
+// writes also names the counter, the step, and where its induction
+// expressions go; otherwise inductions is null.
+struct LoopHoist {
+    VariableNames written;
+    Invariants* invariants;
+    std::string counter;
+    int step;
+    Inductions* inductions;
+};
+typedef std::vector<LoopHoist> LoopNest; // outermost first
+
+// What propagation knows a variable holds at some point: a constant, or
+// whatever another variable holds.
+struct KnownValue {
+    bool isConstant;
+    int value;
+    std::string copy;
+    bool operator==(const KnownValue &other) const {
+        return isConstant == other.isConstant && value == other.value && copy == other.copy;
+    }
+};
+typedef std::map<std::string, KnownValue> KnownValues;
+
+// One of a statement's children, as the pointer that holds it, so that a
+// pass can put something else in its place. Only one of the three is
+// set, and what it points to may be null, like an if with no else.
+struct ChildSlot {
+    StatementNode** statement;
+    ExpressionNode** expression;
+    StatementGroupNode* group;
+};
+typedef std::vector<ChildSlot> ChildSlots;
+
 class Node {
     public:
         virtual ~Node() {};
         virtual void PrintTree(int indent = 0) const = 0;
         virtual void Interpret() const = 0;
         virtual void Code(InstructionsClass &machineCode) = 0;
+        // Used to pick the variables a loop keeps in registers.
+        virtual void CountVariableUses(VariableUses &uses) const {};
 };
 
 class StartNode : public Node {
@@ -43,6 +98,11 @@ class StartNode : public Node {
         virtual void PrintTree(int indent = 0) const override;
         virtual void Interpret() const override;
         virtual void Code(InstructionsClass &machineCode) override;
+        void Optimize(OptimizerClass &optimizer);
+        void Propagate(OptimizerClass &optimizer);
+        void BuildIR(IRBuilderClass &builder);
+        void EliminateDeadCode(OptimizerClass &optimizer);
+        void HoistInvariants(OptimizerClass &optimizer);
     private:
         ProgramNode* program;
 };
@@ -54,6 +114,11 @@ class ProgramNode : public Node {
         virtual void PrintTree(int indent = 0) const override;
         virtual void Interpret() const override;
         virtual void Code(InstructionsClass &machineCode) override;
+        void Optimize(OptimizerClass &optimizer);
+        void Propagate(KnownValues &known, OptimizerClass &optimizer);
+        void BuildIR(IRBuilderClass &builder);
+        void EliminateDeadCode(LiveVariables &live, OptimizerClass &optimizer);
+        void HoistInvariants(LoopNest &loops, OptimizerClass &optimizer);
 
     private:
         BlockNode* block;
@@ -66,6 +131,18 @@ class StatementGroupNode : public Node {
         virtual void PrintTree(int indent = 0) const override;
         virtual void Interpret() const override;
         virtual void Code(InstructionsClass &machineCode) override;
+        virtual void CountVariableUses(VariableUses &uses) const override;
+        void Optimize(OptimizerClass &optimizer);
+        void Propagate(KnownValues &known, OptimizerClass &optimizer);
+        void BuildIR(IRBuilderClass &builder);
+        void Liveness(LiveVariables &live) const;
+        void EliminateDeadCode(LiveVariables &live, OptimizerClass &optimizer);
+        bool IsEmpty() const;
+        int CountingStep(std::string &label) const;
+        int TrailingStep(std::string &label) const;
+        void HoistInvariants(LoopNest &loops, OptimizerClass &optimizer);
+        void AddWrites(VariableNames &written) const;
+        int Size() const;
 
     private:
         std::vector<StatementNode*> statements;
@@ -75,6 +152,57 @@ class StatementGroupNode : public Node {
 class StatementNode : public Node {
     public:
         virtual ~StatementNode() {};
+        // The children, in order. Unless a statement overrides them, the
+        // passes below just go through these: forwards for Optimize,
+        // Propagate and HoistInvariants, backwards for Liveness and
+        // EliminateDeadCode, where expressions only add their reads.
+        virtual void GetChildren(ChildSlots &children) {}
+        virtual void CountVariableUses(VariableUses &uses) const override;
+        // Optimizes the children, then returns what should stand in for
+        // this statement. The caller deletes this if it is replaced, so
+        // anything reused must be detached from it first.
+        virtual StatementNode* Optimize(OptimizerClass &optimizer);
+        // Adds the statement to the builder's current block, leaving the
+        // builder in the block that follows it.
+        virtual void BuildIR(IRBuilderClass &builder) {}
+
+        // Liveness runs backwards: live holds the variables that may be
+        // read after the statement, and becomes those that may be read
+        // before it. A store nobody reads is left out, operands and all,
+        // so chains of dead stores go in one pass. EliminateDeadCode does
+        // the same, removing those stores; it returns like Optimize.
+        virtual void Liveness(LiveVariables &live) const;
+        virtual StatementNode* EliminateDeadCode(LiveVariables &live, OptimizerClass &optimizer);
+        virtual bool IsEmpty() const { return false; }
+        // 1 for v++ or v += 1, -1 for v-- or v -= 1, setting label to v;
+        // else 0.
+        virtual int CountingStep(std::string &label) const { return 0; }
+        // The same for a body that counts at its very end: the step of its
+        // last statement, when nothing before that writes the variable.
+        virtual int TrailingStep(std::string &label) const { return CountingStep(label); }
+
+        // Propagation runs forwards: known holds what is known about the
+        // variables before the statement, and becomes what is known after
+        // it. Reads of variables known to hold a constant or a copy of
+        // another variable are replaced along the way.
+        virtual void Propagate(KnownValues &known, OptimizerClass &optimizer);
+
+        // Moves invariant subexpressions out of the loops in loops; a loop
+        // adds itself for its own statements.
+        virtual void HoistInvariants(LoopNest &loops, OptimizerClass &optimizer);
+        virtual void AddWrites(VariableNames &written) const;
+        // True for v = constant, setting label to v and value to the
+        // constant.
+        virtual bool ConstantStore(std::string &label, int &value) const { return false; }
+        // Roughly how much code the statement makes, in nodes, for the
+        // unrolling budget.
+        virtual int Size() const;
+
+    protected:
+        ChildSlots Children() const;
+        static ChildSlot Child(StatementNode* &statement) { return ChildSlot{&statement, nullptr, nullptr}; }
+        static ChildSlot Child(ExpressionNode* &expression) { return ChildSlot{nullptr, &expression, nullptr}; }
+        static ChildSlot Child(StatementGroupNode* group) { return ChildSlot{nullptr, nullptr, group}; }
 };
 
 class BlockNode : public StatementNode {
@@ -84,33 +212,55 @@ class BlockNode : public StatementNode {
         virtual void PrintTree(int indent = 0) const override;
         virtual void Interpret() const override;
         virtual void Code(InstructionsClass &machineCode) override;
+        virtual void GetChildren(ChildSlots &children) override;
+        virtual void BuildIR(IRBuilderClass &builder) override;
+        virtual bool IsEmpty() const override;
+        virtual int CountingStep(std::string &label) const override;
+        virtual int TrailingStep(std::string &label) const override;
+        virtual int Size() const override;
 
     private:
         StatementGroupNode* statementGroup;
 };
 
-class DeclarationStatementNode : public StatementNode {
+// A statement that writes a variable, from expression: null for v++ and
+// v--, and for a declaration without a value.
+class StoreStatementNode : public StatementNode {
     public:
-        DeclarationStatementNode(IdentifierNode* identifier, ExpressionNode* expression);
-        ~DeclarationStatementNode();
-        void virtual PrintTree(int indent = 0) const override;
-        void virtual Interpret() const override;
-        void virtual Code(InstructionsClass &machineCode) override;
-    private:
+        StoreStatementNode(IdentifierNode* identifier, ExpressionNode* expression);
+        ~StoreStatementNode();
+        virtual void CountVariableUses(VariableUses &uses) const override;
+        virtual void AddWrites(VariableNames &written) const override;
+        virtual void GetChildren(ChildSlots &children) override;
+    protected:
         IdentifierNode* identifier;
         ExpressionNode* expression;
 };
 
-class AssignmentStatementNode : public StatementNode {
+class AssignmentStatementNode : public StoreStatementNode {
     public:
         AssignmentStatementNode(IdentifierNode* identifier, ExpressionNode* expression);
-        ~AssignmentStatementNode();
         void virtual PrintTree(int indent = 0) const override;
         void virtual Interpret() const override;
         virtual void Code(InstructionsClass &machineCode) override;
+        virtual void Propagate(KnownValues &known, OptimizerClass &optimizer) override;
+        virtual void BuildIR(IRBuilderClass &builder) override;
+        virtual void Liveness(LiveVariables &live) const override;
+        virtual StatementNode* EliminateDeadCode(LiveVariables &live, OptimizerClass &optimizer) override;
+        virtual bool ConstantStore(std::string &label, int &value) const override;
+};
+
+class DeclarationStatementNode : public AssignmentStatementNode {
+    public:
+        DeclarationStatementNode(IdentifierNode* identifier, ExpressionNode* expression);
+        void virtual PrintTree(int indent = 0) const override;
+        void virtual Interpret() const override;
+        void virtual Code(InstructionsClass &machineCode) override;
+        virtual void CountVariableUses(VariableUses &uses) const override;
+        virtual void BuildIR(IRBuilderClass &builder) override;
+        virtual StatementNode* EliminateDeadCode(LiveVariables &live, OptimizerClass &optimizer) override;
     private:
-        IdentifierNode* identifier;
-        ExpressionNode* expression;
+        bool declared; // by Code, which may run again in an unrolled loop
 };
 
 #include <vector>
@@ -123,6 +273,9 @@ class CoutStatementNode : public StatementNode {
         void virtual PrintTree(int indent = 0) const override;
         void virtual Interpret() const override;
         void virtual Code(InstructionsClass &machineCode) override;
+        virtual void GetChildren(ChildSlots &children) override;
+        virtual void BuildIR(IRBuilderClass &builder) override;
+        virtual int Size() const override;
     private:
         std::vector<ExpressionNode*> items;
 };
@@ -134,6 +287,12 @@ class IfStatementNode : public StatementNode {
         void virtual PrintTree(int indent = 0) const override;
         void virtual Interpret() const override;
         void virtual Code(InstructionsClass &machineCode) override;
+        virtual void GetChildren(ChildSlots &children) override;
+        virtual StatementNode* Optimize(OptimizerClass &optimizer) override;
+        virtual void Propagate(KnownValues &known, OptimizerClass &optimizer) override;
+        virtual void BuildIR(IRBuilderClass &builder) override;
+        virtual void Liveness(LiveVariables &live) const override;
+        virtual StatementNode* EliminateDeadCode(LiveVariables &live, OptimizerClass &optimizer) override;
     private:
         ExpressionNode* condition;
         StatementNode* thenStmt;
@@ -146,6 +305,11 @@ class ForStatementNode : public StatementNode {
         ExpressionNode* condition;
         StatementNode* stepStmt;
         StatementNode* body;
+        Invariants invariants;
+        Inductions inductions;
+        int unroll; // copies of the body and step per trip, 0 for none
+        bool counterDead; // nothing reads the counter after the loop
+        int CodeCountDown(InstructionsClass &machineCode, JumpList &exitJumps);
     public:
         ForStatementNode(StatementNode* init,
                          ExpressionNode* cond,
@@ -154,6 +318,14 @@ class ForStatementNode : public StatementNode {
         ~ForStatementNode() override;
         void Interpret() const override;
         void Code(InstructionsClass& machineCode) override;
+        void GetChildren(ChildSlots &children) override;
+        StatementNode* Optimize(OptimizerClass &optimizer) override;
+        void Propagate(KnownValues &known, OptimizerClass &optimizer) override;
+        void BuildIR(IRBuilderClass &builder) override;
+        void Liveness(LiveVariables &live) const override;
+        StatementNode* EliminateDeadCode(LiveVariables &live, OptimizerClass &optimizer) override;
+        void HoistInvariants(LoopNest &loops, OptimizerClass &optimizer) override;
+        int Size() const override;
         void PrintTree(int indent) const override;
     };
 
@@ -164,9 +336,18 @@ class WhileStatementNode : public StatementNode {
         void virtual PrintTree(int indent = 0) const override;
         void virtual Interpret() const override;
         void virtual Code(InstructionsClass &machineCode) override;
+        virtual void GetChildren(ChildSlots &children) override;
+        virtual StatementNode* Optimize(OptimizerClass &optimizer) override;
+        virtual void Propagate(KnownValues &known, OptimizerClass &optimizer) override;
+        virtual void BuildIR(IRBuilderClass &builder) override;
+        virtual void Liveness(LiveVariables &live) const override;
+        virtual StatementNode* EliminateDeadCode(LiveVariables &live, OptimizerClass &optimizer) override;
+        virtual void HoistInvariants(LoopNest &loops, OptimizerClass &optimizer) override;
     private:
         ExpressionNode* condition;
         StatementNode* body;
+        Invariants invariants;
+        Inductions inductions;
 };
 
 class DoWhileStatementNode : public StatementNode {
@@ -176,11 +357,19 @@ class DoWhileStatementNode : public StatementNode {
     
         virtual void Interpret() const override;
         virtual void Code(InstructionsClass &machineCode) override;
+        virtual void GetChildren(ChildSlots &children) override;
+        virtual StatementNode* Optimize(OptimizerClass &optimizer) override;
+        virtual void Propagate(KnownValues &known, OptimizerClass &optimizer) override;
+        virtual void BuildIR(IRBuilderClass &builder) override;
+        virtual void Liveness(LiveVariables &live) const override;
+        virtual StatementNode* EliminateDeadCode(LiveVariables &live, OptimizerClass &optimizer) override;
+        virtual void HoistInvariants(LoopNest &loops, OptimizerClass &optimizer) override;
         virtual void PrintTree(int indent = 0) const override;
     
     private:
         StatementNode* body;
         ExpressionNode* condition;
+        Invariants invariants;
     };
 
 class RepeatStatementNode : public StatementNode {
@@ -190,9 +379,19 @@ class RepeatStatementNode : public StatementNode {
         void virtual PrintTree(int indent = 0) const override;
         void virtual Interpret() const override;
         virtual void Code(InstructionsClass &machineCode) override;
+        virtual void GetChildren(ChildSlots &children) override;
+        virtual StatementNode* Optimize(OptimizerClass &optimizer) override;
+        virtual void Propagate(KnownValues &known, OptimizerClass &optimizer) override;
+        virtual void BuildIR(IRBuilderClass &builder) override;
+        virtual void Liveness(LiveVariables &live) const override;
+        virtual StatementNode* EliminateDeadCode(LiveVariables &live, OptimizerClass &optimizer) override;
+        virtual void HoistInvariants(LoopNest &loops, OptimizerClass &optimizer) override;
+        virtual int Size() const override;
     private:
         ExpressionNode* expression;
         StatementGroupNode* statementGroup;
+        Invariants invariants;
+        int unroll; // copies of the body per trip, 0 for none
 };
 
 class NullStatementNode : public StatementNode {
@@ -203,6 +402,7 @@ class NullStatementNode : public StatementNode {
             // Empty statement: do nothing.
         }
         virtual void Code(InstructionsClass &machineCode) override;
+        virtual bool IsEmpty() const override { return true; }
         virtual void PrintTree(int indent) const override {
             for (int i = 0; i < indent; i++) std::cout << "  ";
             std::cout << "NullStatement" << std::endl;
@@ -213,8 +413,42 @@ class ExpressionNode {
     public:
         virtual int Evaluate() const = 0;    
         virtual ~ExpressionNode();
+        // Like StatementNode::Optimize.
+        virtual ExpressionNode* Optimize(OptimizerClass &optimizer) { return this; }
+        // The SSA value of the expression. BuildBranch is the IR form of
+        // CodeJumpIfFalse: it ends the current block, going on to whenTrue
+        // or whenFalse.
+        virtual IRInstruction* BuildIR(IRBuilderClass &builder) = 0;
+        virtual void BuildBranch(IRBuilderClass &builder, IRBlock* whenTrue, IRBlock* whenFalse);
+        // For dead code elimination: the variables the expression reads,
+        // and whether it may divide by zero.
+        virtual void AddReads(VariableNames &reads) const {}
+        virtual bool MayTrap() const { return false; }
+        // Returns what stands in for the expression once known values are
+        // put in, like Optimize.
+        virtual ExpressionNode* Propagate(const KnownValues &known, OptimizerClass &optimizer) { return this; }
+        // Returns what stands in for the expression: itself, or an
+        // InvariantNode that now owns it. depth is how many of loops it
+        // may move out of.
+        virtual ExpressionNode* HoistInvariants(const LoopNest &loops, size_t depth,
+                                                OptimizerClass &optimizer) { return this; }
+        virtual int Size() const { return 1; }
         virtual void PrintTree(int indent = 0) const = 0;
         virtual void CodeEvaluate(InstructionsClass &machineCode) = 0;
+        // Code for using the expression as a condition: jump when it is
+        // zero (or non zero), adding the jumps to fill in to the list.
+        virtual void CodeJumpIfFalse(InstructionsClass &machineCode, JumpList &falseJumps);
+        virtual void CodeJumpIfTrue(InstructionsClass &machineCode, JumpList &trueJumps);
+
+        // Register mode. RegisterNeed is the Sethi-Ullman number: how many
+        // registers coding the expression takes without spilling.
+        // CodeRegister leaves the value in machineCode.TopRegister().
+        virtual int RegisterNeed() const;
+        virtual void CodeRegister(InstructionsClass &machineCode) = 0;
+        virtual void CountVariableUses(VariableUses &uses) const {};
+        // Code the expression and store or print its value, in either mode.
+        void CodeAndStore(InstructionsClass &machineCode, int index);
+        void CodeAndWrite(InstructionsClass &machineCode);
     };
 
     
@@ -225,8 +459,14 @@ class IdentifierNode : public ExpressionNode {
         void DeclareVariable() const;
         void SetValue(int v) const;
         int GetIndex() const;
+        const std::string& GetLabel() const;
         int Evaluate() const override;
         virtual void CodeEvaluate(InstructionsClass &machineCode) override;
+        virtual void CodeRegister(InstructionsClass &machineCode) override;
+        virtual void CountVariableUses(VariableUses &uses) const override;
+        virtual IRInstruction* BuildIR(IRBuilderClass &builder) override;
+        virtual void AddReads(VariableNames &reads) const override;
+        virtual ExpressionNode* Propagate(const KnownValues &known, OptimizerClass &optimizer) override;
         void virtual PrintTree(int indent = 0) const override;
     private:
         std::string label;
@@ -239,8 +479,60 @@ class IntegerNode : public ExpressionNode {
         IntegerNode(int value);
         int Evaluate() const override;
         virtual void CodeEvaluate(InstructionsClass &machineCode) override;
+        virtual void CodeRegister(InstructionsClass &machineCode) override;
+        virtual IRInstruction* BuildIR(IRBuilderClass &builder) override;
+        void virtual PrintTree(int indent = 0) const override;
+    private:
+        int value;
+};
+
+// An expression a loop works out once, before it starts, and from then
+// on only reads: from a hidden slot in machine code, or from value.
+class InvariantNode : public ExpressionNode {
+    public:
+        InvariantNode(ExpressionNode* expression);
+        ~InvariantNode();
+        // Work the expression out, before the loop.
+        void CodePreheader(InstructionsClass &machineCode);
+        void InterpretPreheader();
+        void BuildPreheaderIR(IRBuilderClass &builder);
+        int Evaluate() const override;
+        virtual void CodeEvaluate(InstructionsClass &machineCode) override;
+        virtual void CodeRegister(InstructionsClass &machineCode) override;
+        virtual void CountVariableUses(VariableUses &uses) const override;
+        virtual IRInstruction* BuildIR(IRBuilderClass &builder) override;
+        virtual void AddReads(VariableNames &reads) const override;
+        void virtual PrintTree(int indent = 0) const override;
+    private:
+        ExpressionNode* expression;
+        int slot;
+        int value;
+        IRInstruction* irValue;
+};
+
+// i * c, where a loop counts i up or down by one: the loop keeps its
+// value in a hidden slot, adding step * c each time i steps, instead of
+// multiplying on every trip.
+class InductionNode : public ExpressionNode {
+    public:
+        InductionNode(ExpressionNode* expression, int increment);
+        ~InductionNode();
+        // Work the expression out before the loop, and follow the step.
+        void CodePreheader(InstructionsClass &machineCode);
+        void CodeStep(InstructionsClass &machineCode);
+        void InterpretPreheader();
+        void InterpretStep();
+        int Evaluate() const override;
+        virtual void CodeEvaluate(InstructionsClass &machineCode) override;
+        virtual void CodeRegister(InstructionsClass &machineCode) override;
+        virtual void CountVariableUses(VariableUses &uses) const override;
+        virtual IRInstruction* BuildIR(IRBuilderClass &builder) override;
+        virtual void AddReads(VariableNames &reads) const override;
         void virtual PrintTree(int indent = 0) const override;
     private:
+        ExpressionNode* expression;
+        int increment;
+        int slot;
         int value;
 };
 
@@ -249,7 +541,27 @@ class BinaryOperatorNode : public ExpressionNode {
         BinaryOperatorNode(ExpressionNode* left, ExpressionNode* right);
         virtual ~BinaryOperatorNode();
         void virtual PrintTree(int indent = 0) const override;
+        virtual TokenType GetOperator() const = 0;
+        virtual int RegisterNeed() const override;
+        virtual void CodeRegister(InstructionsClass &machineCode) override;
+        virtual void CountVariableUses(VariableUses &uses) const override;
+        virtual ExpressionNode* Optimize(OptimizerClass &optimizer) override;
+        virtual ExpressionNode* Propagate(const KnownValues &known, OptimizerClass &optimizer) override;
+        virtual int Size() const override;
+        virtual IRInstruction* BuildIR(IRBuilderClass &builder) override;
+        virtual void AddReads(VariableNames &reads) const override;
+        virtual bool MayTrap() const override;
+        virtual ExpressionNode* HoistInvariants(const LoopNest &loops, size_t depth,
+                                                OptimizerClass &optimizer) override;
+        const ExpressionNode* GetLeft() const { return left; }
+        const ExpressionNode* GetRight() const { return right; }
+        ExpressionNode* GetRight() { return right; }
     protected:
+        InductionNode* Induction(const LoopNest &loops, size_t depth, OptimizerClass &optimizer);
+        // Codes both sides into registers and applies the operator, or
+        // only compares them when compareOnly is set.
+        void CodeRegisterOperands(InstructionsClass &machineCode, bool compareOnly);
+        bool ConstantOnLeft() const;
         ExpressionNode* left;
         ExpressionNode* right;
 };
@@ -258,6 +570,7 @@ class PlusNode : public BinaryOperatorNode {
     public:
         PlusNode(ExpressionNode* left, ExpressionNode* right);
         int Evaluate() const override;
+        virtual TokenType GetOperator() const override { return PLUS_TOKEN; }
         virtual void CodeEvaluate(InstructionsClass &machineCode) override;
         void virtual PrintTree(int indent = 0) const override;
 };
@@ -266,6 +579,7 @@ class MinusNode : public BinaryOperatorNode {
     public:
         MinusNode(ExpressionNode* left, ExpressionNode* right);
         int Evaluate() const override;
+        virtual TokenType GetOperator() const override { return MINUS_TOKEN; }
         virtual void CodeEvaluate(InstructionsClass &machineCode) override;
         void virtual PrintTree(int indent = 0) const override;
 };
@@ -274,6 +588,7 @@ class TimesNode : public BinaryOperatorNode {
     public:
         TimesNode(ExpressionNode* left, ExpressionNode* right);
         int Evaluate() const override;
+        virtual TokenType GetOperator() const override { return TIMES_TOKEN; }
         virtual void CodeEvaluate(InstructionsClass &machineCode) override;
         void virtual PrintTree(int indent = 0) const override;
 
@@ -283,60 +598,83 @@ class DivideNode : public BinaryOperatorNode {
     public:
         DivideNode(ExpressionNode* left, ExpressionNode* right);
         int Evaluate() const override;
+        virtual TokenType GetOperator() const override { return DIVIDE_TOKEN; }
         virtual void CodeEvaluate(InstructionsClass &machineCode) override;
         void virtual PrintTree(int indent = 0) const override;
 
 };
 
-class LessNode : public BinaryOperatorNode {
+// Base of the six comparison nodes. Used as a condition, a comparison
+// codes a single compare and jump.
+class RelationalOperatorNode : public BinaryOperatorNode {
+    public:
+        RelationalOperatorNode(ExpressionNode* left, ExpressionNode* right);
+        virtual ComparisonType GetComparison() const = 0;
+        virtual void CodeJumpIfFalse(InstructionsClass &machineCode, JumpList &falseJumps) override;
+        virtual void CodeJumpIfTrue(InstructionsClass &machineCode, JumpList &trueJumps) override;
+};
+
+class LessNode : public RelationalOperatorNode {
     public:
         LessNode(ExpressionNode* left, ExpressionNode* right);
         int Evaluate() const override;
+        virtual TokenType GetOperator() const override { return LESS_TOKEN; }
+        virtual ComparisonType GetComparison() const override { return LESS_COMPARE; }
         virtual void CodeEvaluate(InstructionsClass &machineCode) override;
         void virtual PrintTree(int indent = 0) const override;
 
 };
 
-class LessEqualNode : public BinaryOperatorNode {
+class LessEqualNode : public RelationalOperatorNode {
     public:
         LessEqualNode(ExpressionNode* left, ExpressionNode* right);
         int Evaluate() const override;
+        virtual TokenType GetOperator() const override { return LESSEQUAL_TOKEN; }
+        virtual ComparisonType GetComparison() const override { return LESSEQUAL_COMPARE; }
         virtual void CodeEvaluate(InstructionsClass &machineCode) override;
         void virtual PrintTree(int indent = 0) const override;
 
 };
 
-class GreaterNode : public BinaryOperatorNode {
+class GreaterNode : public RelationalOperatorNode {
     public:
         GreaterNode(ExpressionNode* left, ExpressionNode* right);
         int Evaluate() const override;
+        virtual TokenType GetOperator() const override { return GREATER_TOKEN; }
+        virtual ComparisonType GetComparison() const override { return GREATER_COMPARE; }
         virtual void CodeEvaluate(InstructionsClass &machineCode) override;
         void virtual PrintTree(int indent = 0) const override;
 
 };
 
-class GreaterEqualNode : public BinaryOperatorNode {
+class GreaterEqualNode : public RelationalOperatorNode {
     public:
         GreaterEqualNode(ExpressionNode* left, ExpressionNode* right);
         int Evaluate() const override;
+        virtual TokenType GetOperator() const override { return GREATEREQUAL_TOKEN; }
+        virtual ComparisonType GetComparison() const override { return GREATEREQUAL_COMPARE; }
         virtual void CodeEvaluate(InstructionsClass &machineCode) override;
         void virtual PrintTree(int indent = 0) const override;
 
 };
 
-class EqualNode : public BinaryOperatorNode {
+class EqualNode : public RelationalOperatorNode {
     public:
         EqualNode(ExpressionNode* left, ExpressionNode* right);
         int Evaluate() const override;
+        virtual TokenType GetOperator() const override { return EQUAL_TOKEN; }
+        virtual ComparisonType GetComparison() const override { return EQUAL_COMPARE; }
         virtual void CodeEvaluate(InstructionsClass &machineCode) override;
         void virtual PrintTree(int indent = 0) const override;
 
 };
 
-class NotEqualNode : public BinaryOperatorNode {
+class NotEqualNode : public RelationalOperatorNode {
     public:
         NotEqualNode(ExpressionNode* left, ExpressionNode* right);
         int Evaluate() const override;
+        virtual TokenType GetOperator() const override { return NOTEQUAL_TOKEN; }
+        virtual ComparisonType GetComparison() const override { return NOTEQUAL_COMPARE; }
         virtual void CodeEvaluate(InstructionsClass &machineCode) override;
         void virtual PrintTree(int indent = 0) const override;
 
@@ -346,6 +684,7 @@ class ModNode : public BinaryOperatorNode {
     public:
         ModNode(ExpressionNode* left, ExpressionNode* right);
         int Evaluate() const override;
+        virtual TokenType GetOperator() const override { return MOD_TOKEN; }
         virtual void CodeEvaluate(InstructionsClass &machineCode) override;
         void virtual PrintTree(int indent = 0) const override;
 
@@ -355,7 +694,14 @@ class AndNode : public BinaryOperatorNode {
     public:
         AndNode(ExpressionNode* left, ExpressionNode* right);
         int Evaluate() const override;
+        virtual TokenType GetOperator() const override { return AND_TOKEN; }
         virtual void CodeEvaluate(InstructionsClass &machineCode) override;
+        virtual int RegisterNeed() const override;
+        virtual void CodeRegister(InstructionsClass &machineCode) override;
+        virtual void CodeJumpIfFalse(InstructionsClass &machineCode, JumpList &falseJumps) override;
+        virtual void CodeJumpIfTrue(InstructionsClass &machineCode, JumpList &trueJumps) override;
+        virtual IRInstruction* BuildIR(IRBuilderClass &builder) override;
+        virtual void BuildBranch(IRBuilderClass &builder, IRBlock* whenTrue, IRBlock* whenFalse) override;
         void virtual PrintTree(int indent = 0) const override;
 
 };
@@ -364,55 +710,64 @@ class OrNode : public BinaryOperatorNode {
     public:
         OrNode(ExpressionNode* left, ExpressionNode* right);
         int Evaluate() const override;
+        virtual TokenType GetOperator() const override { return OR_TOKEN; }
         virtual void CodeEvaluate(InstructionsClass &machineCode) override;
+        virtual int RegisterNeed() const override;
+        virtual void CodeRegister(InstructionsClass &machineCode) override;
+        virtual void CodeJumpIfFalse(InstructionsClass &machineCode, JumpList &falseJumps) override;
+        virtual void CodeJumpIfTrue(InstructionsClass &machineCode, JumpList &trueJumps) override;
+        virtual IRInstruction* BuildIR(IRBuilderClass &builder) override;
+        virtual void BuildBranch(IRBuilderClass &builder, IRBlock* whenTrue, IRBlock* whenFalse) override;
         void virtual PrintTree(int indent = 0) const override;
 
 };
 
-class PlusEqualsStatementNode : public StatementNode {
+// v += e, v -= e, v++ and v--: adds sign times e, or 1 without it, to v.
+class UpdateStatementNode : public StoreStatementNode {
+    public:
+        UpdateStatementNode(IdentifierNode* identifier, ExpressionNode* expression, int sign);
+        virtual void Propagate(KnownValues &known, OptimizerClass &optimizer) override;
+        virtual void Liveness(LiveVariables &live) const override;
+        virtual StatementNode* EliminateDeadCode(LiveVariables &live, OptimizerClass &optimizer) override;
+        virtual int CountingStep(std::string &label) const override;
+    protected:
+        int sign;
+};
+
+class PlusEqualsStatementNode : public UpdateStatementNode {
     public:
         PlusEqualsStatementNode(IdentifierNode* id, ExpressionNode* expr);
-        ~PlusEqualsStatementNode();
         virtual void PrintTree(int indent = 0) const override;
         virtual void Interpret() const override;
         virtual void Code(InstructionsClass &machineCode) override;
-    private:
-        IdentifierNode* identifier;
-        ExpressionNode* expression;
+        virtual void BuildIR(IRBuilderClass &builder) override;
     };
     
-class MinusEqualsStatementNode : public StatementNode {
+class MinusEqualsStatementNode : public UpdateStatementNode {
     public:
         MinusEqualsStatementNode(IdentifierNode* id, ExpressionNode* expr);
-        ~MinusEqualsStatementNode();
         virtual void PrintTree(int indent = 0) const override;
         virtual void Interpret() const override;
         virtual void Code(InstructionsClass &machineCode) override;
-    private:
-        IdentifierNode* identifier;
-        ExpressionNode* expression;
+        virtual void BuildIR(IRBuilderClass &builder) override;
     };
 
-class PlusPlusStatementNode : public StatementNode {
+class PlusPlusStatementNode : public UpdateStatementNode {
     public:
         PlusPlusStatementNode(IdentifierNode* id);
-        ~PlusPlusStatementNode();
         virtual void PrintTree(int indent = 0) const override;
         virtual void Interpret() const override;
         virtual void Code(InstructionsClass &machineCode) override;
-    private:
-        IdentifierNode* identifier;
+        virtual void BuildIR(IRBuilderClass &builder) override;
     };
 
-class MinusMinusStatementNode : public StatementNode {
+class MinusMinusStatementNode : public UpdateStatementNode {
     public:
         MinusMinusStatementNode(IdentifierNode* id);
-        ~MinusMinusStatementNode();
         virtual void PrintTree(int indent = 0) const override;
         virtual void Interpret() const override;
         virtual void Code(InstructionsClass &machineCode) override;
-    private:
-        IdentifierNode* identifier;
+        virtual void BuildIR(IRBuilderClass &builder) override;
     };
 
 // class PrintStatementNode : public StatementNode 
@@ -421,7 +776,11 @@ class ExponentNode : public BinaryOperatorNode {
     public:
         ExponentNode(ExpressionNode* left, ExpressionNode* right);
         int Evaluate() const override;
+        virtual TokenType GetOperator() const override { return POWER_TOKEN; }
         virtual void CodeEvaluate(InstructionsClass &machineCode) override;
         void virtual PrintTree(int indent = 0) const override;
 
 };
+
+// base ** exponent, wrapping like the machine code does.
+int IntegerPower(int base, int exponent);
@@ -0,0 +1,108 @@
+#include <iostream>
+#include "Optimizer.h"
+#include "Node.h"
+
+// Enough for a short loop with a few statements to go entirely.
+const int DEFAULT_UNROLL_BUDGET = 64;
+
+OptimizerClass::OptimizerClass()
+	: mPropagated(0), mCopied(0), mFolded(0), mSimplified(0), mPruned(0),
+	  mDeadStores(0), mDeadCode(0), mHoisted(0), mReduced(0),
+	  mUnrolled(0), mUnrollBudget(DEFAULT_UNROLL_BUDGET)
+{
+}
+
+void OptimizerClass::Optimize(StartNode * root)
+{
+	root->Propagate(*this);
+	root->Optimize(*this);
+	root->EliminateDeadCode(*this);
+	// Last: the loops only point at the expressions it hoists, so no
+	// pass may delete them afterwards.
+	root->HoistInvariants(*this);
+}
+
+void OptimizerClass::PrintStatistics() const
+{
+	std::cout << "Optimizer:" << std::endl;
+	std::cout << "  variable reads made constant: " << mPropagated << std::endl;
+	std::cout << "  variable reads made copies: " << mCopied << std::endl;
+	std::cout << "  constant operators folded: " << mFolded << std::endl;
+	std::cout << "  identities simplified: " << mSimplified << std::endl;
+	std::cout << "  statements pruned: " << mPruned << std::endl;
+	std::cout << "  dead stores removed: " << mDeadStores << std::endl;
+	std::cout << "  dead ifs and loops removed: " << mDeadCode << std::endl;
+	std::cout << "  loop invariants hoisted: " << mHoisted << std::endl;
+	std::cout << "  induction expressions strength-reduced: " << mReduced << std::endl;
+	std::cout << "  loops unrolled: " << mUnrolled << std::endl;
+}
+
+void OptimizerClass::SetUnrollBudget(int nodes)
+{
+	mUnrollBudget = nodes;
+}
+
+int OptimizerClass::UnrollFactor(int count, int size)
+{
+	if (mUnrollBudget <= 0 || size <= 0)
+	{
+		return 0;
+	}
+	if ((long long)count * size <= mUnrollBudget)
+	{
+		mUnrolled++;
+		return count;
+	}
+	int copies = mUnrollBudget / size;
+	if (copies < 2)
+	{
+		return 0;
+	}
+	mUnrolled++;
+	return copies;
+}
+
+void OptimizerClass::CountPropagated()
+{
+	mPropagated++;
+}
+
+void OptimizerClass::CountCopied()
+{
+	mCopied++;
+}
+
+void OptimizerClass::CountFolded()
+{
+	mFolded++;
+}
+
+void OptimizerClass::CountSimplified()
+{
+	mSimplified++;
+}
+
+void OptimizerClass::CountPruned()
+{
+	mPruned++;
+}
+
+void OptimizerClass::CountDeadStore()
+{
+	mDeadStores++;
+}
+
+void OptimizerClass::CountDeadCode()
+{
+	mDeadCode++;
+}
+
+void OptimizerClass::CountHoisted()
+{
+	mHoisted++;
+}
+
+void OptimizerClass::CountReduced()
+{
+	mReduced++;
+}
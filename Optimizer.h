@@ -0,0 +1,49 @@
+#pragma once
+
+class StartNode;
+
+// The passes over the AST between ParserClass::Start and Code or
+// Interpret: Propagate puts known constants and copies in for variable
+// reads, Optimize folds constants and prunes dead branches,
+// EliminateDeadCode removes stores nothing reads, by liveness, and
+// HoistInvariants moves loop-invariant expressions before their loops
+// and has counting loops step multiples of their counters along.
+// Each node works on its own children; this counts what they did, and
+// decides how far loops with a fixed trip count are unrolled.
+class OptimizerClass
+{
+public:
+	OptimizerClass();
+	void Optimize(StartNode * root);
+	void PrintStatistics() const;
+	// Unrolled code is kept to about this many AST nodes per loop; 0
+	// turns unrolling off.
+	void SetUnrollBudget(int nodes);
+	// Copies of a body of size nodes to make per trip of a loop that runs
+	// count times: count when they all fit the budget, else as many as
+	// fit, or 0 when that is fewer than two.
+	int UnrollFactor(int count, int size);
+
+	void CountPropagated();
+	void CountCopied();
+	void CountFolded();
+	void CountSimplified();
+	void CountPruned();
+	void CountDeadStore();
+	void CountDeadCode();
+	void CountHoisted();
+	void CountReduced();
+
+private:
+	int mPropagated; // variable reads, now constants
+	int mCopied;     // variable reads, now reads of what they copied
+	int mFolded;     // operators with constant operands, now constants
+	int mSimplified; // x + 0, x * 1 and the like, now just x
+	int mPruned;     // statements behind constant conditions
+	int mDeadStores; // stores to variables never read afterwards
+	int mDeadCode;   // ifs and loops left with nothing to do
+	int mHoisted;    // loop-invariant expressions, now worked out once
+	int mReduced;    // i * c in loops counting i, now added to instead
+	int mUnrolled;   // loops coded as copies of their bodies
+	int mUnrollBudget;
+};
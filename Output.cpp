@@ -0,0 +1,79 @@
+#include <unistd.h>
+#include <cerrno>
+#include "Output.h"
+
+OutputBufferClass gStandardOutput;
+
+OutputBufferClass::OutputBufferClass(int fileDescriptor)
+	: mLength(0), mFileDescriptor(fileDescriptor)
+{
+}
+
+OutputBufferClass::~OutputBufferClass()
+{
+	Flush();
+}
+
+void OutputBufferClass::WriteInteger(int value)
+{
+	if (mLength > OUTPUT_BUFFER_SIZE - MAX_INTEGER_CHARACTERS)
+	{
+		Flush();
+	}
+
+	// Work in unsigned so that the most negative int prints correctly.
+	unsigned int magnitude = (unsigned int)value;
+	if (value < 0)
+	{
+		mBuffer[mLength++] = '-';
+		magnitude = 0u - magnitude;
+	}
+
+	// Digits come out backwards, so build them at the end of a scratch
+	// array and copy them over in order.
+	char digits[MAX_INTEGER_CHARACTERS];
+	int first = MAX_INTEGER_CHARACTERS;
+	do
+	{
+		digits[--first] = (char)('0' + magnitude % 10);
+		magnitude /= 10;
+	} while (magnitude != 0);
+
+	while (first < MAX_INTEGER_CHARACTERS)
+	{
+		mBuffer[mLength++] = digits[first++];
+	}
+}
+
+void OutputBufferClass::WriteCharacter(char c)
+{
+	if (mLength >= OUTPUT_BUFFER_SIZE)
+	{
+		Flush();
+	}
+	mBuffer[mLength++] = c;
+}
+
+void OutputBufferClass::Flush()
+{
+	int written = 0;
+	while (written < mLength)
+	{
+		ssize_t result = write(mFileDescriptor, mBuffer + written, mLength - written);
+		if (result < 0 && errno == EINTR)
+		{
+			continue;
+		}
+		if (result <= 0)
+		{
+			break; // Nowhere left to report it; drop the rest.
+		}
+		written += (int)result;
+	}
+	mLength = 0;
+}
+
+int OutputBufferClass::GetFileDescriptor() const
+{
+	return mFileDescriptor;
+}
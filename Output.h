@@ -0,0 +1,30 @@
+#pragma once
+
+const int OUTPUT_BUFFER_SIZE = 4096;
+// Longest thing written in one go: '-', 10 digits and a trailing space.
+const int MAX_INTEGER_CHARACTERS = 12;
+
+// Holds program output until the buffer fills up or the program ends,
+// so that printing costs one write() per buffer instead of one per item.
+// This is the interpreter's. Machine code built by InstructionsClass
+// buffers the same way in each execution's own ExecutionContext, and
+// only takes the file descriptor from here.
+class OutputBufferClass
+{
+public:
+	OutputBufferClass(int fileDescriptor = 1);
+	~OutputBufferClass();
+	void WriteInteger(int value);
+	void WriteCharacter(char c);
+	void Flush();
+
+	int GetFileDescriptor() const;
+
+private:
+	char mBuffer[OUTPUT_BUFFER_SIZE];
+	int mLength;
+	int mFileDescriptor;
+};
+
+// Shared by the interpreter and by generated code writing to stdout.
+extern OutputBufferClass gStandardOutput;
@@ -3,33 +3,40 @@
 #include <vector>
 #include <iostream>
 #include <cstdlib>
+#include <stdexcept>
+#include <memory>
+
+// Subtrees are held in unique_ptrs until they are handed to the node
+// that owns them, so that none are leaked when a syntax error throws.
 
 ParserClass::ParserClass(ScannerClass* scanner, SymbolTableClass* symTab)
-    : mScanner(scanner), mSymTab(symTab)
+    : mScanner(scanner), mSymTab(symTab), mDeclarations(0)
 {
 }
 
+int ParserClass::GetDeclarationCount() const {
+    return mDeclarations;
+}
+
 TokenClass ParserClass::Match(TokenType expectedType) {
     TokenClass currentToken = mScanner->GetNextToken();
     MSG("\tCurrent Token: " << currentToken.GetTokenTypeName() << " (" << static_cast<int>(currentToken.GetTokenType())
         << ") . Lexeme: \"" << currentToken.GetLexeme() << "\"");
 
     if (currentToken.GetTokenType() != expectedType) {
-        std::cerr << "Error in ParserClass::Match on line " << mScanner->GetLineNumber() << ": "
-                  << "Expected token type "
-                  << TokenClass::GetTokenTypeName(expectedType)
-                  << ", but got type " << currentToken.GetTokenTypeName()
-                  << " with lexeme \"" << currentToken.GetLexeme() << "\"." << std::endl;
-        std::exit(1);
+        throw std::runtime_error("ParserClass::Match on line " + std::to_string(mScanner->GetLineNumber())
+            + ": Expected token type " + TokenClass::GetTokenTypeName(expectedType)
+            + ", but got type " + currentToken.GetTokenTypeName()
+            + " with lexeme \"" + currentToken.GetLexeme() + "\".");
     }
     MSG("\tSuccessfully matched Token Type: " << currentToken.GetTokenTypeName() << ". Lexeme: \"" << currentToken.GetLexeme() << "\"");
     return currentToken;
 }
 
 StartNode * ParserClass::Start() {
-    ProgramNode* programNode = Program();
+    std::unique_ptr<ProgramNode> programNode(Program());
     Match(ENDFILE_TOKEN);
-    StartNode* startNode = new StartNode(programNode);
+    StartNode* startNode = new StartNode(programNode.release());
     return startNode;
 }
 
@@ -46,14 +53,14 @@ ProgramNode* ParserClass::Program() {
 
 BlockNode* ParserClass::Block() {
     Match(LCURLY_TOKEN);
-    StatementGroupNode* statementGroupNode = StatementGroup();
+    std::unique_ptr<StatementGroupNode> statementGroupNode(StatementGroup());
     Match(RCURLY_TOKEN);
-    BlockNode* blockNode = new BlockNode(statementGroupNode);
+    BlockNode* blockNode = new BlockNode(statementGroupNode.release());
     return blockNode;
 }
 
 StatementGroupNode* ParserClass::StatementGroup() {
-    StatementGroupNode* stmtGroup = new StatementGroupNode();
+    std::unique_ptr<StatementGroupNode> stmtGroup(new StatementGroupNode());
     TokenClass token = mScanner->PeekNextToken();
     TokenType tt = token.GetTokenType();
     while (tt == INT_TOKEN || tt == IDENTIFIER_TOKEN || tt == COUT_TOKEN || tt == LCURLY_TOKEN ||
@@ -65,7 +72,7 @@ StatementGroupNode* ParserClass::StatementGroup() {
         token = mScanner->PeekNextToken();
         tt = token.GetTokenType();
     }
-    return stmtGroup;
+    return stmtGroup.release();
 }
 
 StatementNode* ParserClass::Statement() {
@@ -111,14 +118,15 @@ StatementNode* ParserClass::Statement() {
 
 DeclarationStatementNode* ParserClass::DeclarationStatement() {
     Match(INT_TOKEN);
-    IdentifierNode* idNode = Identifier();
-    ExpressionNode* expr = nullptr;
+    std::unique_ptr<IdentifierNode> idNode(Identifier());
+    std::unique_ptr<ExpressionNode> expr;
     if (mScanner->PeekNextToken().GetTokenType() == ASSIGNMENT_TOKEN){
         Match(ASSIGNMENT_TOKEN);
-        expr = Expression();
+        expr.reset(Expression());
     }
     Match(SEMICOLON_TOKEN);
-    DeclarationStatementNode* declStmt = new DeclarationStatementNode(idNode, expr);
+    mDeclarations++;
+    DeclarationStatementNode* declStmt = new DeclarationStatementNode(idNode.release(), expr.release());
     return declStmt;
 }
 
@@ -132,46 +140,46 @@ DeclarationStatementNode* ParserClass::DeclarationStatement() {
 // }
 
 StatementNode* ParserClass::AssignmentOrCompoundStatement() {
-    IdentifierNode* id = Identifier();
+    std::unique_ptr<IdentifierNode> id(Identifier());
     TokenType tt = mScanner->PeekNextToken().GetTokenType();
     if (tt == ASSIGNMENT_TOKEN) {
         Match(ASSIGNMENT_TOKEN);
-        ExpressionNode* rhs = Expression();
+        std::unique_ptr<ExpressionNode> rhs(Expression());
         Match(SEMICOLON_TOKEN);
-        return new AssignmentStatementNode(id, rhs);
+        return new AssignmentStatementNode(id.release(), rhs.release());
     }
     else if (tt == PLUS_EQUAL_TOKEN) {
         Match(PLUS_EQUAL_TOKEN);
-        ExpressionNode* rhs = Expression();
+        std::unique_ptr<ExpressionNode> rhs(Expression());
         Match(SEMICOLON_TOKEN);
-        return new PlusEqualsStatementNode(id, rhs);
+        return new PlusEqualsStatementNode(id.release(), rhs.release());
     }
     else if (tt == MINUS_EQUAL_TOKEN) {
         Match(MINUS_EQUAL_TOKEN);
-        ExpressionNode* rhs = Expression();
+        std::unique_ptr<ExpressionNode> rhs(Expression());
         Match(SEMICOLON_TOKEN);
-        return new MinusEqualsStatementNode(id, rhs);
+        return new MinusEqualsStatementNode(id.release(), rhs.release());
     }
     else if (tt == PLUS_PLUS_TOKEN) {
         Match(PLUS_PLUS_TOKEN);
         Match(SEMICOLON_TOKEN);
-        return new PlusPlusStatementNode(id);
+        return new PlusPlusStatementNode(id.release());
     }
     else if (tt == MINUS_MINUS_TOKEN) {
         Match(MINUS_MINUS_TOKEN);
         Match(SEMICOLON_TOKEN);
-        return new MinusMinusStatementNode(id);
+        return new MinusMinusStatementNode(id.release());
     }
     else {
-        std::cerr << "Error: expected =, +=, -=, ++, or -- after identifier\n";
-        std::exit(1);
+        throw std::runtime_error("Expected =, +=, -=, ++, or -- after identifier on line "
+            + std::to_string(mScanner->GetLineNumber()) + ".");
     }
 }
 
 CoutStatementNode *ParserClass::CoutStatement()
 {
     Match(COUT_TOKEN);
-    std::vector<ExpressionNode*> items;
+    std::vector<std::unique_ptr<ExpressionNode> > items;
     do{
         Match(INSERTION_TOKEN);
         TokenClass next = mScanner->PeekNextToken();
@@ -180,130 +188,134 @@ CoutStatementNode *ParserClass::CoutStatement()
             items.push_back(nullptr);
 
         }else{
-            ExpressionNode* expr = Expression();
-            items.push_back(expr);
+            items.push_back(std::unique_ptr<ExpressionNode>(Expression()));
         }
 
     }
     while(mScanner->PeekNextToken().GetTokenType() == INSERTION_TOKEN);
 
     Match(SEMICOLON_TOKEN);
-    return new CoutStatementNode(items);
+    std::vector<ExpressionNode*> released;
+    for (std::unique_ptr<ExpressionNode> &item : items) {
+        released.push_back(item.release());
+    }
+    return new CoutStatementNode(released);
 }
 
 StatementNode* ParserClass::IfStatement() {
     Match(IF_TOKEN);            
     Match(LPAREN_TOKEN);        
-    ExpressionNode* condition = Expression();
+    std::unique_ptr<ExpressionNode> condition(Expression());
     Match(RPAREN_TOKEN);        
     
-    StatementNode* thenStmt = Statement();
+    std::unique_ptr<StatementNode> thenStmt(Statement());
     
-    StatementNode* elseStmt = nullptr;
+    std::unique_ptr<StatementNode> elseStmt;
     if (mScanner->PeekNextToken().GetTokenType() == ELSE_TOKEN) {
         Match(ELSE_TOKEN);
-        elseStmt = Statement();
+        elseStmt.reset(Statement());
     }
     
-    return new IfStatementNode(condition, thenStmt, elseStmt);
+    return new IfStatementNode(condition.release(), thenStmt.release(), elseStmt.release());
 }
 
 StatementNode* ParserClass::ForStatement() {
     Match(FOR_TOKEN);
     Match(LPAREN_TOKEN);
 
-    StatementNode* initStmt = nullptr;
+    std::unique_ptr<StatementNode> initStmt;
     if (mScanner->PeekNextToken().GetTokenType() != SEMICOLON_TOKEN) {
         if (mScanner->PeekNextToken().GetTokenType() == INT_TOKEN) {
-            initStmt = DeclarationStatement();
+            initStmt.reset(DeclarationStatement());
         } else {
-            IdentifierNode* id = Identifier();
+            std::unique_ptr<IdentifierNode> id(Identifier());
             Match(ASSIGNMENT_TOKEN);
-            ExpressionNode* expr = Expression();
-            initStmt = new AssignmentStatementNode(id, expr);
+            std::unique_ptr<ExpressionNode> expr(Expression());
+            initStmt.reset(new AssignmentStatementNode(id.release(), expr.release()));
             Match(SEMICOLON_TOKEN);
         }
     } else {
         Match(SEMICOLON_TOKEN);
     }
 
-    ExpressionNode* condExpr = nullptr;
+    std::unique_ptr<ExpressionNode> condExpr;
     if (mScanner->PeekNextToken().GetTokenType() != SEMICOLON_TOKEN) {
-        condExpr = Expression();
+        condExpr.reset(Expression());
     }
     Match(SEMICOLON_TOKEN);
 
-    StatementNode* stepStmt = nullptr;
+    std::unique_ptr<StatementNode> stepStmt;
     if (mScanner->PeekNextToken().GetTokenType() != RPAREN_TOKEN) {
-        IdentifierNode* id2 = Identifier();
+        std::unique_ptr<IdentifierNode> id2(Identifier());
         TokenType tt2 = mScanner->PeekNextToken().GetTokenType();
         if (tt2 == ASSIGNMENT_TOKEN) {
             Match(ASSIGNMENT_TOKEN);
-            ExpressionNode* expr2 = Expression();
-            stepStmt = new AssignmentStatementNode(id2, expr2);
+            std::unique_ptr<ExpressionNode> expr2(Expression());
+            stepStmt.reset(new AssignmentStatementNode(id2.release(), expr2.release()));
         } else if (tt2 == PLUS_EQUAL_TOKEN) {
             Match(PLUS_EQUAL_TOKEN);
-            ExpressionNode* expr2 = Expression();
-            stepStmt = new PlusEqualsStatementNode(id2, expr2);
+            std::unique_ptr<ExpressionNode> expr2(Expression());
+            stepStmt.reset(new PlusEqualsStatementNode(id2.release(), expr2.release()));
         } else if (tt2 == MINUS_EQUAL_TOKEN) {
             Match(MINUS_EQUAL_TOKEN);
-            ExpressionNode* expr2 = Expression();
-            stepStmt = new MinusEqualsStatementNode(id2, expr2);
+            std::unique_ptr<ExpressionNode> expr2(Expression());
+            stepStmt.reset(new MinusEqualsStatementNode(id2.release(), expr2.release()));
         } else if (tt2 == PLUS_PLUS_TOKEN) {
             Match(PLUS_PLUS_TOKEN);
-            stepStmt = new PlusPlusStatementNode(id2);
+            stepStmt.reset(new PlusPlusStatementNode(id2.release()));
         } else if (tt2 == MINUS_MINUS_TOKEN) {
             Match(MINUS_MINUS_TOKEN);
-            stepStmt = new MinusMinusStatementNode(id2);
+            stepStmt.reset(new MinusMinusStatementNode(id2.release()));
         } else {
-            std::cerr << "Error in ForStatement: expected assignment or increment/decrement operator after identifier\n";
-            std::exit(1);
+            throw std::runtime_error("ForStatement on line " + std::to_string(mScanner->GetLineNumber())
+                + ": expected assignment or increment/decrement operator after identifier.");
         }
     }
     Match(RPAREN_TOKEN);
 
-    StatementNode* body = Statement();
+    std::unique_ptr<StatementNode> body(Statement());
 
-    return new ForStatementNode(initStmt, condExpr, stepStmt, body);
+    return new ForStatementNode(initStmt.release(), condExpr.release(), stepStmt.release(),
+        body.release());
 }
 
 StatementNode* ParserClass::WhileStatement() {
     Match(WHILE_TOKEN);
     Match(LPAREN_TOKEN);
-    ExpressionNode* condition = Expression();
+    std::unique_ptr<ExpressionNode> condition(Expression());
     Match(RPAREN_TOKEN);
     
-    StatementNode* body = Statement();
+    std::unique_ptr<StatementNode> body(Statement());
     
-    return new WhileStatementNode(condition, body);
+    return new WhileStatementNode(condition.release(), body.release());
 }
 
 StatementNode* ParserClass::DoWhileStatement() {
     Match(DO_TOKEN);
-    StatementNode* body = Statement();
+    std::unique_ptr<StatementNode> body(Statement());
     Match(WHILE_TOKEN);
     Match(LPAREN_TOKEN);
-    ExpressionNode* condition = Expression();
+    std::unique_ptr<ExpressionNode> condition(Expression());
     Match(RPAREN_TOKEN);
     // Optional semicolon
     if (mScanner->PeekNextToken().GetTokenType() == SEMICOLON_TOKEN) {
         Match(SEMICOLON_TOKEN);
     }
     
-    return new DoWhileStatementNode(body, condition);
+    return new DoWhileStatementNode(body.release(), condition.release());
 }
 
 
 StatementNode* ParserClass::RepeatStatement() {
     Match(REPEAT_TOKEN);
     Match(LPAREN_TOKEN);
-    ExpressionNode* expr = Expression();
+    std::unique_ptr<ExpressionNode> expr(Expression());
     Match(RPAREN_TOKEN);
     Match(LCURLY_TOKEN);
-    StatementGroupNode* stmtGroup = StatementGroup();
+    std::unique_ptr<StatementGroupNode> stmtGroup(StatementGroup());
     Match(RCURLY_TOKEN);
     
-    return new RepeatStatementNode(expr, stmtGroup);
+    return new RepeatStatementNode(expr.release(), stmtGroup.release());
 }
 
 IdentifierNode* ParserClass::Identifier() {
@@ -327,83 +339,87 @@ ExpressionNode* ParserClass::Expression() {
 }
 
 ExpressionNode* ParserClass::Relational() {
-    ExpressionNode* left = PlusMinus();
+    std::unique_ptr<ExpressionNode> left(PlusMinus());
     
     TokenType tt = mScanner->PeekNextToken().GetTokenType();
     
     if (tt == LESS_TOKEN) {
         Match(tt);
         ExpressionNode* right = PlusMinus();
-        return new LessNode(left, right);
+        return new LessNode(left.release(), right);
     }
     else if (tt == LESSEQUAL_TOKEN) {
         Match(tt);
         ExpressionNode* right = PlusMinus();
-        return new LessEqualNode(left, right);
+        return new LessEqualNode(left.release(), right);
     }
     else if (tt == GREATER_TOKEN) {
         Match(tt);
         ExpressionNode* right = PlusMinus();
-        return new GreaterNode(left, right);
+        return new GreaterNode(left.release(), right);
     }
     else if (tt == GREATEREQUAL_TOKEN) {
         Match(tt);
         ExpressionNode* right = PlusMinus();
-        return new GreaterEqualNode(left, right);
+        return new GreaterEqualNode(left.release(), right);
     }
     else if (tt == EQUAL_TOKEN) {
         Match(tt);
         ExpressionNode* right = PlusMinus();
-        return new EqualNode(left, right);
+        return new EqualNode(left.release(), right);
     }
     else if (tt == NOTEQUAL_TOKEN) {
         Match(tt);
         ExpressionNode* right = PlusMinus();
-        return new NotEqualNode(left, right);
+        return new NotEqualNode(left.release(), right);
     }
     else if (tt == MOD_TOKEN){
         Match(tt);
         ExpressionNode* right = PlusMinus();
-        return new ModNode(left, right);
+        return new ModNode(left.release(), right);
     }
     
-    return left;
+    return left.release();
 }
 
 ExpressionNode* ParserClass::PlusMinus(){
-    ExpressionNode* current = TimesDivide();
+    std::unique_ptr<ExpressionNode> current(TimesDivide());
 
     while(true){
         TokenType tt= mScanner->PeekNextToken().GetTokenType();
         if(tt== PLUS_TOKEN){
             Match(tt);
-            current = new PlusNode(current, TimesDivide());
+            ExpressionNode* right = TimesDivide();
+            current.reset(new PlusNode(current.release(), right));
         }
         else if (tt==MINUS_TOKEN){
             Match(tt);
-            current = new MinusNode(current, TimesDivide());
+            ExpressionNode* right = TimesDivide();
+            current.reset(new MinusNode(current.release(), right));
         }
         else{
-            return current;
+            return current.release();
         }
     }
 }
 
 ExpressionNode* ParserClass::TimesDivide(){
-    ExpressionNode* current = Power();
+    std::unique_ptr<ExpressionNode> current(Power());
 
     while(true){
         TokenType tt= mScanner->PeekNextToken().GetTokenType();
         if(tt== TIMES_TOKEN){
             Match(tt);
-            current = new TimesNode(current, Power());
+            ExpressionNode* right = Power();
+            current.reset(new TimesNode(current.release(), right));
         }
         else if (tt==DIVIDE_TOKEN){
             Match(tt);
-            current = new DivideNode(current, Power());
+            ExpressionNode* right = Power();
+            current.reset(new DivideNode(current.release(), right));
         }
         else{
-            return current;
+            return current.release();
         }
     }
 }
@@ -418,55 +434,57 @@ ExpressionNode* ParserClass::Factor() {
         return Integer();
     } else if (tt == LPAREN_TOKEN) {
         Match(LPAREN_TOKEN);
-        ExpressionNode* expr = Expression();
+        std::unique_ptr<ExpressionNode> expr(Expression());
         Match(RPAREN_TOKEN);
-        return expr;
+        return expr.release();
     } else {
-        std::cerr << "Error in ParserClass::Factor: unexpected token "
-                  << token.GetTokenTypeName() << " with lexeme \"" 
-                  << token.GetLexeme() << "\"." << std::endl;
-        std::exit(1);
+        throw std::runtime_error("ParserClass::Factor on line " + std::to_string(mScanner->GetLineNumber())
+            + ": unexpected token " + token.GetTokenTypeName()
+            + " with lexeme \"" + token.GetLexeme() + "\".");
     }
 }
 
 ExpressionNode *ParserClass::Power()
 {
-    ExpressionNode* current = Factor();
+    std::unique_ptr<ExpressionNode> current(Factor());
     while (true) {
         TokenType tt = mScanner->PeekNextToken().GetTokenType();
         if (tt == POWER_TOKEN) {
             Match(tt);
-            current = new ExponentNode(current, Factor());
+            ExpressionNode* right = Factor();
+            current.reset(new ExponentNode(current.release(), right));
         } else {
-            return current;
+            return current.release();
         }
     }    
 }
 
 ExpressionNode* ParserClass::And(){
-    ExpressionNode* left = Relational();
+    std::unique_ptr<ExpressionNode> left(Relational());
     while(true){
         TokenType tt = mScanner->PeekNextToken().GetTokenType();
         MSG("And() peek token: " << gTokenTypeNames[tt]);
         if (tt == AND_TOKEN) {
             Match(tt);
-            left = new AndNode(left, Relational());
+            ExpressionNode* right = Relational();
+            left.reset(new AndNode(left.release(), right));
         } else {
-            return left;
+            return left.release();
         }
     }
 }
 
 ExpressionNode* ParserClass::Or(){
-    ExpressionNode* left = And();
+    std::unique_ptr<ExpressionNode> left(And());
     while(true){
         TokenType tt = mScanner->PeekNextToken().GetTokenType();
         MSG("Or() peek token: " << gTokenTypeNames[tt]);
         if (tt == OR_TOKEN) {
             Match(tt);
-            left = new OrNode(left, And());
+            ExpressionNode* right = And();
+            left.reset(new OrNode(left.release(), right));
         } else {
-            return left;
+            return left.release();
         }
     }
 }
@@ -9,6 +9,7 @@ class ParserClass
 private:
     ScannerClass* mScanner;
     SymbolTableClass* mSymTab;
+    int mDeclarations;
 
     TokenClass Match(TokenType expectedType);
     
@@ -45,6 +46,10 @@ private:
 
 public:
     ParserClass(ScannerClass* scanner, SymbolTableClass* symTab);
+    // Throws std::runtime_error, saying where, at the first syntax error.
     StartNode* Start();
+    // After Start: how many variables the program declares. They only
+    // enter the symbol table as their declarations run or are coded.
+    int GetDeclarationCount() const;
 };
 
@@ -0,0 +1,278 @@
+#include <iostream>
+#include <climits>
+#include <set>
+#include "Passes.h"
+#include "Node.h"
+
+// left operation right, wrapping like the machine code. False when the
+// machine code would trap instead.
+static bool Fold(TokenType operation, int left, int right, int & result)
+{
+	unsigned int a = (unsigned int)left;
+	unsigned int b = (unsigned int)right;
+	switch (operation)
+	{
+	case PLUS_TOKEN:         result = (int)(a + b); return true;
+	case MINUS_TOKEN:        result = (int)(a - b); return true;
+	case TIMES_TOKEN:        result = (int)(a * b); return true;
+	case DIVIDE_TOKEN:
+	case MOD_TOKEN:
+		if (right == 0 || (right == -1 && left == INT_MIN))
+		{
+			return false;
+		}
+		result = operation == DIVIDE_TOKEN ? left / right : left % right;
+		return true;
+	case POWER_TOKEN:        result = IntegerPower(left, right); return true;
+	case LESS_TOKEN:         result = left < right; return true;
+	case LESSEQUAL_TOKEN:    result = left <= right; return true;
+	case GREATER_TOKEN:      result = left > right; return true;
+	case GREATEREQUAL_TOKEN: result = left >= right; return true;
+	case EQUAL_TOKEN:        result = left == right; return true;
+	case NOTEQUAL_TOKEN:     result = left != right; return true;
+	default:                 return false;
+	}
+}
+
+static bool IsConstant(const IRInstruction * value, int constant)
+{
+	return value->opcode == IR_CONSTANT && value->constant == constant;
+}
+
+// What a binary instruction is without working it out: x + 0 is x.
+static IRInstruction * Identity(IRInstruction * instruction)
+{
+	IRInstruction * left = instruction->operands[0];
+	IRInstruction * right = instruction->operands[1];
+	switch (instruction->operation)
+	{
+	case PLUS_TOKEN:
+		if (IsConstant(right, 0)) return left;
+		if (IsConstant(left, 0)) return right;
+		break;
+	case TIMES_TOKEN:
+		if (IsConstant(right, 1)) return left;
+		if (IsConstant(left, 1)) return right;
+		break;
+	case MINUS_TOKEN:
+		if (IsConstant(right, 0)) return left;
+		break;
+	case DIVIDE_TOKEN:
+	case POWER_TOKEN:
+		if (IsConstant(right, 1)) return left;
+		break;
+	default:
+		break;
+	}
+	return NULL;
+}
+
+const char * ConstantFoldingPassClass::Name() const
+{
+	return "constant folding";
+}
+
+int ConstantFoldingPassClass::Run(IRFunctionClass & function)
+{
+	int changes = 0;
+	for (IRBlock * block : function.GetBlocks())
+	{
+		for (IRInstruction * phi : block->phis)
+		{
+			IRInstruction * same = NULL;
+			bool trivial = true;
+			for (IRInstruction * operand : phi->operands)
+			{
+				operand = IRFunctionClass::Resolve(operand);
+				if (operand == phi || operand == same)
+				{
+					continue;
+				}
+				if (same)
+				{
+					trivial = false;
+					break;
+				}
+				same = operand;
+			}
+			if (trivial && same)
+			{
+				phi->replacement = same;
+				changes++;
+			}
+		}
+		for (IRInstruction * instruction : block->instructions)
+		{
+			if (instruction->opcode != IR_BINARY)
+			{
+				continue;
+			}
+			IRInstruction * left = IRFunctionClass::Resolve(instruction->operands[0]);
+			IRInstruction * right = IRFunctionClass::Resolve(instruction->operands[1]);
+			instruction->operands[0] = left;
+			instruction->operands[1] = right;
+			int result;
+			if (left->opcode == IR_CONSTANT && right->opcode == IR_CONSTANT
+				&& Fold(instruction->operation, left->constant, right->constant, result))
+			{
+				instruction->replacement = function.Constant(result);
+				changes++;
+			}
+			else if (IRInstruction * same = Identity(instruction))
+			{
+				instruction->replacement = same;
+				changes++;
+			}
+		}
+		IRInstruction * condition = IRFunctionClass::Resolve(block->condition);
+		if (block->terminator == IR_BRANCH && condition->opcode == IR_CONSTANT)
+		{
+			int taken = condition->constant ? 0 : 1;
+			function.RemoveEdge(block, block->successors[1 - taken]);
+			block->terminator = IR_JUMP;
+			block->successors[0] = block->successors[taken];
+			block->successors[1] = NULL;
+			block->condition = NULL;
+			changes++;
+		}
+	}
+	changes += function.RemoveUnreachableBlocks();
+	function.ResolveReplacements();
+	return changes;
+}
+
+const char * DeadCodePassClass::Name() const
+{
+	return "dead code elimination";
+}
+
+// Division by anything but a constant other than 0 and -1 may trap.
+static bool HasEffect(const IRInstruction * instruction)
+{
+	switch (instruction->opcode)
+	{
+	case IR_WRITE:
+	case IR_WRITE_END:
+		return true;
+	case IR_BINARY:
+		if (instruction->operation == DIVIDE_TOKEN || instruction->operation == MOD_TOKEN)
+		{
+			const IRInstruction * divisor = instruction->operands[1];
+			return divisor->opcode != IR_CONSTANT
+				|| divisor->constant == 0 || divisor->constant == -1;
+		}
+		return false;
+	default:
+		return false;
+	}
+}
+
+int DeadCodePassClass::Run(IRFunctionClass & function)
+{
+	function.ResolveReplacements();
+	std::set<IRInstruction *> live;
+	std::vector<IRInstruction *> work;
+	for (IRBlock * block : function.GetBlocks())
+	{
+		for (IRInstruction * instruction : block->instructions)
+		{
+			if (HasEffect(instruction))
+			{
+				work.push_back(instruction);
+			}
+		}
+		if (block->terminator == IR_BRANCH)
+		{
+			work.push_back(block->condition);
+		}
+	}
+	while (!work.empty())
+	{
+		IRInstruction * instruction = work.back();
+		work.pop_back();
+		if (!live.insert(instruction).second)
+		{
+			continue;
+		}
+		for (IRInstruction * operand : instruction->operands)
+		{
+			work.push_back(operand);
+		}
+	}
+
+	int changes = 0;
+	for (IRBlock * block : function.GetBlocks())
+	{
+		for (std::vector<IRInstruction *> * list : { &block->phis, &block->instructions })
+		{
+			std::vector<IRInstruction *> kept;
+			for (IRInstruction * instruction : *list)
+			{
+				if (live.count(instruction))
+				{
+					kept.push_back(instruction);
+				}
+			}
+			changes += (int)(list->size() - kept.size());
+			list->swap(kept);
+		}
+	}
+	return changes;
+}
+
+PassManagerClass::PassManagerClass()
+	: mRounds(0)
+{
+}
+
+PassManagerClass::~PassManagerClass()
+{
+	for (IRPassClass * pass : mPasses)
+	{
+		delete pass;
+	}
+}
+
+void PassManagerClass::AddPass(IRPassClass * pass)
+{
+	mPasses.push_back(pass);
+	mChanges.push_back(0);
+}
+
+void PassManagerClass::AddStandardPasses()
+{
+	AddPass(new ConstantFoldingPassClass);
+	AddPass(new DeadCodePassClass);
+}
+
+// Each pass may uncover work for the others. The limit only guards
+// against a pass that never settles.
+void PassManagerClass::Run(IRFunctionClass & function)
+{
+	const int MAX_ROUNDS = 16;
+	for (int round = 0; round < MAX_ROUNDS; round++)
+	{
+		mRounds++;
+		int changes = 0;
+		for (size_t i = 0; i < mPasses.size(); i++)
+		{
+			int made = mPasses[i]->Run(function);
+			mChanges[i] += made;
+			changes += made;
+		}
+		if (!changes)
+		{
+			break;
+		}
+	}
+	function.ResolveReplacements();
+}
+
+void PassManagerClass::PrintStatistics() const
+{
+	std::cout << "IR passes, " << mRounds << " rounds:" << std::endl;
+	for (size_t i = 0; i < mPasses.size(); i++)
+	{
+		std::cout << "  " << mPasses[i]->Name() << ": " << mChanges[i] << std::endl;
+	}
+}
@@ -0,0 +1,55 @@
+#pragma once
+#include <vector>
+#include <string>
+#include "IR.h"
+
+// A transformation of the SSA IR. Run returns how many changes it made,
+// zero once there is nothing left for it to do.
+class IRPassClass
+{
+public:
+	virtual ~IRPassClass() {}
+	virtual const char * Name() const = 0;
+	virtual int Run(IRFunctionClass & function) = 0;
+};
+
+// Folds binary operators on constants and identities like x + 0, drops
+// phis that merge only one value, and turns branches on constants into
+// jumps, removing the blocks that can no longer be reached.
+class ConstantFoldingPassClass : public IRPassClass
+{
+public:
+	virtual const char * Name() const override;
+	virtual int Run(IRFunctionClass & function) override;
+};
+
+// Removes values nothing observable depends on. Output, branch
+// conditions and divisions that may trap are what is observable.
+class DeadCodePassClass : public IRPassClass
+{
+public:
+	virtual const char * Name() const override;
+	virtual int Run(IRFunctionClass & function) override;
+};
+
+// Runs its passes in order, round after round, until a whole round
+// changes nothing. Owns the passes.
+class PassManagerClass
+{
+public:
+	PassManagerClass();
+	~PassManagerClass();
+	PassManagerClass(const PassManagerClass &) = delete;
+	PassManagerClass & operator=(const PassManagerClass &) = delete;
+
+	void AddPass(IRPassClass * pass);
+	// Constant folding, then dead code elimination.
+	void AddStandardPasses();
+	void Run(IRFunctionClass & function);
+	void PrintStatistics() const;
+
+private:
+	std::vector<IRPassClass *> mPasses;
+	std::vector<int> mChanges; // per pass, over all rounds
+	int mRounds;
+};
@@ -1,5 +1,6 @@
 #include "Scanner.h"
 #include "Debug.h"
+#include <stdexcept>
 
 ScannerClass::ScannerClass(const std::string &inputFileName) {
     MSG("Initializing ScannerClass object...");
@@ -9,9 +10,7 @@ ScannerClass::ScannerClass(const std::string &inputFileName) {
     mFin.open(inputFileName.c_str(), std::ios::binary);
 
     if (!mFin) {
-        std::cerr << "Error opening input file: " << inputFileName << '\n';
-        std::cerr << "Ensure the file exists and is in the same directory as Scanner.cpp\n";
-        std::exit(1);
+        throw std::runtime_error("Could not open the input file " + inputFileName + ".");
     }
 }
 
@@ -111,8 +110,8 @@ TokenClass ScannerClass::GetNextToken(){
     }
 
     if (previousTokenType == BAD_TOKEN){
-        std::cerr << "Error. BAD_TOKEN from lexeme:" << lexeme;
-        std::exit(1);
+        throw std::runtime_error("BAD_TOKEN from lexeme \"" + lexeme + "\" on line "
+            + std::to_string(mLineNumber) + ".");
     }
     MSG("Final lexeme before unget: \"" << lexeme << "\"");
     MSG("Final token type from mapping: " << previousTokenType << " (" << gTokenTypeNames[previousTokenType] << ")");
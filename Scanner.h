@@ -7,6 +7,8 @@
 
 class ScannerClass {
     public:
+        // Throws std::runtime_error when the file cannot be opened, and
+        // GetNextToken when it meets a bad token.
         ScannerClass(const std::string &inputFileName);
 
         ~ScannerClass();
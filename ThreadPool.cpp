@@ -0,0 +1,76 @@
+#include <iostream>
+#include <cstdlib>
+#include <thread>
+#include "ThreadPool.h"
+
+ThreadPoolClass::ThreadPoolClass(int threads)
+	: mNextQueue(0)
+{
+	if (threads < 1)
+	{
+		std::cerr << "Error.  A thread pool needs at least one thread." << std::endl;
+		exit(1);
+	}
+	for (int i = 0; i < threads; i++)
+	{
+		mQueues.push_back(std::unique_ptr<WorkQueue>(new WorkQueue));
+	}
+}
+
+void ThreadPoolClass::Add(const std::function<void()> & task)
+{
+	mQueues[mNextQueue]->tasks.push_back(task);
+	mNextQueue = (mNextQueue + 1) % (int)mQueues.size();
+}
+
+// Its own queue first, newest task first; then the oldest task of each
+// other queue in turn. Nothing is added while the pool runs, so once
+// every queue is empty there is nothing left to wait for.
+bool ThreadPoolClass::Take(int worker, std::function<void()> & task)
+{
+	int count = (int)mQueues.size();
+	for (int i = 0; i < count; i++)
+	{
+		WorkQueue & queue = *mQueues[(worker + i) % count];
+		std::lock_guard<std::mutex> lock(queue.mutex);
+		if (queue.tasks.empty())
+		{
+			continue;
+		}
+		if (i == 0)
+		{
+			task = queue.tasks.back();
+			queue.tasks.pop_back();
+		}
+		else
+		{
+			task = queue.tasks.front();
+			queue.tasks.pop_front();
+		}
+		return true;
+	}
+	return false;
+}
+
+void ThreadPoolClass::Work(int worker)
+{
+	std::function<void()> task;
+	while (Take(worker, task))
+	{
+		task();
+	}
+}
+
+void ThreadPoolClass::Run()
+{
+	std::vector<std::thread> threads;
+	for (int worker = 1; worker < (int)mQueues.size(); worker++)
+	{
+		threads.push_back(std::thread(&ThreadPoolClass::Work, this, worker));
+	}
+	Work(0);
+	for (std::thread & thread : threads)
+	{
+		thread.join();
+	}
+}
@@ -0,0 +1,36 @@
+#pragma once
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+// Runs tasks on a fixed number of threads. Every thread has a queue of
+// its own: it takes its next task from the back, and once that is empty
+// steals from the front of the others', so threads that drew short tasks
+// help out the ones that drew long ones. All tasks are added before Run.
+class ThreadPoolClass
+{
+public:
+	ThreadPoolClass(int threads);
+	ThreadPoolClass(const ThreadPoolClass &) = delete;
+	ThreadPoolClass & operator=(const ThreadPoolClass &) = delete;
+	// Tasks are dealt out to the threads' queues in turn.
+	void Add(const std::function<void()> & task);
+	// Runs every task added, on the calling thread too, and returns when
+	// all of them are done.
+	void Run();
+
+private:
+	struct WorkQueue
+	{
+		std::mutex mutex;
+		std::deque<std::function<void()> > tasks;
+	};
+
+	bool Take(int worker, std::function<void()> & task);
+	void Work(int worker);
+
+	std::vector<std::unique_ptr<WorkQueue> > mQueues; // one per thread
+	int mNextQueue;
+};
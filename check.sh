@@ -0,0 +1,121 @@
+#!/bin/bash
+# Runs the sample programs that say what they print, and checks that
+# they print it, coded from the AST, through the SSA IR and without the
+# optional rewrites. A sample lists its output in comment lines that follow
+# a "// Expected output:" line.
+#
+# Usage: ./check.sh [sample...]    (make check runs them all)
+
+cd "$(dirname "$0")" || exit 1
+MAIN=./main
+
+# Keep the code cache to ourselves.
+export XDG_CACHE_HOME=$(mktemp -d)
+trap 'rm -rf "$XDG_CACHE_HOME"' EXIT
+
+failures=0
+
+# The output a sample lists.
+expected() {
+    awk '/^\/\/ Expected output:$/ { listing = 1; next }
+         listing && /^\/\// { sub(/^\/\/ ?/, ""); print; next }
+         { listing = 0 }' "$1"
+}
+
+# What a run printed, without the closing message, trailing blanks and
+# blank lines at the end.
+normalize() {
+    awk '{ sub(/[ \t]+$/, "") }
+         $0 == "There and back again!" { next }
+         { lines[n++] = $0 }
+         END { while (n > 0 && lines[n - 1] == "") n--
+               for (i = 0; i < n; i++) print lines[i] }'
+}
+
+# check name expected actual
+check() {
+    if [ "$2" == "$3" ]; then
+        echo "ok    $1"
+    else
+        echo "FAIL  $1"
+        diff <(echo "$2") <(echo "$3") | head -20
+        failures=$((failures + 1))
+    fi
+}
+
+for sample in ${@:-*.txt}; do
+    grep -q '^// Expected output:$' "$sample" || continue
+    want=$(expected "$sample")
+    check "$sample" "$want" "$($MAIN "$sample" 2>&1 | normalize)"
+    check "$sample, -i" "$want" "$($MAIN -i "$sample" 2>&1 | normalize)"
+    check "$sample, as first coded" "$want" \
+        "$($MAIN -u 0 --no-peephole --no-relax "$sample" 2>&1 | normalize)"
+
+    # Written out ahead of time, and run on its own.
+    executable=$XDG_CACHE_HOME/a.out
+    rm -f "$executable"
+    $MAIN -o "$executable" "$sample"
+    check "$sample, -o" "$want" "$("$executable" 2>&1 | normalize)"
+done
+
+# The rest runs one sample in other ways, when not given samples to run.
+if [ $# -eq 0 ]; then
+    sample=power_test.txt
+    want=$(expected "$sample")
+
+    # The code cache: --no-cache neither reads nor writes it, the first
+    # run codes the program and stores it, the second loads it and leaves
+    # the entry alone, and a changed source is a new entry.
+    cache=$XDG_CACHE_HOME/simple-compiler
+    rm -rf "$cache"
+    check "$sample, --no-cache" "$want" "$($MAIN --no-cache "$sample" 2>&1 | normalize)"
+    check "$sample, --no-cache left no cache" "" "$(ls -d "$cache" 2>/dev/null)"
+    check "$sample, cache miss" "$want" "$($MAIN "$sample" 2>&1 | normalize)"
+    entry=$(stat -c '%i %Y' "$cache"/* 2>&1)
+    check "$sample, cache hit" "$want" "$($MAIN "$sample" 2>&1 | normalize)"
+    check "$sample, cache entry kept" "$entry" "$(stat -c '%i %Y' "$cache"/* 2>&1)"
+    changed=$XDG_CACHE_HOME/changed.txt
+    { cat "$sample"; echo "// changed"; } > "$changed"
+    check "$sample, changed" "$want" "$($MAIN "$changed" 2>&1 | normalize)"
+    check "$sample, changed cached apart" "2" "$(ls "$cache" | wc -l)"
+
+    # Compiled once and run three times.
+    check "$sample, -n 3" "$(printf '%s\n' "$want" "$want" "$want")" \
+        "$($MAIN -n 3 "$sample" 2>&1 | normalize)"
+
+    # Eight runs on four threads at once. Each run's output is well
+    # under a buffer, so it comes out in one piece.
+    check "$sample, -n 8 -j 4" "$(for i in 1 2 3 4 5 6 7 8; do echo "$want"; done)" \
+        "$($MAIN -n 8 -j 4 "$sample" 2>&1 | normalize)"
+
+    # The reports come ahead of the output, one for each pass that ran.
+    check "$sample, -s" "Optimizer: Peephole:" \
+        "$($MAIN -s "$sample" 2>&1 | grep -oE '^(Optimizer:|IR passes,|Peephole:)' | tr '\n' ' ' | sed 's/ $//')"
+    check "$sample, -i -s" "Optimizer: IR passes, Peephole:" \
+        "$($MAIN -i -s "$sample" 2>&1 | grep -oE '^(Optimizer:|IR passes,|Peephole:)' | tr '\n' ' ' | sed 's/ $//')"
+
+    # A batch where one program does not parse and another divides by
+    # zero: both are reported with what they printed, the good one still
+    # runs, and the exit status says that some failed. Timings vary.
+    batch=$(cat <<'EOF'
+== batch_test/1_fibonacci.txt: compiled in N ms, ran in N ms
+1 1 2 3 5 8 13 21 34 55
+== batch_test/2_missing_semicolon.txt: failed to compile: ParserClass::Match on line 5: Expected token type SEMICOLON, but got type COUT with lexeme "cout".
+== batch_test/3_divide_by_zero.txt: compiled in N ms, failed: Division by zero, or overflow, in main.
+20
+30
+60
+== 3 programs in N ms on 2 threads, 2 failed
+exit status 1
+EOF
+)
+    check "batch_test, -b" "$batch" \
+        "$($MAIN -j 2 -b batch_test 2>&1 | normalize | sed -E 's/[0-9]+\.[0-9]+ ms/N ms/g'
+           echo "exit status ${PIPESTATUS[0]}")"
+fi
+
+if [ $failures -ne 0 ]; then
+    echo "$failures failed."
+    exit 1
+fi
+echo "All samples passed."